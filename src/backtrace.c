@@ -24,27 +24,48 @@
 #ifdef HAVE_BACKTRACE_SUPPORT
 
 #include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdint.h>
 #include <sys/resource.h>
+#include <ucontext.h>
 
 #define MIN_STACK_FRAMES        3
 #define MAX_STACK_FRAMES        64
 
+// The report is formatted into this and written out with write(2) whenever it fills up
+#define CRASH_BUFFER_SIZE       8192
+
+// Enough for backtrace(3) and the report itself when the main stack has overflowed
+#define CRASH_ALTSTACK_SIZE     65536
+
 #ifdef DATADIR
 #define CRASHLOG_FILE           DATADIR "/crash.log"
 #endif /* DATADIR */
 
 #ifdef CRASHLOG_FILE
-static FILE *crashfp            = NULL;
+static int crashfd              = -1;
 #else /* CRASHLOG_FILE */
-static FILE *const crashfp      = stderr;
+static const int crashfd        = STDERR_FILENO;
 #endif /* !CRASHLOG_FILE */
 
+static int mapsfd               = -1;
+
+static char crashbuf[CRASH_BUFFER_SIZE];
+static size_t crashlen          = 0;
+
+static char crashstack[CRASH_ALTSTACK_SIZE];
+static char crashconfopts[BUFSIZE];
+
 static struct sigaction oldbusaction;
 static struct sigaction oldfpeaction;
 static struct sigaction oldillaction;
 static struct sigaction oldsegvaction;
 
+static stack_t oldaltstack;
+static bool altstack_installed  = false;
+
 static bool
 contrib_backtrace_signal_map(const int signum, const siginfo_t *const restrict info,
                              const char **const restrict fault_type,
@@ -237,13 +258,180 @@ contrib_backtrace_signal_map(const int signum, const siginfo_t *const restrict i
 		return true;
 	}
 
-	(void) slog(LG_ERROR, "%s: unrecognised signal %d", __func__, signum);
+	// Only reachable from the signal handler, so nothing is logged here
 	return false;
 }
 
+/* Everything below runs in the signal handler, after an arbitrary fault, possibly
+ * inside malloc(3) or stdio; only async-signal-safe functions may be used here.
+ */
+
+static void
+crash_flush(void)
+{
+	size_t written = 0;
+
+	while (written < crashlen)
+	{
+		const ssize_t ret = write(crashfd, crashbuf + written, crashlen - written);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			break;
+
+		written += (size_t) ret;
+	}
+
+	crashlen = 0;
+}
+
+static void
+crash_write(const char *restrict str, size_t len)
+{
+	while (len)
+	{
+		if (crashlen == sizeof crashbuf)
+			(void) crash_flush();
+
+		const size_t chunk = ((sizeof crashbuf - crashlen) < len) ? (sizeof crashbuf - crashlen) : len;
+
+		(void) memcpy(crashbuf + crashlen, str, chunk);
+
+		crashlen += chunk;
+		str += chunk;
+		len -= chunk;
+	}
+}
+
+static void
+crash_puts(const char *const restrict str)
+{
+	(void) crash_write(str, strlen(str));
+}
+
+static void
+crash_putnum(uintmax_t value, const unsigned int base, const unsigned int width)
+{
+	static const char digits[] = "0123456789abcdef";
+	char tmp[(sizeof value * CHAR_BIT) + 1];
+	size_t pos = sizeof tmp;
+
+	do
+	{
+		tmp[--pos] = digits[value % base];
+		value /= base;
+	} while (value && pos);
+
+	while (pos && (sizeof tmp - pos) < width)
+		tmp[--pos] = '0';
+
+	(void) crash_write(tmp + pos, sizeof tmp - pos);
+}
+
+static void
+crash_puthex(const uintptr_t value)
+{
+	(void) crash_puts("0x");
+	(void) crash_putnum(value, 16, sizeof value * 2);
+}
+
+static void
+crash_dump_registers(const ucontext_t *const restrict uc)
+{
+	(void) crash_puts("Registers:\n");
+
+#if defined(__x86_64__) && defined(REG_RIP)
+	static const struct { const char *name; int reg; } regs[] = {
+		{ "RIP", REG_RIP }, { "RSP", REG_RSP }, { "RBP", REG_RBP },
+		{ "RAX", REG_RAX }, { "RBX", REG_RBX }, { "RCX", REG_RCX },
+		{ "RDX", REG_RDX }, { "RSI", REG_RSI }, { "RDI", REG_RDI },
+		{ "R8 ", REG_R8  }, { "R9 ", REG_R9  }, { "R10", REG_R10 },
+		{ "R11", REG_R11 }, { "R12", REG_R12 }, { "R13", REG_R13 },
+		{ "R14", REG_R14 }, { "R15", REG_R15 }, { "EFL", REG_EFL },
+	};
+
+	for (size_t i = 0; i < (sizeof regs / sizeof regs[0]); i++)
+	{
+		(void) crash_puts((i % 3) ? "  " : "\n  ");
+		(void) crash_puts(regs[i].name);
+		(void) crash_puts(" ");
+		(void) crash_puthex((uintptr_t) uc->uc_mcontext.gregs[regs[i].reg]);
+	}
+
+	(void) crash_puts("\n");
+#elif defined(__i386__) && defined(REG_EIP)
+	static const struct { const char *name; int reg; } regs[] = {
+		{ "EIP", REG_EIP }, { "ESP", REG_ESP }, { "EBP", REG_EBP },
+		{ "EAX", REG_EAX }, { "EBX", REG_EBX }, { "ECX", REG_ECX },
+		{ "EDX", REG_EDX }, { "ESI", REG_ESI }, { "EDI", REG_EDI },
+		{ "EFL", REG_EFL },
+	};
+
+	for (size_t i = 0; i < (sizeof regs / sizeof regs[0]); i++)
+	{
+		(void) crash_puts((i % 3) ? "  " : "\n  ");
+		(void) crash_puts(regs[i].name);
+		(void) crash_puts(" ");
+		(void) crash_puthex((uintptr_t) uc->uc_mcontext.gregs[regs[i].reg]);
+	}
+
+	(void) crash_puts("\n");
+#elif defined(__aarch64__)
+	for (unsigned int i = 0; i < 31; i++)
+	{
+		(void) crash_puts((i % 3) ? "  " : "\n  ");
+		(void) crash_puts("X");
+		(void) crash_putnum(i, 10, 2);
+		(void) crash_puts(" ");
+		(void) crash_puthex((uintptr_t) uc->uc_mcontext.regs[i]);
+	}
+
+	(void) crash_puts("\n  SP  ");
+	(void) crash_puthex((uintptr_t) uc->uc_mcontext.sp);
+	(void) crash_puts("  PC  ");
+	(void) crash_puthex((uintptr_t) uc->uc_mcontext.pc);
+	(void) crash_puts("  PST ");
+	(void) crash_puthex((uintptr_t) uc->uc_mcontext.pstate);
+	(void) crash_puts("\n");
+#else
+	(void) crash_puts("\n  Not available on this platform.\n");
+#endif
+}
+
+static void
+crash_dump_maps(void)
+{
+	(void) crash_puts("Memory Map:\n");
+	(void) crash_puts("\n");
+
+	if (mapsfd < 0 || lseek(mapsfd, 0, SEEK_SET) != 0)
+	{
+		(void) crash_puts("  Not available.\n");
+		return;
+	}
+
+	(void) crash_flush();
+
+	for (;;)
+	{
+		const ssize_t ret = read(mapsfd, crashbuf, sizeof crashbuf);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			break;
+
+		crashlen = (size_t) ret;
+		(void) crash_flush();
+	}
+}
+
 static void ATHEME_FATTR_NORETURN
 contrib_backtrace_signal_handler(const int signum, siginfo_t *const restrict info,
-                                 void ATHEME_VATTR_UNUSED *const restrict ucontext)
+                                 void *const restrict ucontext)
 {
 	const char *fault_type = "<unknown>";
 	const char *fault_code = "<unknown>";
@@ -251,71 +439,87 @@ contrib_backtrace_signal_handler(const int signum, siginfo_t *const restrict inf
 	if (! contrib_backtrace_signal_map(signum, info, &fault_type, &fault_code))
 		goto end;
 
-	char *fault_null = "<NULL>";
-	char **fault_addr = (info->si_addr) ? backtrace_symbols(&info->si_addr, 1) : &fault_null;
+	(void) crash_puts("\n");
+	(void) crash_puts("===8<===8<=== [ BEGIN CRASH REPORT ] ===>8===>8===\n");
+	(void) crash_puts("\n");
+	(void) crash_puts("Program Version ...: ");
+	(void) crash_puts(PACKAGE_STRING);
+	(void) crash_puts(" (");
+	(void) crash_puts(SERNO);
+	(void) crash_puts(")\n");
+	(void) crash_puts("Config Flags ......: ");
+	(void) crash_puts(crashconfopts);
+	(void) crash_puts("\n");
+	(void) crash_puts("Fault Type ........: ");
+	(void) crash_puts(fault_type);
+	(void) crash_puts(" (");
+	(void) crash_putnum((uintmax_t) signum, 10, 0);
+	(void) crash_puts(")\n");
+	(void) crash_puts("Fault Code ........: ");
+	(void) crash_puts(fault_code);
+	(void) crash_puts("\n");
+	(void) crash_puts("Fault Address .....: ");
+
+	if (info->si_addr)
+		(void) crash_puthex((uintptr_t) info->si_addr);
+	else
+		(void) crash_puts("<NULL>");
+
+	(void) crash_puts("\n");
+	(void) crash_puts("\n");
 
-	(void) fprintf(crashfp, "\n");
-	(void) fprintf(crashfp, "===8<===8<=== [ BEGIN CRASH REPORT ] ===>8===>8===\n");
-	(void) fprintf(crashfp, "\n");
-	(void) fprintf(crashfp, "Program Version ...: %s (%s)\n", PACKAGE_STRING, SERNO);
-	(void) fprintf(crashfp, "Config Flags ......: %s\n", get_conf_opts());
-	(void) fprintf(crashfp, "Fault Type ........: %s (%d)\n", fault_type, signum);
-	(void) fprintf(crashfp, "Fault Code ........: %s\n", fault_code);
-	(void) fprintf(crashfp, "Fault Address .....: %s\n", (fault_addr) ? *fault_addr : fault_null);
-	(void) fprintf(crashfp, "\n");
+	if (ucontext)
+	{
+		(void) crash_dump_registers(ucontext);
+		(void) crash_puts("\n");
+	}
 
 	void *frames[MAX_STACK_FRAMES];
 	const int framecount = backtrace(frames, MAX_STACK_FRAMES);
 
 	if (framecount >= MIN_STACK_FRAMES)
 	{
-		(void) fprintf(crashfp, "Backtrace:\n");
-		(void) fprintf(crashfp, "\n");
-
-		char **symbols = backtrace_symbols(frames, framecount);
-
-		if (symbols)
-		{
-			for (int i = 0; i < framecount; i++)
-				(void) fprintf(crashfp, "  #%02d %s\n", i, symbols[i]);
-		}
-		else
-		{
-			for (int i = 0; i < framecount; i++)
-				(void) fprintf(crashfp, "  #%02d %p\n", i, frames[i]);
+		(void) crash_puts("Backtrace:\n");
+		(void) crash_puts("\n");
+		(void) crash_flush();
 
-			(void) fprintf(crashfp, "\n");
-			(void) fprintf(crashfp, "No symbols available.\n");
-		}
+		// Unlike backtrace_symbols(3), this does not allocate
+		(void) backtrace_symbols_fd(frames, framecount, crashfd);
 	}
 	else
-		(void) fprintf(crashfp, "No backtrace available.\n");
+		(void) crash_puts("No backtrace available.\n");
 
-	(void) fprintf(crashfp, "\n");
+	(void) crash_puts("\n");
+	(void) crash_dump_maps();
+	(void) crash_puts("\n");
 
 	if (IS_TAINTED)
 	{
-		(void) fprintf(crashfp, "Your installation is tainted; support is unavailable.\n");
+		(void) crash_puts("Your installation is tainted; support is unavailable.\n");
 	}
 	else
 	{
 #ifdef PACKAGE_BUGREPORT
-		(void) fprintf(crashfp, "Please file a bug report for this crash:\n");
-		(void) fprintf(crashfp, "  <%s>\n", PACKAGE_BUGREPORT);
+		(void) crash_puts("Please file a bug report for this crash:\n");
+		(void) crash_puts("  <");
+		(void) crash_puts(PACKAGE_BUGREPORT);
+		(void) crash_puts(">\n");
 #else /* PACKAGE_BUGREPORT */
-		(void) fprintf(crashfp, "Please file a bug report for this crash.\n");
+		(void) crash_puts("Please file a bug report for this crash.\n");
 #endif /* !PACKAGE_BUGREPORT */
 	}
 
-	(void) fprintf(crashfp, "\n");
-	(void) fprintf(crashfp, "===8<===8<==== [ END CRASH REPORT ] ====>8===>8===\n");
-	(void) fprintf(crashfp, "\n");
-	(void) fflush(crashfp);
+	(void) crash_puts("\n");
+	(void) crash_puts("===8<===8<==== [ END CRASH REPORT ] ====>8===>8===\n");
+	(void) crash_puts("\n");
+	(void) crash_flush();
 
 #ifdef CRASHLOG_FILE
-	(void) fclose(crashfp);
-	(void) fprintf(stderr, "Aborting; please see '%s'\n", CRASHLOG_FILE);
-	(void) fflush(stderr);
+	(void) close(crashfd);
+
+	static const char aborting[] = "Aborting; please see '" CRASHLOG_FILE "'\n";
+
+	(void) write(STDERR_FILENO, aborting, sizeof aborting - 1);
 #endif /* CRASHLOG_FILE */
 
 end:
@@ -323,6 +527,28 @@ end:
 	abort();
 }
 
+// Idempotent, so it can serve both the failure paths of mod_init() and mod_deinit()
+static void
+contrib_backtrace_release(void)
+{
+	if (altstack_installed)
+		(void) sigaltstack(&oldaltstack, NULL);
+
+	altstack_installed = false;
+
+	if (mapsfd >= 0)
+		(void) close(mapsfd);
+
+	mapsfd = -1;
+
+#ifdef CRASHLOG_FILE
+	if (crashfd >= 0)
+		(void) close(crashfd);
+
+	crashfd = -1;
+#endif /* CRASHLOG_FILE */
+}
+
 static void
 mod_init(module_t *const restrict m)
 {
@@ -349,12 +575,37 @@ mod_init(module_t *const restrict m)
 	else
 		(void) slog(LG_INFO, "%s: coredumps cannot be enabled", m->name);
 
+	// The first backtrace(3) call loads libgcc, which allocates; do that now rather than in the handler
+	void *warmup[1];
+	(void) backtrace(warmup, 1);
+
+	// get_conf_opts() formats into a static buffer with snprintf(3); capture its result ahead of time
+	(void) mowgli_strlcpy(crashconfopts, get_conf_opts(), sizeof crashconfopts);
+
+	if ((mapsfd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC)) < 0)
+		(void) slog(LG_INFO, "%s: open('/proc/self/maps') failed: %s; crash reports will not include "
+		                     "the memory map", m->name, strerror(errno));
+
+	const stack_t altstack = {
+		.ss_sp          = crashstack,
+		.ss_size        = sizeof crashstack,
+		.ss_flags       = 0,
+	};
+
+	if (sigaltstack(&altstack, &oldaltstack) != 0)
+		(void) slog(LG_INFO, "%s: sigaltstack(2) failed: %s; stack overflows will not be reported",
+		                     m->name, strerror(errno));
+	else
+		altstack_installed = true;
+
 	sigset_t masked_signals;
 
 	if (sigfillset(&masked_signals) != 0)
 	{
 		(void) slog(LG_ERROR, "%s: sigfillset(3) failed: %s", m->name, strerror(errno));
 
+		(void) contrib_backtrace_release();
+
 		m->mflags |= MODFLAG_FAIL;
 		return;
 	}
@@ -362,13 +613,15 @@ mod_init(module_t *const restrict m)
 	const struct sigaction newsigaction = {
 		.sa_sigaction   = &contrib_backtrace_signal_handler,
 		.sa_mask        = masked_signals,
-		.sa_flags       = SA_SIGINFO,
+		.sa_flags       = SA_SIGINFO | SA_ONSTACK,
 	};
 
 	if (sigaction(SIGBUS, &newsigaction, &oldbusaction) != 0)
 	{
 		(void) slog(LG_ERROR, "%s: sigaction(2) for SIGBUS failed: %s", m->name, strerror(errno));
 
+		(void) contrib_backtrace_release();
+
 		m->mflags |= MODFLAG_FAIL;
 		return;
 	}
@@ -378,6 +631,8 @@ mod_init(module_t *const restrict m)
 
 		(void) sigaction(SIGBUS, &oldbusaction, NULL);
 
+		(void) contrib_backtrace_release();
+
 		m->mflags |= MODFLAG_FAIL;
 		return;
 	}
@@ -388,6 +643,8 @@ mod_init(module_t *const restrict m)
 		(void) sigaction(SIGBUS, &oldbusaction, NULL);
 		(void) sigaction(SIGFPE, &oldfpeaction, NULL);
 
+		(void) contrib_backtrace_release();
+
 		m->mflags |= MODFLAG_FAIL;
 		return;
 	}
@@ -399,20 +656,24 @@ mod_init(module_t *const restrict m)
 		(void) sigaction(SIGFPE, &oldfpeaction, NULL);
 		(void) sigaction(SIGILL, &oldillaction, NULL);
 
+		(void) contrib_backtrace_release();
+
 		m->mflags |= MODFLAG_FAIL;
 		return;
 	}
 
 #ifdef CRASHLOG_FILE
-	if (! (crashfp = fopen(CRASHLOG_FILE, "w")))
+	if ((crashfd = open(CRASHLOG_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0)
 	{
-		(void) slog(LG_ERROR, "%s: fopen('%s') failed: %s", m->name, CRASHLOG_FILE, strerror(errno));
+		(void) slog(LG_ERROR, "%s: open('%s') failed: %s", m->name, CRASHLOG_FILE, strerror(errno));
 
 		(void) sigaction(SIGBUS, &oldbusaction, NULL);
 		(void) sigaction(SIGFPE, &oldfpeaction, NULL);
 		(void) sigaction(SIGILL, &oldillaction, NULL);
 		(void) sigaction(SIGSEGV, &oldsegvaction, NULL);
 
+		(void) contrib_backtrace_release();
+
 		m->mflags |= MODFLAG_FAIL;
 		return;
 	}
@@ -431,9 +692,7 @@ mod_deinit(const module_unload_intent_t ATHEME_VATTR_UNUSED intent)
 	(void) sigaction(SIGILL, &oldillaction, NULL);
 	(void) sigaction(SIGSEGV, &oldsegvaction, NULL);
 
-#ifdef CRASHLOG_FILE
-	(void) fclose(crashfp);
-#endif /* CRASHLOG_FILE */
+	(void) contrib_backtrace_release();
 }
 
 #else /* HAVE_BACKTRACE_SUPPORT */
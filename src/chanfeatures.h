@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2026 Atheme Development Group (https://atheme.github.io/)
+ * Rights to this code are documented in doc/LICENSE.
+ *
+ * Interface to contrib/cs_chanfeatures, which owns the one channel_message
+ * hook shared by the contrib modules that act on channel text.
+ */
+
+#ifndef CONTRIB_CHANFEATURES_H
+#define CONTRIB_CHANFEATURES_H
+
+enum chanfeature_id
+{
+	CHANFEATURE_BADWORDS,
+	CHANFEATURE_KICKDOTS,
+	CHANFEATURE_BABBLER,
+	CHANFEATURE_COUNT
+};
+
+struct chanfeature
+{
+	/* the channel has the feature enabled while this metadata entry exists */
+	const char *metadata;
+
+	/* called only for registered channels that have the feature enabled */
+	void (*message)(hook_cmessage_data_t *data, mychan_t *mc);
+
+	/* optional; called whenever the channel's features are re-read */
+	void (*refresh)(mychan_t *mc, bool enabled);
+};
+
+struct chanfeatures_api
+{
+	void (*attach)(enum chanfeature_id id, const struct chanfeature *feature);
+	void (*detach)(enum chanfeature_id id);
+
+	/* call after changing a channel's feature metadata; nothing else notices
+	 * until the periodic recheck
+	 */
+	void (*invalidate)(mychan_t *mc);
+};
+
+#endif /* CONTRIB_CHANFEATURES_H */
@@ -11,10 +11,27 @@
 #  include "template.h"
 #endif
 
-typedef struct {
-	const char *res;
+/* level -> template name, sorted by level. Channel maps are kept in the
+ * channel's private data and rebuilt when private:templates changes; the
+ * global map is rebuilt when the configuration is reloaded.
+ */
+struct template_map_entry {
 	unsigned int level;
-} template_iter_t;
+	char *name;
+};
+
+struct template_map {
+	mychan_t *mc;
+	char *source;
+	struct template_map_entry *entries;
+	size_t count;
+	mowgli_node_t node;
+};
+
+#define TEMPLATE_MAP_PRIVDATA   "access_alias:templates"
+
+static mowgli_list_t template_maps;
+static struct template_map global_template_map;
 
 static void
 compat_cmd(sourceinfo_t *si, const char *cmdname, char *channel, char *arg1, char *arg2, char *arg3)
@@ -38,63 +55,180 @@ compat_cmd(sourceinfo_t *si, const char *cmdname, char *channel, char *arg1, cha
 }
 
 static int
-global_template_search(const char *key, void *data, void *privdata)
+template_map_cmp(const void *a, const void *b)
 {
-	template_iter_t *iter = privdata;
-	default_template_t *def_t = data;
+	const struct template_map_entry *ea = a, *eb = b;
+
+	return (ea->level > eb->level) - (ea->level < eb->level);
+}
 
-	if (def_t->flags == iter->level)
-		iter->res = key;
+static struct template_map_entry *
+template_map_find(struct template_map *tm, unsigned int level)
+{
+	struct template_map_entry key = { .level = level };
 
-	return 0;
+	if (tm->count == 0)
+		return NULL;
+
+	return bsearch(&key, tm->entries, tm->count, sizeof *tm->entries, template_map_cmp);
 }
 
-static const char *
-get_template_name(mychan_t *mc, unsigned int level)
+/* adds an entry; on a duplicate level the first name is kept unless replace is set */
+static void
+template_map_add(struct template_map *tm, unsigned int level, const char *name, size_t namelen, bool replace)
+{
+	struct template_map_entry *e;
+	size_t i;
+
+	for (i = 0; i < tm->count; i++)
+	{
+		e = &tm->entries[i];
+
+		if (e->level != level)
+			continue;
+
+		if (replace)
+		{
+			sfree(e->name);
+			e->name = smalloc(namelen + 1);
+			memcpy(e->name, name, namelen);
+			e->name[namelen] = '\0';
+		}
+
+		return;
+	}
+
+	tm->entries = srealloc(tm->entries, (tm->count + 1) * sizeof *tm->entries);
+	e = &tm->entries[tm->count++];
+	e->level = level;
+	e->name = smalloc(namelen + 1);
+	memcpy(e->name, name, namelen);
+	e->name[namelen] = '\0';
+}
+
+static void
+template_map_clear(struct template_map *tm)
+{
+	size_t i;
+
+	for (i = 0; i < tm->count; i++)
+		sfree(tm->entries[i].name);
+
+	sfree(tm->entries);
+	sfree(tm->source);
+
+	tm->entries = NULL;
+	tm->source = NULL;
+	tm->count = 0;
+}
+
+/* parses "name=flags name=flags ..." as stored in private:templates */
+static void
+template_map_parse(struct template_map *tm, const char *value)
 {
-	metadata_t *md;
 	const char *p, *q, *r;
-	char *s;
 	char ss[40];
-	static char flagname[400];
-	template_iter_t iter;
 
-	md = metadata_find(mc, "private:templates");
-	if (md != NULL)
+	p = value;
+	while (p != NULL)
 	{
-		p = md->value;
-		while (p != NULL)
+		while (*p == ' ')
+			p++;
+		q = strchr(p, '=');
+		if (q == NULL)
+			break;
+		r = strchr(q, ' ');
+		if (r != NULL && r < q)
+			break;
+		mowgli_strlcpy(ss, q, sizeof ss);
+		if (r != NULL && r - q < (int)(sizeof ss - 1))
 		{
-			while (*p == ' ')
-				p++;
-			q = strchr(p, '=');
-			if (q == NULL)
-				break;
-			r = strchr(q, ' ');
-			if (r != NULL && r < q)
-				break;
-			mowgli_strlcpy(ss, q, sizeof ss);
-			if (r != NULL && r - q < (int)(sizeof ss - 1))
-			{
-				ss[r - q] = '\0';
-			}
-			if (level == flags_to_bitmask(ss, 0))
-			{
-				mowgli_strlcpy(flagname, p, sizeof flagname);
-				s = strchr(flagname, '=');
-				if (s != NULL)
-					*s = '\0';
-				return flagname;
-			}
-			p = r;
+			ss[r - q] = '\0';
 		}
+		template_map_add(tm, flags_to_bitmask(ss, 0), p, q - p, false);
+		p = r;
 	}
 
-	iter.res = NULL;
-	iter.level = level;
-	mowgli_patricia_foreach(global_template_dict, global_template_search, &iter);
+	if (tm->count)
+		qsort(tm->entries, tm->count, sizeof *tm->entries, template_map_cmp);
+}
 
-	return iter.res;
+static struct template_map *
+template_map_of(mychan_t *mc)
+{
+	struct template_map *tm;
+	metadata_t *md;
+
+	md = metadata_find(mc, "private:templates");
+
+	if ((tm = privatedata_get(mc, TEMPLATE_MAP_PRIVDATA)) == NULL)
+	{
+		tm = smalloc(sizeof *tm);
+		memset(tm, 0, sizeof *tm);
+		tm->mc = mc;
+		privatedata_set(mc, TEMPLATE_MAP_PRIVDATA, tm);
+		mowgli_node_add(tm, &tm->node, &template_maps);
+	}
+	else if (md == NULL ? tm->source == NULL : (tm->source != NULL && !strcmp(tm->source, md->value)))
+		return tm;
+
+	template_map_clear(tm);
+
+	if (md != NULL)
+	{
+		tm->source = sstrdup(md->value);
+		template_map_parse(tm, md->value);
+	}
+
+	return tm;
+}
+
+static void
+template_map_drop(mychan_t *mc)
+{
+	struct template_map *tm;
+
+	if ((tm = privatedata_delete(mc, TEMPLATE_MAP_PRIVDATA)) == NULL)
+		return;
+
+	template_map_clear(tm);
+	mowgli_node_delete(&tm->node, &template_maps);
+	sfree(tm);
+}
+
+static int
+global_template_add(const char *key, void *data, void *privdata)
+{
+	default_template_t *def_t = data;
+
+	/* the last template in dictionary order wins, as it always has */
+	template_map_add(&global_template_map, def_t->flags, key, strlen(key), true);
+
+	return 0;
+}
+
+static void
+global_template_map_rebuild(void *unused)
+{
+	template_map_clear(&global_template_map);
+	mowgli_patricia_foreach(global_template_dict, global_template_add, NULL);
+
+	if (global_template_map.count)
+		qsort(global_template_map.entries, global_template_map.count, sizeof *global_template_map.entries, template_map_cmp);
+}
+
+static const char *
+get_template_name(struct template_map *tm, unsigned int level)
+{
+	struct template_map_entry *e;
+
+	if ((e = template_map_find(tm, level)) != NULL)
+		return e->name;
+
+	if ((e = template_map_find(&global_template_map, level)) != NULL)
+		return e->name;
+
+	return NULL;
 }
 
 static void
@@ -102,6 +236,7 @@ access_list(sourceinfo_t *si, mychan_t *mc, int parc, char *parv[])
 {
 	mowgli_node_t *n;
 	chanacs_t *ca;
+	struct template_map *tm;
 	const char *str1, *str2;
 	int i = 1;
 	bool operoverride = false;
@@ -120,6 +255,8 @@ access_list(sourceinfo_t *si, mychan_t *mc, int parc, char *parv[])
 		}
 	}
 
+	tm = template_map_of(mc);
+
 	command_success_nodata(si, _("Entry Nickname/Host          Flags"));
 	command_success_nodata(si, "----- ---------------------- -----");
 
@@ -129,7 +266,7 @@ access_list(sourceinfo_t *si, mychan_t *mc, int parc, char *parv[])
 		/* Change: don't show akicks */
 		if (ca->level == CA_AKICK)
 			continue;
-		str1 = get_template_name(mc, ca->level);
+		str1 = get_template_name(tm, ca->level);
 		str2 = ca->tmodified ? time_ago(ca->tmodified) : "?";
 		if (str1 != NULL)
 			command_success_nodata(si, _("%-5d %-22s %s (%s) [modified %s ago]"), i, ca->entity ? ca->entity->name : ca->host, bitmask_to_flags(ca->level), str1,
@@ -210,13 +347,31 @@ static command_t cs_access = {
 static void
 mod_init(module_t *const restrict m)
 {
+	global_template_map_rebuild(NULL);
+
+	hook_add_event("config_ready");
+	hook_add_config_ready(global_template_map_rebuild);
+
+	hook_add_event("channel_drop");
+	hook_add_channel_drop(template_map_drop);
+
 	service_named_bind_command("chanserv", &cs_access);
 }
 
 static void
 mod_deinit(const module_unload_intent_t intent)
 {
+	mowgli_node_t *n, *tn;
+
+	hook_del_config_ready(global_template_map_rebuild);
+	hook_del_channel_drop(template_map_drop);
+
 	service_named_unbind_command("chanserv", &cs_access);
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, template_maps.head)
+		template_map_drop(((struct template_map *)n->data)->mc);
+
+	template_map_clear(&global_template_map);
 }
 
 VENDOR_DECLARE_MODULE_V1("contrib/cs_access_alias", MODULE_UNLOAD_CAPABILITY_OK, CONTRIB_VENDOR_FREENODE)
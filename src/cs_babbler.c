@@ -19,10 +19,13 @@
  * How do I use it? I have an asshole on my channel too!
  * =====================================================
  *
- * Load the module, set these options:
+ * Load the module, set these options (with /cs set #channel babbler
+ * on|off|nicks|target|source [value], or as channel properties; changes
+ * made through SET PROPERTY take effect within CHANFEATURES_RECHECK):
  *
  *  - babbler:enable to actually enable babbler
- *  - babbler:nicks, the actual ignore list of the asshole
+ *  - babbler:nicks, the actual ignore list of the asshole (nicks
+ *    separated by spaces or commas)
  *  - babbler:target, the nick of the person who needs to be pwnt
  *  - babbler:source, the nick of a psuedoclient to send the message
  *    from.
@@ -35,55 +38,222 @@
  */
 
 #include "atheme-compat.h"
+#include "chanfeatures.h"
+
+static const struct chanfeatures_api *chanfeatures = NULL;
+
+static mowgli_patricia_t **cs_set_cmdtree = NULL;
+
+/* babbler:nicks parsed into a case-mapped set; rebuilt only when the
+ * metadata value differs from the one it was parsed from
+ */
+struct babbler_nicks {
+	mychan_t *mc;
+	char *source;
+	mowgli_patricia_t *nicks;
+	mowgli_node_t node;
+};
+
+#define BABBLER_PRIVDATA        "babbler:nickset"
+
+static mowgli_list_t babbler_sets;
 
 static void
-on_channel_message(hook_cmessage_data_t *data)
+babbler_forget(mychan_t *mc)
 {
-	if (data != NULL && data->msg != NULL)
+	struct babbler_nicks *bn;
+
+	if ((bn = privatedata_delete(mc, BABBLER_PRIVDATA)) == NULL)
+		return;
+
+	mowgli_patricia_destroy(bn->nicks, NULL, NULL);
+	sfree(bn->source);
+	mowgli_node_delete(&bn->node, &babbler_sets);
+	sfree(bn);
+}
+
+static void
+babbler_refresh(mychan_t *mc, bool enabled)
+{
+	struct babbler_nicks *bn;
+	metadata_t *md;
+	char *list, *nick, *saveptr = NULL;
+
+	if (!enabled || !(md = metadata_find(mc, "babbler:nicks")))
 	{
-		mychan_t *mc = mychan_from(data->c);
-		metadata_t *md;
+		babbler_forget(mc);
+		return;
+	}
 
-		if (!mc)
+	if ((bn = privatedata_get(mc, BABBLER_PRIVDATA)) != NULL)
+	{
+		if (!strcmp(bn->source, md->value))
 			return;
 
-		if (!metadata_find(mc, "babbler:enable"))
-			return;
+		babbler_forget(mc);
+	}
 
-		if (!(md = metadata_find(mc, "babbler:nicks")))
+	bn = smalloc(sizeof *bn);
+	bn->mc = mc;
+	bn->source = sstrdup(md->value);
+	bn->nicks = mowgli_patricia_create(irccasecanon);
+
+	list = sstrdup(md->value);
+
+	for (nick = strtok_r(list, " ,", &saveptr); nick != NULL; nick = strtok_r(NULL, " ,", &saveptr))
+		mowgli_patricia_add(bn->nicks, nick, bn);
+
+	sfree(list);
+
+	privatedata_set(mc, BABBLER_PRIVDATA, bn);
+	mowgli_node_add(bn, &bn->node, &babbler_sets);
+}
+
+static void
+on_channel_message(hook_cmessage_data_t *data, mychan_t *mc)
+{
+	struct babbler_nicks *bn;
+	metadata_t *md;
+
+	if ((bn = privatedata_get(mc, BABBLER_PRIVDATA)) == NULL)
+		return;
+
+	if (mowgli_patricia_retrieve(bn->nicks, data->u->nick) != NULL)
+	{
+		char *source = NULL;
+		char *target;
+
+		if (!(md = metadata_find(mc, "babbler:target")))
 			return;
 
-		if (strstr(md->value, data->u->nick))
-		{
-			char *source = NULL;
-			char *target;
+		target = md->value;
+
+		if (!(md = metadata_find(mc, "babbler:source")))
+			source = chansvs.nick;
+		else
+			source = md->value;
+
+		msg(source, data->c->name, "%s: <%s> %s", target, data->u->nick, data->msg);
+	}
+}
 
-			if (!(md = metadata_find(mc, "babbler:target")))
-				return;
+static const struct
+{
+	const char *option;
+	const char *metadata;
+} babbler_options[] = {
+	{ "NICKS",      "babbler:nicks" },
+	{ "TARGET",     "babbler:target" },
+	{ "SOURCE",     "babbler:source" },
+};
 
-			target = md->value;
+static void
+cs_set_cmd_babbler(sourceinfo_t *si, int parc, char *parv[])
+{
+	const char *key = NULL, *value;
+	mychan_t *mc;
+	size_t i;
 
-			if (!(md = metadata_find(mc, "babbler:source")))
-				source = chansvs.nick;
-			else
-				source = md->value;
+	if (!(mc = mychan_find(parv[0])))
+	{
+		command_fail(si, fault_nosuch_target, STR_IS_NOT_REGISTERED, parv[0]);
+		return;
+	}
+
+	if (!parv[1])
+	{
+		command_fail(si, fault_needmoreparams, STR_INSUFFICIENT_PARAMS, "SET BABBLER");
+		command_fail(si, fault_needmoreparams, _("Syntax: SET <#channel> BABBLER <ON|OFF|NICKS|TARGET|SOURCE> [value]"));
+		return;
+	}
 
-			msg(source, data->c->name, "%s: <%s> %s", target, data->u->nick, data->msg);
+	if (!chanacs_source_has_flag(mc, si, CA_SET))
+	{
+		command_fail(si, fault_noprivs, STR_NOT_AUTHORIZED);
+		return;
+	}
+
+	if (!strcasecmp("ON", parv[1]))
+	{
+		metadata_add(mc, "babbler:enable", "on");
+		logcommand(si, CMDLOG_SET, "SET:BABBLER:ON: \2%s\2", mc->name);
+		command_success_nodata(si, _("The \2%s\2 flag has been set for channel \2%s\2."), "BABBLER", mc->name);
+	}
+	else if (!strcasecmp("OFF", parv[1]))
+	{
+		metadata_delete(mc, "babbler:enable");
+		logcommand(si, CMDLOG_SET, "SET:BABBLER:OFF: \2%s\2", mc->name);
+		command_success_nodata(si, _("The \2%s\2 flag has been removed for channel \2%s\2."), "BABBLER", mc->name);
+	}
+	else
+	{
+		for (i = 0; i < sizeof babbler_options / sizeof babbler_options[0] && key == NULL; i++)
+			if (!strcasecmp(babbler_options[i].option, parv[1]))
+				key = babbler_options[i].metadata;
+
+		if (key == NULL)
+		{
+			command_fail(si, fault_badparams, STR_INVALID_PARAMS, "BABBLER");
+			return;
 		}
+
+		value = parc > 2 ? parv[2] : NULL;
+
+		if (value != NULL)
+			metadata_add(mc, key, value);
+		else
+			metadata_delete(mc, key);
+
+		logcommand(si, CMDLOG_SET, "SET:BABBLER:%s: \2%s\2 %s", key, mc->name, value != NULL ? value : "");
+		command_success_nodata(si, _("\2%s\2 for channel \2%s\2 is now \2%s\2."), key, mc->name,
+			value != NULL ? value : _("unset"));
 	}
+
+	chanfeatures->invalidate(mc);
 }
 
+static command_t cs_set_babbler = {
+	.name           = "BABBLER",
+	.desc           = N_("Configures the babbler for the channel."),
+	.access         = AC_NONE,
+	.maxparc        = 3,
+	.cmd            = &cs_set_cmd_babbler,
+	.help           = { .path = "contrib/set_babbler" },
+};
+
+static const struct chanfeature babbler_feature = {
+	.metadata       = "babbler:enable",
+	.message        = &on_channel_message,
+	.refresh        = &babbler_refresh,
+};
+
 static void
 mod_init(module_t *const restrict m)
 {
-	hook_add_event("channel_message");
-	hook_add_channel_message(on_channel_message);
+	MODULE_TRY_REQUEST_SYMBOL(m, cs_set_cmdtree, "chanserv/set_core", "cs_set_cmdtree");
+	MODULE_TRY_REQUEST_SYMBOL(m, chanfeatures, "contrib/cs_chanfeatures", "chanfeatures_api");
+
+	command_add(&cs_set_babbler, *cs_set_cmdtree);
+
+	hook_add_event("channel_drop");
+	hook_add_channel_drop(babbler_forget);
+
+	chanfeatures->attach(CHANFEATURE_BABBLER, &babbler_feature);
 }
 
 static void
 mod_deinit(const module_unload_intent_t intent)
 {
-	hook_del_channel_message(on_channel_message);
+	mowgli_node_t *n, *tn;
+
+	chanfeatures->detach(CHANFEATURE_BABBLER);
+
+	command_delete(&cs_set_babbler, *cs_set_cmdtree);
+
+	hook_del_channel_drop(babbler_forget);
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, babbler_sets.head)
+		babbler_forget(((struct babbler_nicks *)n->data)->mc);
 }
 
 VENDOR_DECLARE_MODULE_V1("contrib/cs_babbler", MODULE_UNLOAD_CAPABILITY_OK, CONTRIB_VENDOR_NENOLOD)
@@ -4,6 +4,7 @@
  */
 
 #include "atheme-compat.h"
+#include "chanfeatures.h"
 
 struct badword_ {
 	char *badword;
@@ -17,6 +18,7 @@ struct badword_ {
 typedef struct badword_ badword_t;
 
 static mowgli_patricia_t **cs_set_cmdtree = NULL;
+static const struct chanfeatures_api *chanfeatures = NULL;
 
 static inline mowgli_list_t *
 badwords_list_of(mychan_t *mc)
@@ -98,90 +100,79 @@ db_h_bw(database_handle_t *db, const char *type)
 }
 
 static void
-on_channel_message(hook_cmessage_data_t *data)
+on_channel_message(hook_cmessage_data_t *data, mychan_t *mc)
 {
 	badword_t *bw;
 	mowgli_node_t *n;
 	mowgli_list_t *l;
 
-	mychan_t *mc = mychan_from(data->c);
-
-	if (mc == NULL)
-		return;
-
-	if (metadata_find(mc, "blockbadwords") == NULL)
-		return;
-
 	l = badwords_list_of(mc);
 	if (MOWGLI_LIST_LENGTH(l) == 0)
 		return;
 
 	char *kickstring = "Foul language is prohibited here.";
 
-	if (data != NULL && data->msg != NULL)
+	MOWGLI_ITER_FOREACH(n, l->head)
 	{
-		MOWGLI_ITER_FOREACH(n, l->head)
-		{
-			bw = n->data;
-			chanuser_t *cu;
-			cu = chanuser_find(data->c, data->u);
-			if (cu == NULL)
-				return;
-			if ((metadata_find(mc, "blockbadwordsops") != NULL) && ((CSTATUS_OP | CSTATUS_PROTECT | CSTATUS_OWNER) & cu->modes))
-				return;
+		bw = n->data;
+		chanuser_t *cu;
+		cu = chanuser_find(data->c, data->u);
+		if (cu == NULL)
+			return;
+		if ((metadata_find(mc, "blockbadwordsops") != NULL) && ((CSTATUS_OP | CSTATUS_PROTECT | CSTATUS_OWNER) & cu->modes))
+			return;
 
-			if (!match(bw->badword, data->msg))
+		if (!match(bw->badword, data->msg))
+		{
+			if (!strcasecmp("KICKBAN", bw->action))
 			{
-				if (!strcasecmp("KICKBAN", bw->action))
-				{
-					char hostbuf[BUFSIZE];
+				char hostbuf[BUFSIZE];
 
-					hostbuf[0] = '\0';
+				hostbuf[0] = '\0';
 
-					mowgli_strlcat(hostbuf, "*!*@", BUFSIZE);
-					mowgli_strlcat(hostbuf, data->u->vhost, BUFSIZE);
+				mowgli_strlcat(hostbuf, "*!*@", BUFSIZE);
+				mowgli_strlcat(hostbuf, data->u->vhost, BUFSIZE);
 
-					modestack_mode_param(chansvs.nick, data->c, MTYPE_ADD, 'b', hostbuf);
-					chanban_add(data->c, hostbuf, 'b');
-					kick(chansvs.me->me, data->c, data->u, kickstring);
-					return;
-				}
-				else if (!strcasecmp("KICK", bw->action))
-				{
-					kick(chansvs.me->me, data->c, data->u, kickstring);
-					return;
-				}
-				else if (!strcasecmp("WARN", bw->action))
-				{
-					notice(chansvs.nick, data->u->nick, "Foul language is prohibited on %s.", data->c->name);
-					return;
-				}
-				else if (!strcasecmp("QUIET", bw->action))
-				{
-					char hostbuf[BUFSIZE];
+				modestack_mode_param(chansvs.nick, data->c, MTYPE_ADD, 'b', hostbuf);
+				chanban_add(data->c, hostbuf, 'b');
+				kick(chansvs.me->me, data->c, data->u, kickstring);
+				return;
+			}
+			else if (!strcasecmp("KICK", bw->action))
+			{
+				kick(chansvs.me->me, data->c, data->u, kickstring);
+				return;
+			}
+			else if (!strcasecmp("WARN", bw->action))
+			{
+				notice(chansvs.nick, data->u->nick, "Foul language is prohibited on %s.", data->c->name);
+				return;
+			}
+			else if (!strcasecmp("QUIET", bw->action))
+			{
+				char hostbuf[BUFSIZE];
 
-					hostbuf[0] = '\0';
+				hostbuf[0] = '\0';
 
-					mowgli_strlcat(hostbuf, "*!*@", BUFSIZE);
-					mowgli_strlcat(hostbuf, data->u->vhost, BUFSIZE);
+				mowgli_strlcat(hostbuf, "*!*@", BUFSIZE);
+				mowgli_strlcat(hostbuf, data->u->vhost, BUFSIZE);
 
-					modestack_mode_param(chansvs.nick, data->c, MTYPE_ADD, 'q', hostbuf);
-					chanban_add(data->c, hostbuf, 'q');
-					return;
-				}
-				else if (!strcasecmp("BAN", bw->action))
-				{
-					char hostbuf[BUFSIZE];
+				modestack_mode_param(chansvs.nick, data->c, MTYPE_ADD, 'q', hostbuf);
+				chanban_add(data->c, hostbuf, 'q');
+				return;
+			}
+			else if (!strcasecmp("BAN", bw->action))
+			{
+				char hostbuf[BUFSIZE];
 
-					hostbuf[0] = '\0';
+				hostbuf[0] = '\0';
 
-					mowgli_strlcat(hostbuf, "*!*@", BUFSIZE);
-					mowgli_strlcat(hostbuf, data->u->vhost, BUFSIZE);
+				mowgli_strlcat(hostbuf, "*!*@", BUFSIZE);
+				mowgli_strlcat(hostbuf, data->u->vhost, BUFSIZE);
 
-					modestack_mode_param(chansvs.nick, data->c, MTYPE_ADD, 'b', hostbuf);
-					chanban_add(data->c, hostbuf, 'b');
-					return;
-				}
+				modestack_mode_param(chansvs.nick, data->c, MTYPE_ADD, 'b', hostbuf);
+				chanban_add(data->c, hostbuf, 'b');
+				return;
 			}
 		}
 	}
@@ -384,6 +375,7 @@ cs_set_cmd_blockbadwords(sourceinfo_t *si, int parc, char *parv[])
 		}
 
 		metadata_add(mc, "blockbadwords", "on");
+		chanfeatures->invalidate(mc);
 		logcommand(si, CMDLOG_SET, "SET:BLOCKBADWORDS:ON: \2%s\2", mc->name);
 		command_success_nodata(si, _("The \2%s\2 flag has been set for channel \2%s\2."),
 		                             "BLOCKBADWORDS", mc->name);
@@ -400,6 +392,7 @@ cs_set_cmd_blockbadwords(sourceinfo_t *si, int parc, char *parv[])
 		}
 
 		metadata_delete(mc, "blockbadwords");
+		chanfeatures->invalidate(mc);
 		logcommand(si, CMDLOG_SET, "SET:BLOCKBADWORDS:OFF: \2%s\2", mc->name);
 		command_success_nodata(si, _("The \2%s\2 flag has been removed for channel \2%s\2."),
 		                             "BLOCKBADWORDS", mc->name);
@@ -467,6 +460,11 @@ cs_set_cmd_blockbadwordsops(sourceinfo_t *si, int parc, char *parv[])
 		command_fail(si, fault_badparams, STR_INVALID_PARAMS, "BLOCKBADWORDSOPS");
 }
 
+static const struct chanfeature badwords_feature = {
+	.metadata       = "blockbadwords",
+	.message        = &on_channel_message,
+};
+
 static command_t cs_badwords = {
 	.name           = "BADWORDS",
 	.desc           = N_("Manage the list of channel bad words."),
@@ -498,6 +496,7 @@ static void
 mod_init(module_t *const restrict m)
 {
 	MODULE_TRY_REQUEST_SYMBOL(m, cs_set_cmdtree, "chanserv/set_core", "cs_set_cmdtree");
+	MODULE_TRY_REQUEST_SYMBOL(m, chanfeatures, "contrib/cs_chanfeatures", "chanfeatures_api");
 
 	if (!module_find_published("backend/opensex"))
 	{
@@ -506,8 +505,7 @@ mod_init(module_t *const restrict m)
 		return;
 	}
 
-	hook_add_event("channel_message");
-	hook_add_channel_message(on_channel_message);
+	chanfeatures->attach(CHANFEATURE_BADWORDS, &badwords_feature);
 
 	hook_add_db_write(write_badword_db);
 
@@ -521,7 +519,7 @@ mod_init(module_t *const restrict m)
 static void
 mod_deinit(const module_unload_intent_t intent)
 {
-	hook_del_channel_message(on_channel_message);
+	chanfeatures->detach(CHANFEATURE_BADWORDS);
 	hook_del_db_write(write_badword_db);
 
 	db_unregister_type_handler("BW");
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2026 Atheme Development Group (https://atheme.github.io/)
+ * Rights to this code are documented in doc/LICENSE.
+ *
+ * Shared channel_message dispatcher for cs_badwords, cs_kickdots and
+ * cs_babbler. Each registered channel keeps a bitmap of the features it
+ * has enabled, so a line in a channel without any of them costs a single
+ * private data lookup instead of a metadata search per module.
+ */
+
+#include "atheme-compat.h"
+#include "chanfeatures.h"
+
+#define CHANFEATURES_PRIVDATA   "chanfeatures:state"
+
+/* the modules' own SET commands invalidate a channel at once; metadata
+ * changed any other way (e.g. ChanServ SET PROPERTY) fires no hook and is
+ * picked up after at most CHANFEATURES_RECHECK seconds (chanserv {} block,
+ * 0 disables the periodic recheck)
+ */
+static unsigned int chanfeatures_recheck = 60;
+
+struct chanfeatures_state {
+	mychan_t *mc;
+	unsigned int bits;
+	unsigned int gen;
+	time_t checked;
+	mowgli_node_t node;
+};
+
+static const struct chanfeature *features[CHANFEATURE_COUNT];
+
+static mowgli_list_t states;
+static unsigned int generation = 1;
+
+static void
+chanfeatures_refresh(struct chanfeatures_state *st)
+{
+	unsigned int i;
+
+	st->bits = 0;
+	st->gen = generation;
+	st->checked = CURRTIME;
+
+	for (i = 0; i < CHANFEATURE_COUNT; i++)
+	{
+		bool enabled;
+
+		if (features[i] == NULL)
+			continue;
+
+		enabled = metadata_find(st->mc, features[i]->metadata) != NULL;
+
+		if (enabled)
+			st->bits |= 1U << i;
+
+		if (features[i]->refresh != NULL)
+			features[i]->refresh(st->mc, enabled);
+	}
+}
+
+static struct chanfeatures_state *
+chanfeatures_of(mychan_t *mc)
+{
+	struct chanfeatures_state *st;
+
+	if ((st = privatedata_get(mc, CHANFEATURES_PRIVDATA)) == NULL)
+	{
+		st = smalloc(sizeof *st);
+		memset(st, 0, sizeof *st);
+		st->mc = mc;
+		privatedata_set(mc, CHANFEATURES_PRIVDATA, st);
+		mowgli_node_add(st, &st->node, &states);
+	}
+	else if (st->gen == generation && (!chanfeatures_recheck || st->checked + chanfeatures_recheck > CURRTIME))
+		return st;
+
+	chanfeatures_refresh(st);
+
+	return st;
+}
+
+static void
+chanfeatures_drop(mychan_t *mc)
+{
+	struct chanfeatures_state *st;
+
+	if ((st = privatedata_delete(mc, CHANFEATURES_PRIVDATA)) == NULL)
+		return;
+
+	mowgli_node_delete(&st->node, &states);
+	sfree(st);
+}
+
+static void
+on_channel_message(hook_cmessage_data_t *data)
+{
+	struct chanfeatures_state *st;
+	unsigned int bits, i;
+	mychan_t *mc;
+
+	if (data == NULL || data->msg == NULL)
+		return;
+
+	if ((mc = mychan_from(data->c)) == NULL)
+		return;
+
+	st = chanfeatures_of(mc);
+
+	for (bits = st->bits, i = 0; bits != 0; bits >>= 1, i++)
+		if ((bits & 1) && features[i] != NULL)
+			features[i]->message(data, mc);
+}
+
+static void
+chanfeatures_invalidate(mychan_t *mc)
+{
+	struct chanfeatures_state *st;
+
+	if ((st = privatedata_get(mc, CHANFEATURES_PRIVDATA)) != NULL)
+		st->gen = generation - 1;
+}
+
+static void
+chanfeatures_attach(enum chanfeature_id id, const struct chanfeature *feature)
+{
+	return_if_fail(id < CHANFEATURE_COUNT);
+
+	features[id] = feature;
+	generation++;
+}
+
+static void
+chanfeatures_detach(enum chanfeature_id id)
+{
+	return_if_fail(id < CHANFEATURE_COUNT);
+
+	features[id] = NULL;
+	generation++;
+}
+
+/* the only exported symbol; modules fetch it with MODULE_TRY_REQUEST_SYMBOL */
+const struct chanfeatures_api chanfeatures_api = {
+	.attach         = &chanfeatures_attach,
+	.detach         = &chanfeatures_detach,
+	.invalidate     = &chanfeatures_invalidate,
+};
+
+static void
+mod_init(module_t *const restrict m)
+{
+	MODULE_TRY_REQUEST_DEPENDENCY(m, "chanserv/main");
+
+	add_uint_conf_item("CHANFEATURES_RECHECK", &chansvs.me->conf_table, 0, &chanfeatures_recheck, 0, 86400, 60);
+
+	hook_add_event("channel_message");
+	hook_add_channel_message(on_channel_message);
+
+	hook_add_event("channel_drop");
+	hook_add_channel_drop(chanfeatures_drop);
+}
+
+static void
+mod_deinit(const module_unload_intent_t intent)
+{
+	mowgli_node_t *n, *tn;
+
+	hook_del_channel_message(on_channel_message);
+	hook_del_channel_drop(chanfeatures_drop);
+
+	del_conf_item("CHANFEATURES_RECHECK", &chansvs.me->conf_table);
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, states.head)
+		chanfeatures_drop(((struct chanfeatures_state *)n->data)->mc);
+}
+
+SIMPLE_DECLARE_MODULE_V1("contrib/cs_chanfeatures", MODULE_UNLOAD_CAPABILITY_OK)
@@ -2,39 +2,114 @@
  * Copyright (c) 2006 William Pitcock
  * Rights to this code are as documented in doc/LICENSE.
  *
- * Kicks people saying "..." on channels with "kickdots" metadata set.
+ * Kicks people saying "..." on channels with "kickdots" metadata set,
+ * which ChanServ SET KICKDOTS turns on and off.
  */
 
 #include "atheme-compat.h"
+#include "chanfeatures.h"
+
+static const struct chanfeatures_api *chanfeatures = NULL;
+
+static mowgli_patricia_t **cs_set_cmdtree = NULL;
 
 static void
-on_channel_message(hook_cmessage_data_t *data)
+on_channel_message(hook_cmessage_data_t *data, mychan_t *mc)
 {
-	if (data != NULL && data->msg != NULL && !strncmp(data->msg, "...", 3))
+	if (!strncmp(data->msg, "...", 3))
 	{
-		mychan_t *mc = mychan_from(data->c);
+		kick(chansvs.me->me, data->c, data->u, data->msg);
+	}
+}
 
-		if (mc == NULL)
-			return;
+static void
+cs_set_cmd_kickdots(sourceinfo_t *si, int parc, char *parv[])
+{
+	mychan_t *mc;
+
+	if (!(mc = mychan_find(parv[0])))
+	{
+		command_fail(si, fault_nosuch_target, STR_IS_NOT_REGISTERED, parv[0]);
+		return;
+	}
+
+	if (!parv[1])
+	{
+		command_fail(si, fault_needmoreparams, STR_INSUFFICIENT_PARAMS, "SET KICKDOTS");
+		return;
+	}
+
+	if (!chanacs_source_has_flag(mc, si, CA_SET))
+	{
+		command_fail(si, fault_noprivs, STR_NOT_AUTHORIZED);
+		return;
+	}
 
+	if (!strcasecmp("ON", parv[1]))
+	{
 		if (metadata_find(mc, "kickdots"))
 		{
-			kick(chansvs.me->me, data->c, data->u, data->msg);
+			command_fail(si, fault_nochange, _("The \2%s\2 flag is already set for channel \2%s\2."),
+			                                   "KICKDOTS", mc->name);
+			return;
 		}
+
+		metadata_add(mc, "kickdots", "on");
+		chanfeatures->invalidate(mc);
+		logcommand(si, CMDLOG_SET, "SET:KICKDOTS:ON: \2%s\2", mc->name);
+		command_success_nodata(si, _("The \2%s\2 flag has been set for channel \2%s\2."),
+		                             "KICKDOTS", mc->name);
 	}
+	else if (!strcasecmp("OFF", parv[1]))
+	{
+		if (!metadata_find(mc, "kickdots"))
+		{
+			command_fail(si, fault_nochange, _("The \2%s\2 flag is not set for channel \2%s\2."),
+			                                   "KICKDOTS", mc->name);
+			return;
+		}
+
+		metadata_delete(mc, "kickdots");
+		chanfeatures->invalidate(mc);
+		logcommand(si, CMDLOG_SET, "SET:KICKDOTS:OFF: \2%s\2", mc->name);
+		command_success_nodata(si, _("The \2%s\2 flag has been removed for channel \2%s\2."),
+		                             "KICKDOTS", mc->name);
+	}
+	else
+		command_fail(si, fault_badparams, STR_INVALID_PARAMS, "KICKDOTS");
 }
 
+static command_t cs_set_kickdots = {
+	.name           = "KICKDOTS",
+	.desc           = N_("Set whether users saying \"...\" are kicked from the channel."),
+	.access         = AC_NONE,
+	.maxparc        = 2,
+	.cmd            = &cs_set_cmd_kickdots,
+	.help           = { .path = "contrib/set_kickdots" },
+};
+
+static const struct chanfeature kickdots_feature = {
+	.metadata       = "kickdots",
+	.message        = &on_channel_message,
+};
+
 static void
 mod_init(module_t *const restrict m)
 {
-	hook_add_event("channel_message");
-	hook_add_channel_message(on_channel_message);
+	MODULE_TRY_REQUEST_SYMBOL(m, cs_set_cmdtree, "chanserv/set_core", "cs_set_cmdtree");
+	MODULE_TRY_REQUEST_SYMBOL(m, chanfeatures, "contrib/cs_chanfeatures", "chanfeatures_api");
+
+	command_add(&cs_set_kickdots, *cs_set_cmdtree);
+
+	chanfeatures->attach(CHANFEATURE_KICKDOTS, &kickdots_feature);
 }
 
 static void
 mod_deinit(const module_unload_intent_t intent)
 {
-	hook_del_channel_message(on_channel_message);
+	chanfeatures->detach(CHANFEATURE_KICKDOTS);
+
+	command_delete(&cs_set_kickdots, *cs_set_cmdtree);
 }
 
 VENDOR_DECLARE_MODULE_V1("contrib/cs_kickdots", MODULE_UNLOAD_CAPABILITY_OK, CONTRIB_VENDOR_NENOLOD)
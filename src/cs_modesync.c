@@ -10,6 +10,52 @@
 /* contract provided by chanserv/sync */
 static void (*do_channel_sync)(mychan_t *mc, chanacs_t *ca) = NULL;
 
+/* channels with a mode change since the last flush; a burst of mode
+ * lines costs one sync per channel instead of one per line
+ */
+static mowgli_patricia_t *modesync_dirty = NULL;
+static mowgli_eventloop_timer_t *modesync_timer = NULL;
+
+static unsigned int modesync_interval = 0;
+
+static unsigned long modesync_syncs = 0;
+static unsigned long modesync_avoided = 0;
+
+static void
+modesync_free_name(const char *key, void *data, void *privdata)
+{
+	sfree(data);
+}
+
+static void
+modesync_flush(void *unused)
+{
+	mowgli_patricia_iteration_state_t state;
+	mowgli_patricia_t *dirty = modesync_dirty;
+	mychan_t *mc;
+	char *name;
+
+	modesync_timer = NULL;
+
+	/* syncing changes modes too; anything dirtied now waits for the next flush */
+	modesync_dirty = mowgli_patricia_create(irccasecanon);
+
+	MOWGLI_PATRICIA_FOREACH(name, &state, dirty)
+	{
+		/* looked up again: the channel may have been dropped meanwhile */
+		if ((mc = mychan_find(name)) == NULL || mc->chan == NULL || mc->flags & MC_NOSYNC)
+			continue;
+
+		if (do_channel_sync != NULL)
+		{
+			do_channel_sync(mc, NULL);
+			modesync_syncs++;
+		}
+	}
+
+	mowgli_patricia_destroy(dirty, modesync_free_name, NULL);
+}
+
 static void
 on_channel_mode(hook_channel_mode_t *data)
 {
@@ -23,8 +69,25 @@ on_channel_mode(hook_channel_mode_t *data)
 	if (mc == NULL || mc->flags & MC_NOSYNC)
 		return;
 
-	if (do_channel_sync != NULL)
-		do_channel_sync(mc, NULL);
+	if (mowgli_patricia_retrieve(modesync_dirty, mc->name) != NULL)
+	{
+		modesync_avoided++;
+		return;
+	}
+
+	mowgli_patricia_add(modesync_dirty, mc->name, sstrdup(mc->name));
+
+	if (modesync_timer == NULL)
+		modesync_timer = mowgli_timer_add_once(base_eventloop, "modesync_flush", modesync_flush, NULL, modesync_interval);
+}
+
+static void
+info_hook(sourceinfo_t *si)
+{
+	return_if_fail(si != NULL);
+
+	command_success_nodata(si, "Mode change resyncs run: %lu, avoided by coalescing: %lu",
+		modesync_syncs, modesync_avoided);
 }
 
 static void
@@ -32,14 +95,29 @@ mod_init(module_t *const restrict m)
 {
 	MODULE_TRY_REQUEST_SYMBOL(m, do_channel_sync, "chanserv/sync", "do_channel_sync");
 
+	modesync_dirty = mowgli_patricia_create(irccasecanon);
+
+	add_uint_conf_item("MODESYNC_INTERVAL", &chansvs.me->conf_table, 0, &modesync_interval, 0, 60, 0);
+
 	hook_add_event("channel_mode");
 	hook_add_channel_mode(on_channel_mode);
+
+	hook_add_event("operserv_info");
+	hook_add_operserv_info(info_hook);
 }
 
 static void
 mod_deinit(const module_unload_intent_t intent)
 {
 	hook_del_channel_mode(on_channel_mode);
+	hook_del_operserv_info(info_hook);
+
+	del_conf_item("MODESYNC_INTERVAL", &chansvs.me->conf_table);
+
+	if (modesync_timer != NULL)
+		mowgli_timer_destroy(base_eventloop, modesync_timer);
+
+	mowgli_patricia_destroy(modesync_dirty, modesync_free_name, NULL);
 }
 
 VENDOR_DECLARE_MODULE_V1("contrib/cs_modesync", MODULE_UNLOAD_CAPABILITY_OK, CONTRIB_VENDOR_NENOLOD)
@@ -3,10 +3,151 @@
  * Rights to this code are as documented in doc/LICENSE.
  *
  * Per-channel userinfo thingie
+ *
+ * Greetings are not sent on join directly. They are collected per
+ * channel for USERINFO_WINDOW seconds and then sent combined into as few
+ * lines as possible, at most USERINFO_MAXLINES lines per channel per
+ * window; greetings past that are dropped. Someone rejoining a channel
+ * within USERINFO_REJOIN_TTL seconds of actually being greeted there is
+ * not greeted again.
  */
 
 #include "atheme-compat.h"
 
+#define USERINFO_WINDOW         2
+#define USERINFO_MAXLINES       3
+#define USERINFO_LINELEN        400
+#define USERINFO_REJOIN_TTL     300
+
+#define USERINFO_PRIVDATA       "userinfo:cache"
+
+/* channel name -> greeting of one account; accounts without a greeting
+ * on a channel are not cached, so this only grows with real greetings
+ */
+struct userinfo_cache {
+	myuser_t *mu;
+	unsigned int generation;
+	mowgli_patricia_t *greetings;
+	mowgli_node_t node;
+};
+
+struct userinfo_batch {
+	char *chan;
+	mowgli_list_t lines;
+};
+
+// one queued greeting; key is "channel account", as in userinfo_greeted
+struct userinfo_line {
+	char *key;
+	char *text;
+};
+
+struct userinfo_greeted {
+	char *key;
+	time_t when;
+};
+
+static mowgli_list_t userinfo_caches;
+
+/* bumped on channel drop, which removes chanacs without telling us */
+static unsigned int userinfo_generation = 0;
+
+// channel name -> struct userinfo_batch
+static mowgli_patricia_t *userinfo_pending = NULL;
+static mowgli_eventloop_timer_t *userinfo_timer = NULL;
+
+// "channel account" -> struct userinfo_line, for greetings not sent yet
+static mowgli_patricia_t *userinfo_queued = NULL;
+
+// "channel account" -> struct userinfo_greeted
+static mowgli_patricia_t *userinfo_greeted = NULL;
+static time_t userinfo_last_prune = 0;
+
+static void
+userinfo_greeting_free(const char *key, void *data, void *privdata)
+{
+	sfree(data);
+}
+
+static struct userinfo_cache *
+userinfo_cache_of(myuser_t *mu)
+{
+	struct userinfo_cache *uc;
+
+	if ((uc = privatedata_get(mu, USERINFO_PRIVDATA)) != NULL)
+	{
+		if (uc->generation == userinfo_generation)
+			return uc;
+
+		mowgli_patricia_destroy(uc->greetings, userinfo_greeting_free, NULL);
+		uc->greetings = mowgli_patricia_create(irccasecanon);
+		uc->generation = userinfo_generation;
+		return uc;
+	}
+
+	uc = smalloc(sizeof *uc);
+	memset(uc, 0, sizeof *uc);
+	uc->mu = mu;
+	uc->generation = userinfo_generation;
+	uc->greetings = mowgli_patricia_create(irccasecanon);
+
+	privatedata_set(mu, USERINFO_PRIVDATA, uc);
+	mowgli_node_add(uc, &uc->node, &userinfo_caches);
+
+	return uc;
+}
+
+static void
+userinfo_cache_drop(myuser_t *mu)
+{
+	struct userinfo_cache *uc;
+
+	if ((uc = privatedata_delete(mu, USERINFO_PRIVDATA)) == NULL)
+		return;
+
+	mowgli_patricia_destroy(uc->greetings, userinfo_greeting_free, NULL);
+	mowgli_node_delete(&uc->node, &userinfo_caches);
+	sfree(uc);
+}
+
+static void
+userinfo_cache_forget(myuser_t *mu, const char *chan)
+{
+	struct userinfo_cache *uc;
+	void *greeting;
+
+	if ((uc = privatedata_get(mu, USERINFO_PRIVDATA)) == NULL)
+		return;
+
+	if ((greeting = mowgli_patricia_delete(uc->greetings, chan)) != NULL)
+		userinfo_greeting_free(chan, greeting, NULL);
+}
+
+/* the greeting of mu on mc, or NULL; only looks at chanacs on a cache miss */
+static const char *
+userinfo_greeting(myuser_t *mu, mychan_t *mc)
+{
+	struct userinfo_cache *uc;
+	chanacs_t *ca;
+	metadata_t *md;
+	char *greeting;
+
+	if ((uc = privatedata_get(mu, USERINFO_PRIVDATA)) != NULL && uc->generation == userinfo_generation &&
+	    (greeting = mowgli_patricia_retrieve(uc->greetings, mc->name)) != NULL)
+		return greeting;
+
+	ca = chanacs_find_literal(mc, entity(mu), 0);
+
+	if (ca == NULL || (ca->level & CA_AKICK) || (md = metadata_find(ca, "userinfo")) == NULL)
+		return NULL;
+
+	uc = userinfo_cache_of(mu);
+	greeting = sstrdup(md->value);
+	mowgli_patricia_add(uc->greetings, mc->name, greeting);
+
+	return greeting;
+}
+
 static void
 cs_cmd_userinfo(sourceinfo_t *si, int parc, char *parv[])
 {
@@ -91,6 +232,7 @@ cs_cmd_userinfo(sourceinfo_t *si, int parc, char *parv[])
 		if (parc == 2)
 		{
 			metadata_delete(ca, "userinfo");
+			userinfo_cache_forget(mu, mc->name);
 			command_success_nodata(si, _("Deleted userinfo for \2%s\2 on \2%s\2."),
 						entity(mu)->name, mc->name);
 			logcommand(si, CMDLOG_SET, "USERINFO:DEL: \2%s\2 on \2%s\2", entity(mu)->name, mc->name);
@@ -98,20 +240,171 @@ cs_cmd_userinfo(sourceinfo_t *si, int parc, char *parv[])
 		}
 
 		metadata_add(ca, "userinfo", parv[2]);
+		userinfo_cache_forget(mu, mc->name);
 		command_success_nodata(si, _("Added userinfo for \2%s\2 on \2%s\2."),
 					entity(mu)->name, mc->name);
 		logcommand(si, CMDLOG_SET, "USERINFO:ADD: \2%s\2 on \2%s\2 (\2%s\2)", entity(mu)->name, mc->name, parv[2]);
 	}
 }
 
+static void
+userinfo_prune(void)
+{
+	struct userinfo_greeted *ug;
+	mowgli_patricia_iteration_state_t state;
+
+	MOWGLI_PATRICIA_FOREACH(ug, &state, userinfo_greeted)
+	{
+		if (ug->when + USERINFO_REJOIN_TTL > CURRTIME)
+			continue;
+
+		mowgli_patricia_delete(userinfo_greeted, ug->key);
+		sfree(ug->key);
+		sfree(ug);
+	}
+}
+
+static void
+userinfo_batch_free(struct userinfo_batch *ub)
+{
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, ub->lines.head)
+	{
+		struct userinfo_line *ul = n->data;
+
+		sfree(ul->key);
+		sfree(ul->text);
+		sfree(ul);
+		mowgli_node_delete(n, &ub->lines);
+		mowgli_node_free(n);
+	}
+
+	sfree(ub->chan);
+	sfree(ub);
+}
+
+static void
+userinfo_batch_free_cb(const char *key, void *data, void *privdata)
+{
+	userinfo_batch_free(data);
+}
+
+static void
+userinfo_greeted_free_cb(const char *key, void *data, void *privdata)
+{
+	struct userinfo_greeted *ug = data;
+
+	sfree(ug->key);
+	sfree(ug);
+}
+
+static void
+userinfo_mark_greeted(const char *key)
+{
+	struct userinfo_greeted *ug;
+
+	if ((ug = mowgli_patricia_retrieve(userinfo_greeted, key)) == NULL)
+	{
+		ug = smalloc(sizeof *ug);
+		ug->key = sstrdup(key);
+		mowgli_patricia_add(userinfo_greeted, ug->key, ug);
+	}
+
+	ug->when = CURRTIME;
+}
+
+static int
+userinfo_flush_cb(const char *key, void *data, void *privdata)
+{
+	struct userinfo_batch *ub = data;
+	channel_t *c;
+	mowgli_node_t *n;
+	char buf[BUFSIZE];
+	size_t len = 0, linelen;
+	unsigned int lines = 0, dropped = 0;
+
+	if ((c = channel_find(ub->chan)) == NULL)
+		return 0;
+
+	MOWGLI_ITER_FOREACH(n, ub->lines.head)
+	{
+		struct userinfo_line *ul = n->data;
+
+		linelen = strlen(ul->text);
+
+		if (len && len + 1 + linelen > USERINFO_LINELEN)
+		{
+			msg(chansvs.nick, c->name, "%s", buf);
+			len = 0;
+			lines++;
+		}
+
+		if (lines == USERINFO_MAXLINES)
+		{
+			dropped++;
+			continue;
+		}
+
+		/* whatever makes it into buf is sent, below or on the next turn */
+		len += snprintf(buf + len, sizeof buf - len, "%s%s", len ? " " : "", ul->text);
+		userinfo_mark_greeted(ul->key);
+	}
+
+	if (len && lines < USERINFO_MAXLINES)
+		msg(chansvs.nick, c->name, "%s", buf);
+
+	if (dropped)
+		slog(LG_DEBUG, "userinfo_flush_cb(): dropped %u greetings on %s", dropped, c->name);
+
+	return 0;
+}
+
+static void
+userinfo_flush(void *unused)
+{
+	mowgli_patricia_t *pending = userinfo_pending;
+
+	userinfo_timer = NULL;
+	userinfo_pending = mowgli_patricia_create(irccasecanon);
+
+	mowgli_patricia_destroy(userinfo_queued, NULL, NULL);
+	userinfo_queued = mowgli_patricia_create(irccasecanon);
+
+	mowgli_patricia_foreach(pending, userinfo_flush_cb, NULL);
+	mowgli_patricia_destroy(pending, userinfo_batch_free_cb, NULL);
+
+	if (userinfo_last_prune + USERINFO_REJOIN_TTL <= CURRTIME)
+	{
+		userinfo_prune();
+		userinfo_last_prune = CURRTIME;
+	}
+}
+
+/* returns true if key was greeted recently or is queued to be */
+static bool
+userinfo_recently_greeted(const char *key)
+{
+	struct userinfo_greeted *ug;
+
+	if (mowgli_patricia_retrieve(userinfo_queued, key) != NULL)
+		return true;
+
+	ug = mowgli_patricia_retrieve(userinfo_greeted, key);
+
+	return ug != NULL && ug->when + USERINFO_REJOIN_TTL > CURRTIME;
+}
+
 static void
 userinfo_check_join(hook_channel_joinpart_t *hdata)
 {
 	chanuser_t *cu = hdata->cu;
 	myuser_t *mu;
 	mychan_t *mc;
-	chanacs_t *ca;
-	metadata_t *md;
+	const char *greeting;
+	struct userinfo_batch *ub;
+	struct userinfo_line *ul;
+	char key[BUFSIZE], buf[BUFSIZE];
 
 	if (cu == NULL)
 		return;
@@ -121,12 +414,55 @@ userinfo_check_join(hook_channel_joinpart_t *hdata)
 	mc = mychan_from(cu->chan);
 	if (mu == NULL || mc == NULL)
 		return;
-	ca = chanacs_find_literal(mc, entity(mu), 0);
-	if (ca == NULL || ca->level & CA_AKICK)
+	if ((greeting = userinfo_greeting(mu, mc)) == NULL)
 		return;
-	if (!(md = metadata_find(ca, "userinfo")))
+
+	snprintf(key, sizeof key, "%s %s", cu->chan->name, entity(mu)->name);
+
+	if (userinfo_recently_greeted(key))
 		return;
-	msg(chansvs.nick, cu->chan->name, "[%s] %s", cu->user->nick, md->value);
+
+	if ((ub = mowgli_patricia_retrieve(userinfo_pending, cu->chan->name)) == NULL)
+	{
+		ub = smalloc(sizeof *ub);
+		memset(ub, 0, sizeof *ub);
+		ub->chan = sstrdup(cu->chan->name);
+		mowgli_patricia_add(userinfo_pending, ub->chan, ub);
+	}
+
+	snprintf(buf, sizeof buf, "[%s] %s", cu->user->nick, greeting);
+
+	ul = smalloc(sizeof *ul);
+	ul->key = sstrdup(key);
+	ul->text = sstrdup(buf);
+	mowgli_node_add(ul, mowgli_node_create(), &ub->lines);
+	mowgli_patricia_add(userinfo_queued, ul->key, ul);
+
+	if (userinfo_timer == NULL)
+		userinfo_timer = mowgli_timer_add_once(base_eventloop, "userinfo_flush", userinfo_flush, NULL, USERINFO_WINDOW);
+}
+
+static void
+userinfo_acl_change(hook_channel_acl_req_t *hdata)
+{
+	chanacs_t *ca = hdata->ca;
+
+	if (ca == NULL || ca->entity == NULL || ca->mychan == NULL || !isuser(ca->entity))
+		return;
+
+	userinfo_cache_forget(user(ca->entity), ca->mychan->name);
+}
+
+static void
+userinfo_channel_drop(mychan_t *mc)
+{
+	userinfo_generation++;
+}
+
+static void
+userinfo_myuser_delete(myuser_t *mu)
+{
+	userinfo_cache_drop(mu);
 }
 
 static command_t cs_userinfo = {
@@ -141,16 +477,41 @@ static command_t cs_userinfo = {
 static void
 mod_init(module_t *const restrict m)
 {
+	userinfo_pending = mowgli_patricia_create(irccasecanon);
+	userinfo_queued = mowgli_patricia_create(irccasecanon);
+	userinfo_greeted = mowgli_patricia_create(irccasecanon);
+
 	hook_add_event("channel_join");
 	hook_add_channel_join(userinfo_check_join);
+	hook_add_event("channel_acl_change");
+	hook_add_channel_acl_change(userinfo_acl_change);
+	hook_add_event("channel_drop");
+	hook_add_channel_drop(userinfo_channel_drop);
+	hook_add_event("myuser_delete");
+	hook_add_myuser_delete(userinfo_myuser_delete);
 	service_named_bind_command("chanserv", &cs_userinfo);
 }
 
 static void
 mod_deinit(const module_unload_intent_t intent)
 {
+	mowgli_node_t *n, *tn;
+
 	hook_del_channel_join(userinfo_check_join);
+	hook_del_channel_acl_change(userinfo_acl_change);
+	hook_del_channel_drop(userinfo_channel_drop);
+	hook_del_myuser_delete(userinfo_myuser_delete);
 	service_named_unbind_command("chanserv", &cs_userinfo);
+
+	if (userinfo_timer != NULL)
+		mowgli_timer_destroy(base_eventloop, userinfo_timer);
+
+	mowgli_patricia_destroy(userinfo_queued, NULL, NULL);
+	mowgli_patricia_destroy(userinfo_pending, userinfo_batch_free_cb, NULL);
+	mowgli_patricia_destroy(userinfo_greeted, userinfo_greeted_free_cb, NULL);
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, userinfo_caches.head)
+		userinfo_cache_drop(((struct userinfo_cache *)n->data)->mu);
 }
 
 SIMPLE_DECLARE_MODULE_V1("contrib/cs_userinfo", MODULE_UNLOAD_CAPABILITY_OK)
@@ -3,6 +3,10 @@
  * Rights to this code are as documented in doc/LICENSE.
  *
  * An echo server. (proof of concept for integrated XMLRPC HTTPD)
+ *
+ * Also serves as a benchmark for the connection layer: OS ECHOBENCH forks
+ * a load generator that opens many client connections to the echo server
+ * and measures round trips.
  */
 
 #include "atheme-compat.h"
@@ -11,74 +15,501 @@
 #  include "datastream.h"
 #endif
 
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define ECHO_PORT		7100
+
+/* per-connection receive ring; a line longer than this is echoed in pieces */
+#define ECHO_BUFSIZE		(BUFSIZE * 4)
+
+/* latency histogram: 10 microsecond buckets up to one second */
+#define BENCH_BUCKET_USEC	10
+#define BENCH_BUCKETS		100000
+
+/* hard cap on ECHOBENCH connections; a quarter of RLIMIT_NOFILE if lower */
+#define BENCH_MAX_CONNECTIONS	10000
+
+struct echo_conn
+{
+	size_t head;			/* offset of the oldest unsent byte */
+	size_t len;			/* bytes received but not yet echoed */
+	connection_t *cptr;
+	mowgli_node_t node;
+	char buf[ECHO_BUFSIZE];
+};
+
+/* the load generator runs in a child process, so its sockets and its
+ * event loop are not those of services; only the echo side is measured
+ */
+struct bench_client
+{
+	struct timespec sent;
+	unsigned long seq;
+	size_t len;
+	char buf[32];
+};
+
+static struct
+{
+	pid_t pid;
+	int fd;
+	char oper[COMPAT_NICKLEN + 1];
+	unsigned int seconds;
+} bench = { .fd = -1 };
+
 static connection_t *listener = NULL;
+static mowgli_list_t echo_conns;
+
+/* ------------------------------ echo server */
+
+/* hands the next count bytes of the ring to the sendq, in at most two slices */
+static void
+echo_emit(connection_t *cptr, struct echo_conn *ec, size_t count)
+{
+	size_t first = count < ECHO_BUFSIZE - ec->head ? count : ECHO_BUFSIZE - ec->head;
+
+	if (log_debug_enabled())
+		slog(LG_DEBUG, "-{incoming}-> %.*s%.*s", (int) first, ec->buf + ec->head,
+			(int) (count - first), ec->buf);
+
+	sendq_add(cptr, ec->buf + ec->head, first);
+
+	if (count > first)
+		sendq_add(cptr, ec->buf, count - first);
 
-static int
-my_read(connection_t *cptr, char *buf)
+	ec->head = (ec->head + count) % ECHO_BUFSIZE;
+	ec->len -= count;
+}
+
+/* reads straight into the free part of the ring, returns the number of bytes read */
+static ssize_t
+my_read(connection_t *cptr, struct echo_conn *ec)
 {
-        int n;
+	size_t tail = (ec->head + ec->len) % ECHO_BUFSIZE;
+	size_t avail = ECHO_BUFSIZE - ec->len;
+	struct iovec iov[2];
+	int iovcnt = 1;
+	ssize_t n;
+
+	iov[0].iov_base = ec->buf + tail;
+	iov[0].iov_len = avail < ECHO_BUFSIZE - tail ? avail : ECHO_BUFSIZE - tail;
+
+	if (avail > iov[0].iov_len)
+	{
+		iov[1].iov_base = ec->buf;
+		iov[1].iov_len = avail - iov[0].iov_len;
+		iovcnt = 2;
+	}
 
-        if ((n = read(cptr->fd, buf, BUFSIZE)) > 0)
-        {
-                buf[n] = '\0';
-                cnt.bin += n;
-        }
+	if ((n = readv(cptr->fd, iov, iovcnt)) > 0)
+	{
+		ec->len += n;
+		cnt.bin += n;
+	}
 
-        return n;
+	return n;
 }
 
+/* echoes every complete line among the bytes after the first scanned ones */
 static void
-do_packet(connection_t *cptr, char *buf)
+do_packet(connection_t *cptr, struct echo_conn *ec, size_t scanned)
 {
-        char *ptr, buf2[BUFSIZE * 2];
-        static char tmp[BUFSIZE * 2 + 1];
+	while (scanned < ec->len)
+	{
+		size_t pos = (ec->head + scanned) % ECHO_BUFSIZE;
+		size_t seg = ec->len - scanned < ECHO_BUFSIZE - pos ? ec->len - scanned : ECHO_BUFSIZE - pos;
+		char *nl = memchr(ec->buf + pos, '\n', seg);
 
-        while ((ptr = strchr(buf, '\n')))
-        {
-                snprintf(buf2, (BUFSIZE * 2), "%s%s", tmp, buf);
-                *tmp = '\0';
+		if (nl == NULL)
+		{
+			scanned += seg;
+			continue;
+		}
 
-		slog(LG_DEBUG, "-{incoming}-> %s", buf2);
-		sendq_add(cptr, buf2, strlen(buf2));
+		echo_emit(cptr, ec, scanned + (nl - (ec->buf + pos)) + 1);
+		scanned = 0;
+	}
 
-                buf = ptr + 1;
-        }
-
-        if (*buf)
-        {
-                mowgli_strlcpy(tmp, buf, BUFSIZE * 2);
-                tmp[BUFSIZE * 2] = '\0';
-        }
+	/* no newline in a full ring: pass the partial line through */
+	if (ec->len == ECHO_BUFSIZE)
+		echo_emit(cptr, ec, ec->len);
 }
 
 static void
-my_rhandler(connection_t * cptr)
+my_rhandler(connection_t *cptr)
 {
-        char buf[BUFSIZE * 2];
+	struct echo_conn *ec = cptr->userdata;
+	size_t scanned = ec->len;
+	ssize_t n;
+
+	n = my_read(cptr, ec);
 
-        if (my_read(cptr, buf) <= 0)
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+
+	if (n <= 0)
 		connection_close(cptr);
 	else
-        do_packet(cptr, buf);
+		do_packet(cptr, ec, scanned);
+}
+
+static void
+my_closehandler(connection_t *cptr)
+{
+	struct echo_conn *ec = cptr->userdata;
+
+	mowgli_node_delete(&ec->node, &echo_conns);
+	sfree(ec);
 }
 
 static void
 do_listen(connection_t *cptr)
 {
 	connection_t *newptr;
+	struct echo_conn *ec;
+
 	newptr = connection_accept_tcp(cptr, my_rhandler, NULL);
-	slog(LG_DEBUG, "do_listen(): accepted %d", cptr->fd);
+
+	if (newptr == NULL)
+		return;
+
+	ec = scalloc(1, sizeof(struct echo_conn));
+	ec->cptr = newptr;
+	mowgli_node_add(ec, &ec->node, &echo_conns);
+
+	newptr->userdata = ec;
+	newptr->close_handler = my_closehandler;
+
+	slog(LG_DEBUG, "do_listen(): accepted %d", newptr->fd);
+}
+
+/* ------------------------------ load generator */
+
+/* child side from here on: plain sockets and poll(2), no services state */
+
+static unsigned int *bench_hist;
+static unsigned long bench_lines, bench_overflow;
+
+static bool
+bench_send(int fd, struct bench_client *bc)
+{
+	char line[32];
+	int len;
+
+	len = snprintf(line, sizeof line, "%lu\n", ++bc->seq);
+
+	clock_gettime(CLOCK_MONOTONIC, &bc->sent);
+	return write(fd, line, len) == len;
+}
+
+static void
+bench_record(const struct bench_client *bc, const struct timespec *now)
+{
+	long usec = (now->tv_sec - bc->sent.tv_sec) * 1000000L + (now->tv_nsec - bc->sent.tv_nsec) / 1000L;
+	long bucket = usec / BENCH_BUCKET_USEC;
+
+	if (bucket < 0)
+		bucket = 0;
+
+	if (bucket < BENCH_BUCKETS)
+		bench_hist[bucket]++;
+	else
+		bench_overflow++;
+
+	bench_lines++;
+}
+
+/* returns false once the connection is no longer usable */
+static bool
+bench_read(int fd, struct bench_client *bc)
+{
+	struct timespec now;
+	ssize_t n;
+	char *nl;
+
+	n = read(fd, bc->buf + bc->len, sizeof bc->buf - bc->len);
+
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return true;
+
+	if (n <= 0)
+		return false;
+
+	bc->len += n;
+
+	/* one line is in flight per connection, so each echo completes a round trip */
+	if ((nl = memchr(bc->buf, '\n', bc->len)) == NULL)
+		return bc->len < sizeof bc->buf;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	bench_record(bc, &now);
+
+	bc->len -= nl + 1 - bc->buf;
+	memmove(bc->buf, nl + 1, bc->len);
+
+	return bench_send(fd, bc);
 }
 
+/* returns the latency in microseconds below which the given share of round trips completed */
+static unsigned long
+bench_percentile(double share)
+{
+	unsigned long want = (unsigned long) (bench_lines * share);
+	unsigned long seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < BENCH_BUCKETS; i++)
+	{
+		seen += bench_hist[i];
+
+		if (seen > want)
+			return (unsigned long) (i + 1) * BENCH_BUCKET_USEC;
+	}
+
+	return (unsigned long) BENCH_BUCKETS * BENCH_BUCKET_USEC;
+}
+
+static void ATHEME_FATTR_NORETURN
+bench_run(int report, unsigned int connections, unsigned int seconds)
+{
+	struct sockaddr_in sin;
+	struct bench_client *clients;
+	struct pollfd *pfds;
+	struct timespec start, now;
+	unsigned int i, opened = 0, failed = 0;
+	char line[BUFSIZE];
+	double secs;
+	int len;
+
+	bench_hist = scalloc(BENCH_BUCKETS, sizeof(unsigned int));
+	clients = scalloc(connections, sizeof *clients);
+	pfds = scalloc(connections, sizeof *pfds);
+
+	memset(&sin, '\0', sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(ECHO_PORT);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (i = 0; i < connections; i++)
+	{
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+		if (fd < 0 || connect(fd, (struct sockaddr *) &sin, sizeof sin) < 0)
+		{
+			if (fd >= 0)
+				close(fd);
+
+			failed++;
+			continue;
+		}
+
+		pfds[opened].fd = fd;
+		pfds[opened].events = POLLIN;
+		opened++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < opened; i++)
+		if (!bench_send(pfds[i].fd, &clients[i]))
+			pfds[i].fd = -1;
+
+	for (;;)
+	{
+		long left;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = seconds * 1000L - ((now.tv_sec - start.tv_sec) * 1000L + (now.tv_nsec - start.tv_nsec) / 1000000L);
+
+		if (left <= 0)
+			break;
+
+		if (poll(pfds, opened, left) < 0 && errno != EINTR)
+			break;
+
+		for (i = 0; i < opened; i++)
+		{
+			if (pfds[i].fd < 0 || !pfds[i].revents)
+				continue;
+
+			/* a negative fd is skipped by poll(2) from then on */
+			if (!bench_read(pfds[i].fd, &clients[i]))
+				pfds[i].fd = -1;
+		}
+	}
+
+	secs = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+
+	len = snprintf(line, sizeof line, "%u %u %lu %.3f %lu %lu %lu\n", opened, failed, bench_lines, secs,
+		bench_percentile(0.50), bench_percentile(0.99), bench_overflow);
+
+	_exit(len > 0 && write(report, line, len) == len ? 0 : 1);
+}
+
+/* parent side: read the child's one-line report and pass it on */
+static void
+bench_done(pid_t pid, int status, void *data)
+{
+	unsigned int opened, failed;
+	unsigned long lines, p50, p99, overflow;
+	char buf[BUFSIZE];
+	double secs;
+	ssize_t len;
+	service_t *svs;
+	user_t *u;
+
+	len = read(bench.fd, buf, sizeof buf - 1);
+	buf[len > 0 ? len : 0] = '\0';
+
+	close(bench.fd);
+	bench.fd = -1;
+	bench.pid = 0;
+
+	/* operserv may have been unloaded while the benchmark ran */
+	u = user_find_named(bench.oper);
+	if ((svs = service_find("operserv")) == NULL || svs->me == NULL)
+		u = NULL;
+
+	if (sscanf(buf, "%u %u %lu %lf %lu %lu %lu", &opened, &failed, &lines, &secs, &p50, &p99, &overflow) != 7)
+	{
+		slog(LG_ERROR, "ECHOBENCH: the load generator failed with status %d", status);
+
+		if (u != NULL)
+			notice(svs->me->nick, u->nick, "ECHOBENCH: the load generator failed.");
+
+		return;
+	}
+
+	if (secs <= 0)
+		secs = bench.seconds;
+
+	slog(LG_INFO, "ECHOBENCH: %u connections (%u failed), %lu lines in %.1fs: %.0f lines/sec, p50 %luus, p99 %luus, %lu over 1s",
+		opened, failed, lines, secs, lines / secs, p50, p99, overflow);
+
+	if (u != NULL)
+		notice(svs->me->nick, u->nick,
+			"ECHOBENCH: %u connections (%u failed), %lu lines in %.1fs: \2%.0f\2 lines/sec, p50 %luus, p99 \2%luus\2",
+			opened, failed, lines, secs, lines / secs, p50, p99);
+}
+
+/* every client connection is also an accepted one inside services */
+static unsigned int
+bench_max_connections(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY)
+		return BENCH_MAX_CONNECTIONS;
+
+	return rl.rlim_cur / 4 < BENCH_MAX_CONNECTIONS ? rl.rlim_cur / 4 : BENCH_MAX_CONNECTIONS;
+}
+
+static void
+os_cmd_echobench(sourceinfo_t *si, int parc, char *parv[])
+{
+	unsigned int connections = 1000, seconds = 10, max = bench_max_connections();
+	int fds[2];
+	pid_t pid;
+
+	if (si->su == NULL)
+	{
+		command_fail(si, fault_noprivs, _("\2%s\2 can only be executed via IRC."), "ECHOBENCH");
+		return;
+	}
+
+	if (bench.pid)
+	{
+		command_fail(si, fault_toomany, _("Another ECHOBENCH is still in progress."));
+		return;
+	}
+
+	if (parc > 0)
+		connections = atoi(parv[0]);
+	if (parc > 1)
+		seconds = atoi(parv[1]);
+
+	if (parc == 0 && connections > max)
+		connections = max;
+
+	if (connections < 1 || connections > max || seconds < 1 || seconds > 300)
+	{
+		command_fail(si, fault_badparams, STR_INVALID_PARAMS, "ECHOBENCH");
+		command_fail(si, fault_badparams, _("Syntax: ECHOBENCH [1-%u connections] [1-300 seconds]"), max);
+		return;
+	}
+
+	if (pipe(fds) == -1)
+	{
+		command_fail(si, fault_internalerror, _("ECHOBENCH: pipe() failed: %s"), strerror(errno));
+		return;
+	}
+
+	switch (pid = fork())
+	{
+		case -1:
+			command_fail(si, fault_internalerror, _("ECHOBENCH: fork() failed: %s"), strerror(errno));
+			close(fds[0]);
+			close(fds[1]);
+			return;
+		case 0:
+			close(fds[0]);
+			connection_close_all_fds();
+			bench_run(fds[1], connections, seconds);
+		default:
+			close(fds[1]);
+			childproc_add(pid, "echobench", bench_done, NULL);
+
+			bench.pid = pid;
+			bench.fd = fds[0];
+			bench.seconds = seconds;
+			mowgli_strlcpy(bench.oper, si->su->nick, sizeof bench.oper);
+			break;
+	}
+
+	logcommand(si, CMDLOG_ADMIN, "ECHOBENCH: \2%u\2 connections, \2%u\2 seconds", connections, seconds);
+	command_success_nodata(si, _("Benchmarking with \2%u\2 connections for \2%u\2 seconds in the background."),
+		connections, seconds);
+}
+
+static command_t os_echobench = {
+	.name           = "ECHOBENCH",
+	.desc           = N_("Measures echo server throughput and latency."),
+	.access         = PRIV_ADMIN,
+	.maxparc        = 2,
+	.cmd            = &os_cmd_echobench,
+	.help           = { .path = "contrib/echobench" },
+};
+
 static void
 mod_init(module_t *const restrict m)
 {
-	listener = connection_open_listener_tcp("127.0.0.1", 7100, do_listen);
+	listener = connection_open_listener_tcp("127.0.0.1", ECHO_PORT, do_listen);
+
+	service_named_bind_command("operserv", &os_echobench);
 }
 
 static void
 mod_deinit(const module_unload_intent_t intent)
 {
+	mowgli_node_t *n, *tn;
+
+	service_named_unbind_command("operserv", &os_echobench);
+
+	childproc_delete_all(bench_done);
+
+	if (bench.pid)
+	{
+		kill(bench.pid, SIGTERM);
+		close(bench.fd);
+	}
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, echo_conns.head)
+		connection_close(((struct echo_conn *) n->data)->cptr);
+
 	connection_close(listener);
 }
 
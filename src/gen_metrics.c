@@ -0,0 +1,398 @@
+/*
+ * Copyright (C) 2026 Atheme Development Group (https://atheme.github.io/)
+ * Rights to this code are documented in doc/LICENSE.
+ *
+ * Serves services metrics in the Prometheus text exposition format on a
+ * localhost listener. Every value is a counter kept up to date as things
+ * happen, so a scrape only formats numbers and never walks the user,
+ * channel or account lists.
+ */
+
+#include "atheme-compat.h"
+
+#if (CURRENT_ABI_REVISION < 730000)
+#  include "datastream.h"
+#endif
+
+#define METRICS_HOST		"127.0.0.1"
+#define METRICS_PORT		9161
+
+#define METRICS_BUFSIZE		8192
+
+/* scrape connections still open after this many seconds are closed */
+#define METRICS_IDLE_TIMEOUT	5
+
+enum metrics_hook
+{
+	MH_USER_ADD,
+	MH_USER_DELETE,
+	MH_USER_NICKCHANGE,
+	MH_CHANNEL_JOIN,
+	MH_CHANNEL_PART,
+	MH_CHANNEL_MESSAGE,
+	MH_USER_REGISTER,
+	MH_USER_DROP,
+	MH_CHANNEL_REGISTER,
+	MH_CHANNEL_DROP,
+	MH_DB_SAVED,
+	MH_COUNT
+};
+
+static const char *const metrics_hook_names[MH_COUNT] = {
+	[MH_USER_ADD]           = "user_add",
+	[MH_USER_DELETE]        = "user_delete",
+	[MH_USER_NICKCHANGE]    = "user_nickchange",
+	[MH_CHANNEL_JOIN]       = "channel_join",
+	[MH_CHANNEL_PART]       = "channel_part",
+	[MH_CHANNEL_MESSAGE]    = "channel_message",
+	[MH_USER_REGISTER]      = "user_register",
+	[MH_USER_DROP]          = "user_drop",
+	[MH_CHANNEL_REGISTER]   = "channel_register",
+	[MH_CHANNEL_DROP]       = "channel_drop",
+	[MH_DB_SAVED]           = "db_saved",
+};
+
+static unsigned long metrics_hook_calls[MH_COUNT];
+
+static time_t metrics_last_save = 0;
+static unsigned long metrics_save_interval = 0;
+static unsigned long metrics_scrapes = 0;
+
+struct metrics_buf
+{
+	size_t len;
+	char data[METRICS_BUFSIZE];
+};
+
+static connection_t *listener = NULL;
+
+/* ------------------------------ counters */
+
+static void
+metrics_user_add(hook_user_nick_t *data)
+{
+	metrics_hook_calls[MH_USER_ADD]++;
+}
+
+static void
+metrics_user_delete(user_t *u)
+{
+	metrics_hook_calls[MH_USER_DELETE]++;
+}
+
+static void
+metrics_user_nickchange(hook_user_nick_t *data)
+{
+	metrics_hook_calls[MH_USER_NICKCHANGE]++;
+}
+
+static void
+metrics_channel_join(hook_channel_joinpart_t *hdata)
+{
+	metrics_hook_calls[MH_CHANNEL_JOIN]++;
+}
+
+static void
+metrics_channel_part(hook_channel_joinpart_t *hdata)
+{
+	metrics_hook_calls[MH_CHANNEL_PART]++;
+}
+
+static void
+metrics_channel_message(hook_cmessage_data_t *data)
+{
+	metrics_hook_calls[MH_CHANNEL_MESSAGE]++;
+}
+
+static void
+metrics_user_register(myuser_t *mu)
+{
+	metrics_hook_calls[MH_USER_REGISTER]++;
+}
+
+static void
+metrics_user_drop(myuser_t *mu)
+{
+	metrics_hook_calls[MH_USER_DROP]++;
+}
+
+static void
+metrics_channel_register(hook_channel_req_t *hdata)
+{
+	metrics_hook_calls[MH_CHANNEL_REGISTER]++;
+}
+
+static void
+metrics_channel_drop(mychan_t *mc)
+{
+	metrics_hook_calls[MH_CHANNEL_DROP]++;
+}
+
+static void
+metrics_db_saved(void *unused)
+{
+	metrics_hook_calls[MH_DB_SAVED]++;
+
+	if (metrics_last_save != 0)
+		metrics_save_interval = CURRTIME - metrics_last_save;
+
+	metrics_last_save = CURRTIME;
+}
+
+/* ------------------------------ exposition */
+
+static void ATHEME_FATTR_PRINTF(2, 3)
+metrics_printf(struct metrics_buf *mb, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (mb->len >= sizeof mb->data)
+		return;
+
+	va_start(ap, fmt);
+	n = vsnprintf(mb->data + mb->len, sizeof mb->data - mb->len, fmt, ap);
+	va_end(ap);
+
+	if (n > 0)
+		mb->len = mb->len + n < sizeof mb->data ? mb->len + n : sizeof mb->data;
+}
+
+static void
+metrics_gauge(struct metrics_buf *mb, const char *name, const char *help, unsigned long long value)
+{
+	metrics_printf(mb, "# HELP %s %s\n# TYPE %s gauge\n%s %llu\n", name, help, name, name, value);
+}
+
+static void
+metrics_counter(struct metrics_buf *mb, const char *name, const char *help, unsigned long long value)
+{
+	metrics_printf(mb, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, value);
+}
+
+static void
+metrics_build(struct metrics_buf *mb)
+{
+	mowgli_node_t *n;
+	unsigned long sendq_buffers = 0;
+	unsigned int i;
+
+	/* the core keeps these counts up to date as objects come and go */
+	metrics_gauge(mb, "atheme_users", "Users on the network.", cnt.user);
+	metrics_gauge(mb, "atheme_channels", "Channels on the network.", cnt.chan);
+	metrics_gauge(mb, "atheme_accounts", "Registered accounts.", cnt.myuser);
+	metrics_gauge(mb, "atheme_registered_channels", "Registered channels.", cnt.mychan);
+	metrics_counter(mb, "atheme_received_bytes_total", "Bytes read from all connections.", cnt.bin);
+	metrics_counter(mb, "atheme_sent_bytes_total", "Bytes written to all connections.", cnt.bout);
+
+	metrics_printf(mb, "# HELP atheme_hook_calls_total Hook events seen since gen_metrics was loaded.\n"
+		"# TYPE atheme_hook_calls_total counter\n");
+
+	for (i = 0; i < MH_COUNT; i++)
+		metrics_printf(mb, "atheme_hook_calls_total{hook=\"%s\"} %lu\n", metrics_hook_names[i], metrics_hook_calls[i]);
+
+	metrics_gauge(mb, "atheme_db_last_save_timestamp_seconds", "When the database was last saved.",
+		(unsigned long long) metrics_last_save);
+	metrics_gauge(mb, "atheme_db_save_interval_seconds", "Time between the last two database saves.",
+		metrics_save_interval);
+
+	/* a handful of connections, one of them the uplink */
+	MOWGLI_ITER_FOREACH(n, connection_list.head)
+		sendq_buffers += MOWGLI_LIST_LENGTH(&((connection_t *) n->data)->sendq);
+
+	metrics_gauge(mb, "atheme_connections", "Open connections, including listeners.",
+		MOWGLI_LIST_LENGTH(&connection_list));
+	metrics_gauge(mb, "atheme_sendq_buffers", "Send queue buffers in use across all connections.",
+		sendq_buffers);
+
+	metrics_gauge(mb, "atheme_start_time_seconds", "When services were started.",
+		(unsigned long long) me.start);
+	metrics_counter(mb, "atheme_metrics_scrapes_total", "Metrics requests served.", metrics_scrapes);
+}
+
+static void
+metrics_respond(connection_t *cptr, const char *status, const struct metrics_buf *mb)
+{
+	char header[BUFSIZE];
+	int len;
+
+	len = snprintf(header, sizeof header,
+		"HTTP/1.0 %s\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\n"
+		"Connection: close\r\n"
+		"\r\n", status, mb != NULL ? mb->len : 0);
+
+	sendq_add(cptr, header, len);
+
+	if (mb != NULL)
+		sendq_add(cptr, (char *) mb->data, mb->len);
+
+	sendq_add_eof(cptr);
+}
+
+/* ------------------------------ listener */
+
+struct metrics_conn
+{
+	connection_t *cptr;
+	time_t opened;
+	bool answered;
+	mowgli_node_t node;
+};
+
+static mowgli_list_t metrics_conns;
+static mowgli_eventloop_timer_t *metrics_idle_timer = NULL;
+
+static void
+my_rhandler(connection_t *cptr)
+{
+	struct metrics_conn *mc = cptr->userdata;
+	static struct metrics_buf mb;
+	char buf[BUFSIZE];
+	ssize_t n;
+
+	n = read(cptr->fd, buf, sizeof buf);
+
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+
+	if (n <= 0)
+	{
+		connection_close(cptr);
+		return;
+	}
+
+	cnt.bin += n;
+
+	/* every request gets one answer; anything after the first read is ignored */
+	if (mc->answered)
+		return;
+
+	mc->answered = true;
+
+	if (n < 4 || memcmp(buf, "GET ", 4))
+	{
+		metrics_respond(cptr, "405 Method Not Allowed", NULL);
+		return;
+	}
+
+	metrics_scrapes++;
+
+	mb.len = 0;
+	metrics_build(&mb);
+	metrics_respond(cptr, "200 OK", &mb);
+}
+
+static void
+my_closehandler(connection_t *cptr)
+{
+	struct metrics_conn *mc = cptr->userdata;
+
+	mowgli_node_delete(&mc->node, &metrics_conns);
+	sfree(mc);
+}
+
+/* a local client that connects and never finishes must not hold a slot forever */
+static void
+metrics_close_idle(void *unused)
+{
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, metrics_conns.head)
+	{
+		struct metrics_conn *mc = n->data;
+
+		if (mc->opened + METRICS_IDLE_TIMEOUT <= CURRTIME)
+			connection_close(mc->cptr);
+	}
+}
+
+static void
+do_listen(connection_t *cptr)
+{
+	connection_t *newptr;
+	struct metrics_conn *mc;
+
+	newptr = connection_accept_tcp(cptr, my_rhandler, NULL);
+
+	if (newptr == NULL)
+		return;
+
+	mc = scalloc(1, sizeof(struct metrics_conn));
+	mc->cptr = newptr;
+	mc->opened = CURRTIME;
+	mowgli_node_add(mc, &mc->node, &metrics_conns);
+
+	newptr->userdata = mc;
+	newptr->close_handler = my_closehandler;
+
+	slog(LG_DEBUG, "do_listen(): accepted %d", newptr->fd);
+}
+
+static void
+mod_init(module_t *const restrict m)
+{
+	listener = connection_open_listener_tcp(METRICS_HOST, METRICS_PORT, do_listen);
+
+	if (listener == NULL)
+	{
+		slog(LG_ERROR, "%s: cannot listen on %s:%d", m->name, METRICS_HOST, METRICS_PORT);
+
+		m->mflags |= MODFLAG_FAIL;
+		return;
+	}
+
+	metrics_idle_timer = mowgli_timer_add(base_eventloop, "metrics_close_idle", metrics_close_idle, NULL, METRICS_IDLE_TIMEOUT);
+
+	hook_add_event("user_add");
+	hook_add_user_add(metrics_user_add);
+	hook_add_event("user_delete");
+	hook_add_user_delete(metrics_user_delete);
+	hook_add_event("user_nickchange");
+	hook_add_user_nickchange(metrics_user_nickchange);
+	hook_add_event("channel_join");
+	hook_add_channel_join(metrics_channel_join);
+	hook_add_event("channel_part");
+	hook_add_channel_part(metrics_channel_part);
+	hook_add_event("channel_message");
+	hook_add_channel_message(metrics_channel_message);
+	hook_add_event("user_register");
+	hook_add_user_register(metrics_user_register);
+	hook_add_event("user_drop");
+	hook_add_user_drop(metrics_user_drop);
+	hook_add_event("channel_register");
+	hook_add_channel_register(metrics_channel_register);
+	hook_add_event("channel_drop");
+	hook_add_channel_drop(metrics_channel_drop);
+	hook_add_event("db_saved");
+	hook_add_db_saved(metrics_db_saved);
+}
+
+static void
+mod_deinit(const module_unload_intent_t intent)
+{
+	mowgli_node_t *n, *tn;
+
+	hook_del_user_add(metrics_user_add);
+	hook_del_user_delete(metrics_user_delete);
+	hook_del_user_nickchange(metrics_user_nickchange);
+	hook_del_channel_join(metrics_channel_join);
+	hook_del_channel_part(metrics_channel_part);
+	hook_del_channel_message(metrics_channel_message);
+	hook_del_user_register(metrics_user_register);
+	hook_del_user_drop(metrics_user_drop);
+	hook_del_channel_register(metrics_channel_register);
+	hook_del_channel_drop(metrics_channel_drop);
+	hook_del_db_saved(metrics_db_saved);
+
+	if (metrics_idle_timer != NULL)
+		mowgli_timer_destroy(base_eventloop, metrics_idle_timer);
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, metrics_conns.head)
+		connection_close(((struct metrics_conn *) n->data)->cptr);
+
+	connection_close(listener);
+}
+
+SIMPLE_DECLARE_MODULE_V1("contrib/gen_metrics", MODULE_UNLOAD_CAPABILITY_OK)
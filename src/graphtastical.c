@@ -14,6 +14,42 @@
  * interconnection, the channels.dot file contains also
  * information about social networks.
  *
+ * == Compact CSR output ==
+ * Setting graphtastical_format = "csr"; (or "both") in the
+ * general {} block makes Graphtastical also write channels.csr
+ * and uchannels.csr. These contain the same graphs as an
+ * interned node table plus CSR (compressed sparse row)
+ * adjacency, so they can be mmap()ed by analysis tooling
+ * without any parsing. All integers are uint32_t in host
+ * byte order and every section is 4-byte aligned:
+ *
+ *   header     magic "ATGRAPH\0", byte order mark 0x01020304,
+ *              version, node count, row count, edge count,
+ *              string table length
+ *   name_off   [nodes]     offset of each node name in strtab
+ *   row_node   [rows]      node index of each row (channel)
+ *   row_ptr    [rows + 1]  first edge of each row in col_idx
+ *   col_idx    [edges]     node index of each edge target
+ *   strtab     [strtab_len] NUL-terminated node names
+ *
+ * Rows are channels; the edges of row i are
+ * col_idx[row_ptr[i]] to col_idx[row_ptr[i + 1] - 1].
+ *
+ * == Delta journal ==
+ * With graphtastical_delta = yes; Graphtastical tracks chanacs
+ * and membership changes through hooks instead of rewriting
+ * every graph on each tick. Added and removed edges are appended
+ * to channels.delta and uchannels.delta, one line per edge:
+ *
+ *   @ <unix time>       start of an interval
+ *   + <node> <channel>  edge added
+ *   - <node> <channel>  edge removed
+ *
+ * Every graphtastical_compact ticks (default 60) the full graphs
+ * are rewritten in the configured format(s) and the journal is
+ * truncated, which also repairs any change the hooks missed
+ * (such as account renames).
+ *
  * Eventually Graphtastical will dump other graph datafiles
  * too.
  *
@@ -36,9 +72,225 @@
 
 #include "atheme-compat.h"
 
+#if (CURRENT_ABI_REVISION < 730000)
+#  include "conf.h"
+#endif
+
+#define GRAPH_FORMAT_DOT        0x01U
+#define GRAPH_FORMAT_CSR        0x02U
+
+#define GRAPH_CSR_MAGIC         "ATGRAPH"
+#define GRAPH_CSR_BYTEORDER     0x01020304U
+#define GRAPH_CSR_VERSION       1U
+
+struct graph_csr_header
+{
+	char            magic[8];
+	uint32_t        byteorder;
+	uint32_t        version;
+	uint32_t        nodes;
+	uint32_t        rows;
+	uint32_t        edges;
+	uint32_t        strtab_len;
+};
+
+struct graph_csr
+{
+	mowgli_patricia_t      *names;
+
+	uint32_t               *name_off;
+	size_t                  nodes;
+	size_t                  nodes_alloc;
+
+	uint32_t               *row_node;
+	uint32_t               *row_ptr;
+	size_t                  rows;
+	size_t                  rows_alloc;
+
+	uint32_t               *col_idx;
+	size_t                  edges;
+	size_t                  edges_alloc;
+
+	char                   *strtab;
+	size_t                  strtab_len;
+	size_t                  strtab_alloc;
+};
+
+#define GRAPH_DELTA_ADD         ((void *)(uintptr_t)1)
+#define GRAPH_DELTA_DEL         ((void *)(uintptr_t)2)
+
+struct graph_delta
+{
+	const char             *name;
+
+	// "channel node" -> GRAPH_DELTA_ADD or GRAPH_DELTA_DEL
+	mowgli_patricia_t      *pending;
+
+	unsigned int            ticks;
+	bool                    synced;
+};
+
 static mowgli_eventloop_timer_t *channels_timer = NULL;
 static mowgli_eventloop_timer_t *uchannels_timer = NULL;
 
+static char *graph_format = NULL;
+static bool graph_delta = false;
+static unsigned int graph_compact_ticks = 60;
+
+static struct graph_delta channels_delta = { .name = "channels" };
+static struct graph_delta uchannels_delta = { .name = "uchannels" };
+
+static unsigned int
+graph_formats(void)
+{
+	if (graph_format == NULL || !strcasecmp(graph_format, "dot"))
+		return GRAPH_FORMAT_DOT;
+	if (!strcasecmp(graph_format, "csr"))
+		return GRAPH_FORMAT_CSR;
+	if (!strcasecmp(graph_format, "both"))
+		return GRAPH_FORMAT_DOT | GRAPH_FORMAT_CSR;
+
+	slog(LG_ERROR, "graphtastical: unknown graphtastical_format '%s', using dot", graph_format);
+	return GRAPH_FORMAT_DOT;
+}
+
+static void *
+graph_csr_grow(void *ptr, size_t *alloc, size_t need, size_t elemsize)
+{
+	size_t newalloc = *alloc ? *alloc : 64;
+
+	if (need <= *alloc)
+		return ptr;
+
+	while (newalloc < need)
+		newalloc *= 2;
+
+	*alloc = newalloc;
+	return srealloc(ptr, newalloc * elemsize);
+}
+
+static void
+graph_csr_init(struct graph_csr *g)
+{
+	memset(g, 0, sizeof *g);
+	g->names = mowgli_patricia_create(NULL);
+}
+
+static void
+graph_csr_free(struct graph_csr *g)
+{
+	mowgli_patricia_destroy(g->names, NULL, NULL);
+	sfree(g->name_off);
+	sfree(g->row_node);
+	sfree(g->row_ptr);
+	sfree(g->col_idx);
+	sfree(g->strtab);
+}
+
+/* returns the node index of name, adding it to the node table if needed */
+static uint32_t
+graph_csr_intern(struct graph_csr *g, const char *name)
+{
+	void *idx;
+	size_t len;
+
+	if ((idx = mowgli_patricia_retrieve(g->names, name)) != NULL)
+		return (uint32_t)((uintptr_t)idx - 1);
+
+	len = strlen(name) + 1;
+	g->strtab = graph_csr_grow(g->strtab, &g->strtab_alloc, g->strtab_len + len, 1);
+	memcpy(g->strtab + g->strtab_len, name, len);
+
+	g->name_off = graph_csr_grow(g->name_off, &g->nodes_alloc, g->nodes + 1, sizeof *g->name_off);
+	g->name_off[g->nodes] = (uint32_t)g->strtab_len;
+	g->strtab_len += len;
+
+	mowgli_patricia_add(g->names, name, (void *)(uintptr_t)(g->nodes + 1));
+
+	return (uint32_t)g->nodes++;
+}
+
+static void
+graph_csr_begin_row(struct graph_csr *g, const char *name)
+{
+	size_t rows_alloc = g->rows_alloc;
+
+	g->row_node = graph_csr_grow(g->row_node, &rows_alloc, g->rows + 2, sizeof *g->row_node);
+	g->row_ptr = graph_csr_grow(g->row_ptr, &g->rows_alloc, g->rows + 2, sizeof *g->row_ptr);
+
+	g->row_node[g->rows] = graph_csr_intern(g, name);
+	g->row_ptr[g->rows] = (uint32_t)g->edges;
+	g->rows++;
+}
+
+static void
+graph_csr_add_edge(struct graph_csr *g, const char *name)
+{
+	uint32_t idx = graph_csr_intern(g, name);
+
+	g->col_idx = graph_csr_grow(g->col_idx, &g->edges_alloc, g->edges + 1, sizeof *g->col_idx);
+	g->col_idx[g->edges++] = idx;
+}
+
+static void
+graph_csr_write(struct graph_csr *g, const char *name)
+{
+	struct graph_csr_header hdr;
+	char path[BUFSIZE], newpath[BUFSIZE];
+	FILE *f;
+	int errno1, was_errored = 0;
+
+	snprintf(path, sizeof path, "%s/%s.csr", DATADIR, name);
+	snprintf(newpath, sizeof newpath, "%s/%s.csr.new", DATADIR, name);
+
+	/* terminate the last row */
+	g->row_ptr = graph_csr_grow(g->row_ptr, &g->rows_alloc, g->rows + 1, sizeof *g->row_ptr);
+	g->row_ptr[g->rows] = (uint32_t)g->edges;
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, GRAPH_CSR_MAGIC, sizeof GRAPH_CSR_MAGIC);
+	hdr.byteorder = GRAPH_CSR_BYTEORDER;
+	hdr.version = GRAPH_CSR_VERSION;
+	hdr.nodes = (uint32_t)g->nodes;
+	hdr.rows = (uint32_t)g->rows;
+	hdr.edges = (uint32_t)g->edges;
+	hdr.strtab_len = (uint32_t)g->strtab_len;
+
+	errno = 0;
+
+	/* write to a temporary file first */
+	if (!(f = fopen(newpath, "wb")))
+	{
+		errno1 = errno;
+		slog(LG_ERROR, "graphtastical: cannot create %s.csr.new: %s", name, strerror(errno1));
+		return;
+	}
+
+	fwrite(&hdr, sizeof hdr, 1, f);
+	fwrite(g->name_off, sizeof *g->name_off, g->nodes, f);
+	fwrite(g->row_node, sizeof *g->row_node, g->rows, f);
+	fwrite(g->row_ptr, sizeof *g->row_ptr, g->rows + 1, f);
+	fwrite(g->col_idx, sizeof *g->col_idx, g->edges, f);
+	fwrite(g->strtab, 1, g->strtab_len, f);
+
+	was_errored = ferror(f);
+	was_errored |= fclose(f);
+	if (was_errored)
+	{
+		errno1 = errno;
+		slog(LG_ERROR, "graphtastical: cannot write to %s.csr.new: %s", name, strerror(errno1));
+		return;
+	}
+
+	/* now, replace the old file with the new one, using an atomic rename */
+	if ((srename(newpath, path)) < 0)
+	{
+		errno1 = errno;
+		slog(LG_ERROR, "graphtastical: cannot rename %s.csr.new to %s.csr: %s", name, name, strerror(errno1));
+		return;
+	}
+}
+
 /* write channels.dot */
 static void
 write_channels_dot_file(void *arg)
@@ -77,7 +329,7 @@ write_channels_dot_file(void *arg)
 
 		pmc = mc;
 
-		fprintf(f, "[fontname=\"Verdana\" fontsize=8]\n");
+		fprintf(f, "\n");
 
 		MOWGLI_ITER_FOREACH(tn, mc->chanacs.head)
 		{
@@ -86,7 +338,7 @@ write_channels_dot_file(void *arg)
 			if (ca->level & CA_AKICK)
 				continue;
 
-			fprintf(f, "\"%s\" -- \"%s\" [fontname=\"Verdana\" fontsize=8]\n", ca->entity ? ca->entity->name : ca->host, mc->name);
+			fprintf(f, "\"%s\" -- \"%s\"\n", ca->entity ? ca->entity->name : ca->host, mc->name);
 		}
 	}
 
@@ -141,13 +393,13 @@ write_uchannels_dot_file(void *arg)
 	{
 		fprintf(f, "\"%s\"", c->name);
 
-		fprintf(f, "[fontname=\"Verdana\" fontsize=8]\n");
+		fprintf(f, "\n");
 
 		MOWGLI_ITER_FOREACH(tn, c->members.head)
 		{
 			cu = (chanuser_t *)tn->data;
 
-			fprintf(f, "\"%s\" -- \"%s\" [fontname=\"Verdana\" fontsize=8]\n", cu->user->nick, c->name);
+			fprintf(f, "\"%s\" -- \"%s\"\n", cu->user->nick, c->name);
 		}
 	}
 
@@ -171,14 +423,349 @@ write_uchannels_dot_file(void *arg)
 	}
 }
 
+/* write channels.csr */
+static void
+write_channels_csr_file(void)
+{
+	struct graph_csr g;
+	mychan_t *mc;
+	chanacs_t *ca;
+	mowgli_node_t *tn;
+	mowgli_patricia_iteration_state_t state;
+
+	graph_csr_init(&g);
+
+	slog(LG_DEBUG, "graphtastical: dumping mychans (csr)");
+
+	MOWGLI_PATRICIA_FOREACH(mc, &state, mclist)
+	{
+		graph_csr_begin_row(&g, mc->name);
+
+		MOWGLI_ITER_FOREACH(tn, mc->chanacs.head)
+		{
+			ca = (chanacs_t *)tn->data;
+
+			if (ca->level & CA_AKICK)
+				continue;
+
+			graph_csr_add_edge(&g, ca->entity ? ca->entity->name : ca->host);
+		}
+	}
+
+	graph_csr_write(&g, "channels");
+	graph_csr_free(&g);
+}
+
+/* write uchannels.csr */
+static void
+write_uchannels_csr_file(void)
+{
+	struct graph_csr g;
+	channel_t *c;
+	chanuser_t *cu;
+	mowgli_node_t *tn;
+	mowgli_patricia_iteration_state_t state;
+
+	graph_csr_init(&g);
+
+	slog(LG_DEBUG, "graphtastical: dumping chans (csr)");
+
+	MOWGLI_PATRICIA_FOREACH(c, &state, chanlist)
+	{
+		graph_csr_begin_row(&g, c->name);
+
+		MOWGLI_ITER_FOREACH(tn, c->members.head)
+		{
+			cu = (chanuser_t *)tn->data;
+
+			graph_csr_add_edge(&g, cu->user->nick);
+		}
+	}
+
+	graph_csr_write(&g, "uchannels");
+	graph_csr_free(&g);
+}
+
+static void
+graph_delta_record(struct graph_delta *d, const char *chan, const char *node, void *op)
+{
+	char key[BUFSIZE];
+	void *prev;
+
+	if (!graph_delta)
+		return;
+
+	snprintf(key, sizeof key, "%s %s", chan, node);
+
+	/* an add followed by a delete (or the reverse) in the same interval cancels out */
+	if ((prev = mowgli_patricia_retrieve(d->pending, key)) != NULL)
+	{
+		if (prev != op)
+			mowgli_patricia_delete(d->pending, key);
+		return;
+	}
+
+	mowgli_patricia_add(d->pending, key, op);
+}
+
+static void
+graph_delta_clear(struct graph_delta *d)
+{
+	mowgli_patricia_destroy(d->pending, NULL, NULL);
+	d->pending = mowgli_patricia_create(NULL);
+}
+
+static int
+graph_delta_write_cb(const char *key, void *op, void *privdata)
+{
+	FILE *f = privdata;
+	const char *node = strchr(key, ' ') + 1;
+
+	fprintf(f, "%c %s %.*s\n", op == GRAPH_DELTA_ADD ? '+' : '-', node, (int)(node - key - 1), key);
+
+	return 0;
+}
+
+/* append the pending changes to <name>.delta */
+static void
+graph_delta_flush(struct graph_delta *d)
+{
+	char path[BUFSIZE];
+	FILE *f;
+	int errno1, was_errored = 0;
+
+	if (mowgli_patricia_size(d->pending) == 0)
+		return;
+
+	snprintf(path, sizeof path, "%s/%s.delta", DATADIR, d->name);
+
+	errno = 0;
+
+	if (!(f = fopen(path, "a")))
+	{
+		errno1 = errno;
+		slog(LG_ERROR, "graphtastical: cannot open %s.delta: %s", d->name, strerror(errno1));
+		return;
+	}
+
+	fprintf(f, "@ %lu\n", (unsigned long)CURRTIME);
+
+	mowgli_patricia_foreach(d->pending, graph_delta_write_cb, f);
+
+	was_errored = ferror(f);
+	was_errored |= fclose(f);
+	if (was_errored)
+	{
+		errno1 = errno;
+		slog(LG_ERROR, "graphtastical: cannot write to %s.delta: %s", d->name, strerror(errno1));
+		return;
+	}
+
+	graph_delta_clear(d);
+}
+
+/* returns true if the caller should rewrite the full graph */
+static bool
+graph_delta_tick(struct graph_delta *d)
+{
+	char path[BUFSIZE];
+	int errno1;
+
+	if (graph_delta && d->synced && (d->ticks++ % graph_compact_ticks) != 0)
+	{
+		graph_delta_flush(d);
+		return false;
+	}
+
+	/* the full graph supersedes the journal */
+	snprintf(path, sizeof path, "%s/%s.delta", DATADIR, d->name);
+	if (unlink(path) < 0 && errno != ENOENT)
+	{
+		errno1 = errno;
+		slog(LG_ERROR, "graphtastical: cannot remove %s.delta: %s", d->name, strerror(errno1));
+	}
+
+	graph_delta_clear(d);
+	d->ticks = 1;
+	d->synced = graph_delta;
+
+	return true;
+}
+
+static bool
+chanacs_is_edge(unsigned int level)
+{
+	return level != 0 && !(level & CA_AKICK);
+}
+
+static const char *
+chanacs_node_name(chanacs_t *ca)
+{
+	return ca->entity ? ca->entity->name : ca->host;
+}
+
+static void
+graph_channel_join(hook_channel_joinpart_t *hdata)
+{
+	chanuser_t *cu = hdata->cu;
+
+	if (cu == NULL)
+		return;
+
+	graph_delta_record(&uchannels_delta, cu->chan->name, cu->user->nick, GRAPH_DELTA_ADD);
+}
+
+static void
+graph_channel_part(hook_channel_joinpart_t *hdata)
+{
+	chanuser_t *cu = hdata->cu;
+
+	if (cu == NULL)
+		return;
+
+	graph_delta_record(&uchannels_delta, cu->chan->name, cu->user->nick, GRAPH_DELTA_DEL);
+}
+
+static void
+graph_user_nickchange(hook_user_nick_t *data)
+{
+	user_t *u = data->u;
+	chanuser_t *cu;
+	mowgli_node_t *n;
+
+	if (u == NULL || data->oldnick == NULL)
+		return;
+
+	MOWGLI_ITER_FOREACH(n, u->channels.head)
+	{
+		cu = n->data;
+
+		graph_delta_record(&uchannels_delta, cu->chan->name, data->oldnick, GRAPH_DELTA_DEL);
+		graph_delta_record(&uchannels_delta, cu->chan->name, u->nick, GRAPH_DELTA_ADD);
+	}
+}
+
+/* this hook runs before the change is applied, so a change that is vetoed
+ * later on leaves a stale edge in the journal until the next compaction
+ */
+static void
+graph_channel_acl_change(hook_channel_acl_req_t *hdata)
+{
+	chanacs_t *ca = hdata->ca;
+	bool was_edge, is_edge;
+
+	if (ca == NULL || ca->mychan == NULL)
+		return;
+
+	was_edge = chanacs_is_edge(hdata->oldlevel);
+	is_edge = chanacs_is_edge(hdata->newlevel);
+
+	if (was_edge == is_edge)
+		return;
+
+	graph_delta_record(&channels_delta, ca->mychan->name, chanacs_node_name(ca), is_edge ? GRAPH_DELTA_ADD : GRAPH_DELTA_DEL);
+}
+
+static void
+graph_channel_chanacs(mychan_t *mc, void *op)
+{
+	chanacs_t *ca;
+	mowgli_node_t *n;
+
+	MOWGLI_ITER_FOREACH(n, mc->chanacs.head)
+	{
+		ca = n->data;
+
+		if (!chanacs_is_edge(ca->level))
+			continue;
+
+		graph_delta_record(&channels_delta, mc->name, chanacs_node_name(ca), op);
+	}
+}
+
+static void
+graph_channel_register(hook_channel_req_t *hdata)
+{
+	if (hdata->mc == NULL)
+		return;
+
+	graph_channel_chanacs(hdata->mc, GRAPH_DELTA_ADD);
+}
+
+static void
+graph_channel_drop(mychan_t *mc)
+{
+	if (mc == NULL)
+		return;
+
+	graph_channel_chanacs(mc, GRAPH_DELTA_DEL);
+}
+
+static void
+write_channels_files(void *arg)
+{
+	unsigned int formats;
+
+	if (!graph_delta_tick(&channels_delta))
+		return;
+
+	formats = graph_formats();
+
+	if (formats & GRAPH_FORMAT_DOT)
+		write_channels_dot_file(arg);
+	if (formats & GRAPH_FORMAT_CSR)
+		write_channels_csr_file();
+}
+
+static void
+write_uchannels_files(void *arg)
+{
+	unsigned int formats;
+
+	if (!graph_delta_tick(&uchannels_delta))
+		return;
+
+	formats = graph_formats();
+
+	if (formats & GRAPH_FORMAT_DOT)
+		write_uchannels_dot_file(arg);
+	if (formats & GRAPH_FORMAT_CSR)
+		write_uchannels_csr_file();
+}
+
 static void
 mod_init(module_t *const restrict m)
 {
-	write_channels_dot_file(NULL);
-	write_uchannels_dot_file(NULL);
+	add_dupstr_conf_item("graphtastical_format", &conf_gi_table, 0, &graph_format, "dot");
+	add_bool_conf_item("graphtastical_delta", &conf_gi_table, 0, &graph_delta, false);
+	add_uint_conf_item("graphtastical_compact", &conf_gi_table, 0, &graph_compact_ticks, 1, 10080, 60);
+
+	channels_delta.pending = mowgli_patricia_create(NULL);
+	uchannels_delta.pending = mowgli_patricia_create(NULL);
+
+	hook_add_event("channel_join");
+	hook_add_channel_join(graph_channel_join);
+
+	hook_add_event("channel_part");
+	hook_add_channel_part(graph_channel_part);
 
-	channels_timer = mowgli_timer_add(base_eventloop, "write_channels_dot_file", write_channels_dot_file, NULL, 60);
-	uchannels_timer = mowgli_timer_add(base_eventloop, "write_uchannels_dot_file", write_uchannels_dot_file, NULL, 60);
+	hook_add_event("user_nickchange");
+	hook_add_user_nickchange(graph_user_nickchange);
+
+	hook_add_event("channel_acl_change");
+	hook_add_channel_acl_change(graph_channel_acl_change);
+
+	hook_add_event("channel_register");
+	hook_add_channel_register(graph_channel_register);
+
+	hook_add_event("channel_drop");
+	hook_add_channel_drop(graph_channel_drop);
+
+	write_channels_files(NULL);
+	write_uchannels_files(NULL);
+
+	channels_timer = mowgli_timer_add(base_eventloop, "write_channels_files", write_channels_files, NULL, 60);
+	uchannels_timer = mowgli_timer_add(base_eventloop, "write_uchannels_files", write_uchannels_files, NULL, 60);
 }
 
 static void
@@ -186,6 +773,20 @@ mod_deinit(const module_unload_intent_t intent)
 {
 	mowgli_timer_destroy(base_eventloop, channels_timer);
 	mowgli_timer_destroy(base_eventloop, uchannels_timer);
+
+	hook_del_channel_join(graph_channel_join);
+	hook_del_channel_part(graph_channel_part);
+	hook_del_user_nickchange(graph_user_nickchange);
+	hook_del_channel_acl_change(graph_channel_acl_change);
+	hook_del_channel_register(graph_channel_register);
+	hook_del_channel_drop(graph_channel_drop);
+
+	mowgli_patricia_destroy(channels_delta.pending, NULL, NULL);
+	mowgli_patricia_destroy(uchannels_delta.pending, NULL, NULL);
+
+	del_conf_item("graphtastical_format", &conf_gi_table);
+	del_conf_item("graphtastical_delta", &conf_gi_table);
+	del_conf_item("graphtastical_compact", &conf_gi_table);
 }
 
 SIMPLE_DECLARE_MODULE_V1("contrib/graphtastical", MODULE_UNLOAD_CAPABILITY_NEVER)
@@ -11,14 +11,43 @@ struct asreq_ {
 	time_t announce_ts;
 	stringref creator;
 	char *text;
+	mowgli_node_t node;
 };
 
 typedef struct asreq_ asreq_t;
 
+/* oldest first, for WAITING; as_reqs indexes the same requests by account */
 static mowgli_list_t as_reqlist = { NULL, NULL, 0 };
+static mowgli_patricia_t *as_reqs = NULL;
 
 static service_t *announcesvs = NULL;
 
+static asreq_t *
+asreq_find(const char *nick)
+{
+	return mowgli_patricia_retrieve(as_reqs, nick);
+}
+
+static void
+asreq_add(asreq_t *l)
+{
+	mowgli_patricia_add(as_reqs, l->nick, l);
+	mowgli_node_add(l, &l->node, &as_reqlist);
+}
+
+static void
+asreq_delete(asreq_t *l)
+{
+	mowgli_patricia_delete(as_reqs, l->nick);
+	mowgli_node_delete(&l->node, &as_reqlist);
+
+	strshare_unref(l->nick);
+	strshare_unref(l->creator);
+	sfree(l->subject);
+	sfree(l->text);
+	sfree(l);
+}
+
 static void
 write_asreqdb(database_handle_t *db)
 {
@@ -47,41 +76,33 @@ db_h_ar(database_handle_t *db, const char *type)
 	const char *creator = db_sread_word(db);
 	const char *text = db_sread_str(db);
 
+	if (asreq_find(nick) != NULL)
+	{
+		slog(LG_ERROR, "db_h_ar(): ignoring duplicate announcement request for \2%s\2", nick);
+		return;
+	}
+
 	asreq_t *l = smalloc(sizeof(asreq_t));
 	l->nick = strshare_get(nick);
 	l->creator = strshare_get(creator);
 	l->subject = sstrdup(subject);
 	l->announce_ts = announce_ts;
 	l->text = sstrdup(text);
-	mowgli_node_add(l, mowgli_node_create(), &as_reqlist);
+	asreq_add(l);
 }
 
 /* Properly remove announcement requests from the DB if an account is dropped */
 static void
 account_drop_request(myuser_t *mu)
 {
-	mowgli_node_t *n;
 	asreq_t *l;
 
-	MOWGLI_LIST_FOREACH(n, as_reqlist.head)
-	{
-		l = n->data;
-
-		if (!irccasecmp(l->nick, entity(mu)->name))
-		{
-			slog(LG_REGISTER, "ANNOUNCEREQ:DROPACCOUNT: \2%s\2 %s\2", l->nick, l->text);
-
-			mowgli_node_delete(n, &as_reqlist);
+	if ((l = asreq_find(entity(mu)->name)) == NULL)
+		return;
 
-			strshare_unref(l->nick);
-			strshare_unref(l->creator);
-			sfree(l->subject);
-			sfree(l->text);
-			sfree(l);
+	slog(LG_REGISTER, "ANNOUNCEREQ:DROPACCOUNT: \2%s\2 %s\2", l->nick, l->text);
 
-			return;
-		}
-	}
+	asreq_delete(l);
 }
 
 /* HELP <command> [params] */
@@ -117,7 +138,6 @@ as_cmd_request(sourceinfo_t *si, int parc, char *parv[])
 	stringref target;
 	char *subject2;
 	char buf [BUFSIZE];
-	mowgli_node_t *n;
 	asreq_t *l;
 
 	if (!text || !subject)
@@ -135,15 +155,10 @@ as_cmd_request(sourceinfo_t *si, int parc, char *parv[])
 
 	target = entity(si->smu)->name;
 
-	MOWGLI_LIST_FOREACH(n, as_reqlist.head)
+	if (asreq_find(target) != NULL)
 	{
-		l = n->data;
-
-		if (!irccasecmp(l->nick, target))
-		{
-			command_fail(si, fault_badparams, _("You cannot request more than one announcement. Use CANCEL if you wish to cancel your current announcement and submit another."));
-			return;
-		}
+		command_fail(si, fault_badparams, _("You cannot request more than one announcement. Use CANCEL if you wish to cancel your current announcement and submit another."));
+		return;
 	}
 
 	/* Check the subject for being too long as well. 35 chars is probably a safe limit here.
@@ -171,8 +186,7 @@ as_cmd_request(sourceinfo_t *si, int parc, char *parv[])
 	l->creator = strshare_ref(target);
 	l->text = sstrdup(buf);
 
-	n = mowgli_node_create();
-	mowgli_node_add(l, n, &as_reqlist);
+	asreq_add(l);
 
 	subject2 = sstrdup(l->subject);
 	/* This doesn't need to be as efficient as InfoServ, so let's just use replace() */
@@ -195,7 +209,6 @@ as_cmd_activate(sourceinfo_t *si, int parc, char *parv[])
 	char *subject2;
 	char buf[BUFSIZE];
 	asreq_t *l;
-	mowgli_node_t *n;
 
 	if (!nick)
 	{
@@ -204,32 +217,21 @@ as_cmd_activate(sourceinfo_t *si, int parc, char *parv[])
 		return;
 	}
 
-	MOWGLI_LIST_FOREACH(n, as_reqlist.head)
+	if ((l = asreq_find(nick)) != NULL)
 	{
-		l = n->data;
+		if ((u = user_find_named(nick)) != NULL)
+			notice(si->service->nick, u->nick, "[auto memo] Your requested announcement has been approved.");
 
-		if (!irccasecmp(l->nick, nick))
-		{
-			if ((u = user_find_named(nick)) != NULL)
-				notice(si->service->nick, u->nick, "[auto memo] Your requested announcement has been approved.");
-
-			subject2 = sstrdup(l->subject);
-			replace(subject2, BUFSIZE, "_", " ");
-			logcommand(si, CMDLOG_REQUEST, "ACTIVATE: \2%s\2", nick);
-			snprintf(buf, BUFSIZE, "[%s - %s] %s", subject2, l->creator, l->text);
-
-			mowgli_node_delete(n, &as_reqlist);
+		subject2 = sstrdup(l->subject);
+		replace(subject2, BUFSIZE, "_", " ");
+		logcommand(si, CMDLOG_REQUEST, "ACTIVATE: \2%s\2", nick);
+		snprintf(buf, BUFSIZE, "[%s - %s] %s", subject2, l->creator, l->text);
 
-			sfree(subject2);
-			strshare_unref(l->nick);
-			sfree(l->subject);
-			strshare_unref(l->creator);
-			sfree(l->text);
-			sfree(l);
+		sfree(subject2);
+		asreq_delete(l);
 
-			notice_global_sts(si->service->me, "*", buf);
-			return;
-		}
+		notice_global_sts(si->service->me, "*", buf);
+		return;
 	}
 
 	command_success_nodata(si, _("Nick \2%s\2 not found in announce request database."), nick);
@@ -241,7 +243,6 @@ as_cmd_reject(sourceinfo_t *si, int parc, char *parv[])
 	char *nick = parv[0];
 	user_t *u;
 	asreq_t *l;
-	mowgli_node_t *n;
 
 	if (!nick)
 	{
@@ -250,25 +251,14 @@ as_cmd_reject(sourceinfo_t *si, int parc, char *parv[])
 		return;
 	}
 
-
-	MOWGLI_LIST_FOREACH(n, as_reqlist.head)
+	if ((l = asreq_find(nick)) != NULL)
 	{
-		l = n->data;
+		if ((u = user_find_named(nick)) != NULL)
+			notice(si->service->nick, u->nick, "[auto memo] Your requested announcement has been rejected.");
+		logcommand(si, CMDLOG_REQUEST, "REJECT: \2%s\2", nick);
 
-		if (!irccasecmp(l->nick, nick))
-		{
-			if ((u = user_find_named(nick)) != NULL)
-				notice(si->service->nick, u->nick, "[auto memo] Your requested announcement has been rejected.");
-			logcommand(si, CMDLOG_REQUEST, "REJECT: \2%s\2", nick);
-
-			mowgli_node_delete(n, &as_reqlist);
-			strshare_unref(l->nick);
-			sfree(l->subject);
-			strshare_unref(l->creator);
-			sfree(l->text);
-			sfree(l);
-			return;
-		}
+		asreq_delete(l);
+		return;
 	}
 
 	command_success_nodata(si, _("Nick \2%s\2 not found in announcement request database."), nick);
@@ -306,33 +296,18 @@ static void
 as_cmd_cancel(sourceinfo_t *si, int parc, char *parv[])
 {
 	asreq_t *l;
-	mowgli_node_t *n;
-	stringref target;
-
-	target = entity(si->smu)->name;
-
-        MOWGLI_LIST_FOREACH(n, as_reqlist.head)
-        {
-                l = n->data;
-
-                if (!irccasecmp(l->nick, target))
-		{
-			mowgli_node_delete(n, &as_reqlist);
 
-			strshare_unref(l->nick);
-			strshare_unref(l->creator);
-			sfree(l->subject);
-			sfree(l->text);
-			sfree(l);
+	if ((l = asreq_find(entity(si->smu)->name)) == NULL)
+	{
+		command_fail(si, fault_badparams, _("You do not have a pending announcement to cancel."));
+		return;
+	}
 
-			command_success_nodata(si, "Your pending announcement has been canceled.");
+	asreq_delete(l);
 
-			logcommand(si, CMDLOG_REQUEST, "CANCEL");
-			return;
-                }
-        }
+	command_success_nodata(si, "Your pending announcement has been canceled.");
 
-	command_fail(si, fault_badparams, _("You do not have a pending announcement to cancel."));
+	logcommand(si, CMDLOG_REQUEST, "CANCEL");
 }
 
 static command_t as_help = {
@@ -392,6 +367,8 @@ static command_t as_cancel = {
 static void
 mod_init(module_t *const restrict m)
 {
+	as_reqs = mowgli_patricia_create(irccasecanon);
+
 	announcesvs = service_add("announceserv", NULL);
 
 	hook_add_event("user_drop");
@@ -430,6 +407,11 @@ mod_deinit(const module_unload_intent_t intent)
 		service_delete(announcesvs);
 		announcesvs = NULL;
 	}
+
+	while (as_reqlist.head != NULL)
+		asreq_delete(as_reqlist.head->data);
+
+	mowgli_patricia_destroy(as_reqs, NULL, NULL);
 }
 
 VENDOR_DECLARE_MODULE_V1("contrib/ircd_announceserv", MODULE_UNLOAD_CAPABILITY_OK, CONTRIB_VENDOR_JD_AND_TAROS)
@@ -12,6 +12,125 @@
 #  include "uplink.h"
 #endif
 
+#define AJOIN_PRIVDATA          "ajoin:list"
+
+/* The parsed form of private:autojoin, kept in the account's private data
+ * so that identifying does not have to re-tokenize the metadata string.
+ * It is dropped whenever this module changes the list.
+ */
+struct ajoin_list {
+	myuser_t *mu;
+	mowgli_list_t chans;
+	mowgli_node_t node;
+};
+
+static mowgli_list_t ajoin_lists;
+
+/* channels per account; 0 means no limit */
+static unsigned int ajoin_max = 50;
+
+static struct ajoin_list *
+ajoin_list_of(myuser_t *mu)
+{
+	struct ajoin_list *al;
+	metadata_t *md;
+	char *buf, *chan;
+
+	if ((al = privatedata_get(mu, AJOIN_PRIVDATA)) != NULL)
+		return al;
+
+	al = smalloc(sizeof *al);
+	memset(al, 0, sizeof *al);
+	al->mu = mu;
+
+	if ((md = metadata_find(mu, "private:autojoin")))
+	{
+		buf = sstrdup(md->value);
+
+		for (chan = strtok(buf, " ,"); chan != NULL; chan = strtok(NULL, " ,"))
+			mowgli_node_add(sstrdup(chan), mowgli_node_create(), &al->chans);
+
+		sfree(buf);
+	}
+
+	privatedata_set(mu, AJOIN_PRIVDATA, al);
+	mowgli_node_add(al, &al->node, &ajoin_lists);
+
+	return al;
+}
+
+static void
+ajoin_list_free(struct ajoin_list *al)
+{
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, al->chans.head)
+	{
+		sfree(n->data);
+		mowgli_node_delete(n, &al->chans);
+		mowgli_node_free(n);
+	}
+
+	mowgli_node_delete(&al->node, &ajoin_lists);
+	sfree(al);
+}
+
+static void
+ajoin_list_invalidate(myuser_t *mu)
+{
+	struct ajoin_list *al;
+
+	if ((al = privatedata_delete(mu, AJOIN_PRIVDATA)) != NULL)
+		ajoin_list_free(al);
+}
+
+static mowgli_node_t *
+ajoin_list_find(struct ajoin_list *al, const char *chan)
+{
+	mowgli_node_t *n;
+
+	MOWGLI_ITER_FOREACH(n, al->chans.head)
+	{
+		if (!irccasecmp(n->data, chan))
+			return n;
+	}
+
+	return NULL;
+}
+
+/* writes al back to private:autojoin and drops the cached copy */
+static void
+ajoin_list_store(struct ajoin_list *al)
+{
+	myuser_t *mu = al->mu;
+	mowgli_node_t *n;
+	size_t len = 0;
+	char *buf;
+
+	MOWGLI_ITER_FOREACH(n, al->chans.head)
+		len += strlen(n->data) + 1;
+
+	metadata_delete(mu, "private:autojoin");
+
+	if (len)
+	{
+		buf = smalloc(len);
+		*buf = '\0';
+
+		MOWGLI_ITER_FOREACH(n, al->chans.head)
+		{
+			if (*buf != '\0')
+				mowgli_strlcat(buf, ",", len);
+			mowgli_strlcat(buf, n->data, len);
+		}
+
+		metadata_add(mu, "private:autojoin", buf);
+		sfree(buf);
+	}
+
+	ajoin_list_invalidate(mu);
+}
+
 static void
 ns_cmd_ajoin_syntaxerr(sourceinfo_t *si)
 {
@@ -22,9 +141,8 @@ ns_cmd_ajoin_syntaxerr(sourceinfo_t *si)
 static void
 ns_cmd_ajoin(sourceinfo_t *si, int parc, char *parv[])
 {
-	char buf[512];
-	char *chan;
-	metadata_t *md;
+	struct ajoin_list *al;
+	mowgli_node_t *n;
 
 	if (!parv[0])
 		return ns_cmd_ajoin_syntaxerr(si);
@@ -33,17 +151,10 @@ ns_cmd_ajoin(sourceinfo_t *si, int parc, char *parv[])
 	{
 		command_success_nodata(si, "\2AJOIN LIST\2:");
 
-		if ((md = metadata_find(si->smu, "private:autojoin")))
-		{
-			mowgli_strlcpy(buf, md->value, sizeof buf);
-			chan = strtok(buf, ",");
-
-			while (chan != NULL)
-			{
-				command_success_nodata(si, "%s", chan);
-				chan = strtok(NULL, ",");
-			}
-		}
+		al = ajoin_list_of(si->smu);
+
+		MOWGLI_ITER_FOREACH(n, al->chans.head)
+			command_success_nodata(si, "%s", (char *)n->data);
 
 		command_success_nodata(si, _("End of \2AJOIN LIST\2"));
 	}
@@ -52,45 +163,29 @@ ns_cmd_ajoin(sourceinfo_t *si, int parc, char *parv[])
 		if (!parv[1])
 			return ns_cmd_ajoin_syntaxerr(si);
 
-		if ((md = metadata_find(si->smu, "private:autojoin")))
+		al = ajoin_list_of(si->smu);
+
+		if (ajoin_list_find(al, parv[1]) != NULL)
 		{
-			mowgli_strlcpy(buf, md->value, sizeof buf);
-			chan = strtok(buf, ",");
-
-			while (chan != NULL)
-			{
-				if (!strcasecmp(chan, parv[1]))
-				{
-					command_fail(si, fault_badparams, _("%s is already on your AJOIN list."), parv[1]);
-					return;
-				}
-
-				chan = strtok(NULL, ",");
-			}
-
-			// Little arbitrary, but stop both overflow and RAM consumption going out of control
-			if (strlen(md->value) + strlen(parv[1]) > 400)
-			{
-				command_fail(si, fault_badparams, _("Sorry, you have too many AJOIN entries set."));
-				return;
-			}
-
-			mowgli_strlcpy(buf, md->value, sizeof buf);
-			mowgli_strlcat(buf, ",", sizeof buf);
-			mowgli_strlcat(buf, parv[1], sizeof buf);
-			metadata_delete(si->smu, "private:autojoin");
-			metadata_add(si->smu, "private:autojoin", buf);
+			command_fail(si, fault_badparams, _("%s is already on your AJOIN list."), parv[1]);
+			return;
 		}
-		else
+
+		if (ajoin_max && MOWGLI_LIST_LENGTH(&al->chans) >= ajoin_max)
 		{
-			metadata_add(si->smu, "private:autojoin", parv[1]);
+			command_fail(si, fault_toomany, _("Your AJOIN list is full (%u channels)."), ajoin_max);
+			return;
 		}
 
+		mowgli_node_add(sstrdup(parv[1]), mowgli_node_create(), &al->chans);
+		ajoin_list_store(al);
+
 		command_success_nodata(si, _("%s added to AJOIN successfully."), parv[1]);
 	}
 	else if (!strcasecmp(parv[0], "CLEAR"))
 	{
 		metadata_delete(si->smu, "private:autojoin");
+		ajoin_list_invalidate(si->smu);
 		command_success_nodata(si, _("AJOIN list cleared successfully."));
 	}
 	else if (!strcasecmp(parv[0], "DEL"))
@@ -98,110 +193,86 @@ ns_cmd_ajoin(sourceinfo_t *si, int parc, char *parv[])
 		if (!parv[1])
 			return ns_cmd_ajoin_syntaxerr(si);
 
-		if (!(md = metadata_find(si->smu, "private:autojoin")))
-		{
-			command_fail(si, fault_badparams, _("%s is not on your AJOIN list."), parv[1]);
-			return;
-		}
-
-		// Thanks to John Brooks for his help with this.
-		char *list = md->value;
-		char *remove1 = parv[1];
-
-		int listlen = 0;
-		int rmlen = 0;
-		int itempos = 0;
-		int i = 0, j = 0;
+		al = ajoin_list_of(si->smu);
 
-		// This loop will find the item (if present), find the length of the item,
-		// and find the length of the entire string.
-		for (; list[i]; i++)
-		{
-			if (!rmlen)
-			{
-				// We have not found the string yet
-				if (tolower(list[i]) == tolower(remove1[j]))
-				{
-					if (j == 0)
-					{
-						// First character of a potential match; remember it's location
-						itempos = i;
-					}
-
-					j++;
-
-					if (!remove1[j])
-					{
-						// Found the entire string
-						rmlen = j;
-					}
-				}
-				else
-					j = 0;
-			}
-		}
-
-		if (remove1[j])
+		if ((n = ajoin_list_find(al, parv[1])) == NULL)
 		{
 			command_fail(si, fault_badparams, _("%s is not on your AJOIN list."), parv[1]);
 			return;
 		}
 
-		listlen = i;
-
-		// listlen is the length of the list, rmlen is the length of the item to remove,
-		// itempos is the beginning of that item.
-		if (!list[itempos + rmlen])
-		{
-			// This item is the last item in the list, so we can simply truncate
-			if (itempos > 0)
-			{
-				itempos--;
-				list[itempos] = '\0';
-			}
-			else
-				metadata_delete(si->smu, "private:autojoin");
-		}
-		else
-		{
-			// There are items after this one, so we must copy memory
-			// Account for the comma following this item (if there is a space,
-			// account for that too, depends on how you format your list)
-			rmlen += 1;
-			memmove(list + itempos, list + itempos + rmlen, listlen - rmlen - itempos);
-			list[listlen - rmlen] = '\0';
-		}
+		sfree(n->data);
+		mowgli_node_delete(n, &al->chans);
+		mowgli_node_free(n);
+		ajoin_list_store(al);
 
 		command_success_nodata(si, _("%s removed from AJOIN successfully."), parv[1]);
 	}
 }
 
+static void
+ajoin_svsjoin(user_t *u, const char *chans)
+{
+	if(ircd->type == PROTOCOL_ELEMENTAL_IRCD)
+	{
+		sts(":%s ENCAP * SVSJOIN %s %s", ME, CLIENT_NAME(u), chans);
+	}
+	else
+	{
+		sts(":%s SVSJOIN %s %s", CLIENT_NAME(nicksvs.me->me), CLIENT_NAME(u), chans);
+	}
+}
+
 static void
 ajoin_on_identify(user_t *u)
 {
-	myuser_t *mu = u->myuser;
-	metadata_t *md;
-	char buf[512];
-	char *chan;
+	struct ajoin_list *al;
+	mowgli_node_t *n;
+	char buf[BUFSIZE];
+	size_t len = 0, chanlen, maxlen;
+	const char *chan;
+
+	al = ajoin_list_of(u->myuser);
 
-	if (!(md = metadata_find(mu, "private:autojoin")))
+	if (MOWGLI_LIST_LENGTH(&al->chans) == 0)
 		return;
 
-	mowgli_strlcpy(buf, md->value, sizeof buf);
-	chan = strtok(buf, " ,");
-	while (chan != NULL)
+	/* InspIRCd's SVSJOIN takes a single channel */
+	if (ircd->type == PROTOCOL_INSPIRCD)
 	{
-		if(ircd->type == PROTOCOL_ELEMENTAL_IRCD)
-		{
-			sts(":%s ENCAP * SVSJOIN %s %s", ME, CLIENT_NAME(u), chan);
-		}
-		else
+		MOWGLI_ITER_FOREACH(n, al->chans.head)
+			ajoin_svsjoin(u, n->data);
+		return;
+	}
+
+	/* everyone else gets comma-joined lists, as many channels per line as fit in 510 bytes */
+	if(ircd->type == PROTOCOL_ELEMENTAL_IRCD)
+		maxlen = 510 - strlen(":") - strlen(ME) - strlen(" ENCAP * SVSJOIN ") - strlen(CLIENT_NAME(u)) - 1;
+	else
+		maxlen = 510 - strlen(":") - strlen(CLIENT_NAME(nicksvs.me->me)) - strlen(" SVSJOIN ") - strlen(CLIENT_NAME(u)) - 1;
+
+	MOWGLI_ITER_FOREACH(n, al->chans.head)
+	{
+		chan = n->data;
+		chanlen = strlen(chan);
+
+		if (len && len + 1 + chanlen > maxlen)
 		{
-			sts(":%s SVSJOIN %s %s", CLIENT_NAME(nicksvs.me->me), CLIENT_NAME(u), chan);
+			ajoin_svsjoin(u, buf);
+			len = 0;
 		}
 
-		chan = strtok(NULL, ",");
+		len += snprintf(buf + len, sizeof buf - len, "%s%s", len ? "," : "", chan);
 	}
+
+	if (len)
+		ajoin_svsjoin(u, buf);
+}
+
+static void
+ajoin_on_myuser_delete(myuser_t *mu)
+{
+	ajoin_list_invalidate(mu);
 }
 
 static command_t ns_ajoin = {
@@ -216,18 +287,33 @@ static command_t ns_ajoin = {
 static void
 mod_init(module_t *const restrict m)
 {
+	MODULE_TRY_REQUEST_DEPENDENCY(m, "nickserv/main");
+
+	add_uint_conf_item("AJOIN_MAX", &nicksvs.me->conf_table, 0, &ajoin_max, 0, 1000, 50);
+
 	hook_add_event("user_identify");
 	hook_add_user_identify(ajoin_on_identify);
 
+	hook_add_event("myuser_delete");
+	hook_add_myuser_delete(ajoin_on_myuser_delete);
+
 	service_named_bind_command("nickserv", &ns_ajoin);
 }
 
 static void
 mod_deinit(const module_unload_intent_t intent)
 {
+	mowgli_node_t *n, *tn;
+
 	hook_del_user_identify(ajoin_on_identify);
+	hook_del_myuser_delete(ajoin_on_myuser_delete);
+
+	del_conf_item("AJOIN_MAX", &nicksvs.me->conf_table);
 
 	service_named_unbind_command("nickserv", &ns_ajoin);
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, ajoin_lists.head)
+		ajoin_list_invalidate(((struct ajoin_list *)n->data)->mu);
 }
 
 SIMPLE_DECLARE_MODULE_V1("contrib/ns_ajoin", MODULE_UNLOAD_CAPABILITY_OK)
@@ -7,39 +7,99 @@
 
 #include "atheme-compat.h"
 
-#define	LAMENESS_WEIGHT		0.35f
+#define NICKSCORE_WORDS         ((COMPAT_NICKLEN + sizeof(uint64_t)) / sizeof(uint64_t))
+#define NICKSCORE_BENCH_NICKS   65536
+
+/* CLEANNICKBENCH runs on the main loop; this keeps it well under a second */
+#define NICKSCORE_BENCH_MAX     5000000U
+
+/* weights are in hundredths of a penalty point per character */
+static unsigned int cleannick_upper_weight = 100;
+static unsigned int cleannick_digit_weight = 0;
+static unsigned int cleannick_symbol_weight = 0;
+static unsigned int cleannick_threshold = 35;
+
+/* penalty of each byte value; NUL scores nothing so padding is free */
+static unsigned int nick_penalty[256];
+
+static void
+nickscore_build_table(void *unused)
+{
+	unsigned int c;
+
+	for (c = 1; c < 256; c++)
+	{
+		if (IsUpper(c))
+			nick_penalty[c] = cleannick_upper_weight;
+		else if (IsDigit(c))
+			nick_penalty[c] = cleannick_digit_weight;
+		else if (!IsAlpha(c))
+			nick_penalty[c] = cleannick_symbol_weight;
+		else
+			nick_penalty[c] = 0;
+	}
+
+	nick_penalty[0] = 0;
+}
+
+/*
+ * Sum the penalties of a nickname. The nick is copied into a zero-padded
+ * buffer once, which also yields its length, and then scored eight bytes
+ * per load with no per-character branches.
+ */
+static unsigned int
+nickname_penalty(const char *nickname, size_t *lenp)
+{
+	uint64_t words[NICKSCORE_WORDS];
+	unsigned int sum = 0;
+	size_t len, i;
+
+	memset(words, 0, sizeof words);
+
+	if ((len = mowgli_strlcpy((char *) words, nickname, sizeof words)) >= sizeof words)
+		len = sizeof words - 1;
+
+	for (i = 0; i <= len / sizeof(uint64_t); i++)
+	{
+		const uint64_t w = words[i];
+
+		sum += nick_penalty[w & 0xff] + nick_penalty[(w >> 8) & 0xff]
+		     + nick_penalty[(w >> 16) & 0xff] + nick_penalty[(w >> 24) & 0xff]
+		     + nick_penalty[(w >> 32) & 0xff] + nick_penalty[(w >> 40) & 0xff]
+		     + nick_penalty[(w >> 48) & 0xff] + nick_penalty[w >> 56];
+	}
+
+	*lenp = len;
+
+	return sum;
+}
 
 /*
- * Determine if a nickname is lame.  Non-alphabetical characters
- * are penalized twice, uppercase characters are penalized once.
+ * Determine if a nickname is lame: its average penalty per character
+ * exceeds the threshold. By default only uppercase characters are
+ * penalized.
  */
 static bool
 is_nickname_lame(const char *nickname)
 {
-	const char *p;
-	unsigned int capcount = 0;
-	float score;
+	unsigned int penalty;
+	size_t len;
+	bool lame;
 
 	return_val_if_fail(nickname != NULL, false);
 
-	for (p = nickname; *p != '\0'; p++)
-	{
-		if (IsUpper(*p))
-			capcount++;
+	penalty = nickname_penalty(nickname, &len);
 
-#ifdef NOTYET
-		if (!IsAlpha(*p))
-			capcount += 2;
-#endif
-	}
+	if (len == 0)
+		return false;
 
-	score = (float) capcount / (float) strlen(nickname);
-	slog(LG_DEBUG, "is_nickname_lame(%s): score %0.3f %u/%zu caps", nickname, score, capcount, strlen(nickname));
+	lame = penalty > cleannick_threshold * len;
 
-	if (score > LAMENESS_WEIGHT)
-		return true;
+	if (log_debug_enabled())
+		slog(LG_DEBUG, "is_nickname_lame(%s): penalty %u over %zu chars (threshold %u per char)",
+			nickname, penalty, len, cleannick_threshold);
 
-	return false;
+	return lame;
 }
 
 /*
@@ -93,21 +153,115 @@ user_state_changed(hook_user_nick_t *data)
 	}
 }
 
+/* xorshift64; the benchmark wants the same nicks on every run, not good randomness */
+static uint64_t
+nickscore_bench_next(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+
+	return *state;
+}
+
+static void
+os_cmd_cleannickbench(sourceinfo_t *si, int parc, char *parv[])
+{
+	static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789[]\\`_^{|}-";
+	unsigned long count = 1000000, i, lame = 0;
+	uint64_t state = UINT64_C(0x9e3779b97f4a7c15);
+	struct timespec start, end;
+	char *nicks, *end_ptr;
+	double secs;
+
+	if (parc > 0)
+	{
+		count = strtoul(parv[0], &end_ptr, 10);
+
+		if (*end_ptr != '\0' || count < 1 || count > NICKSCORE_BENCH_MAX)
+		{
+			command_fail(si, fault_badparams, STR_INVALID_PARAMS, "CLEANNICKBENCH");
+			command_fail(si, fault_badparams, _("Syntax: CLEANNICKBENCH [1-%u nicks]"), NICKSCORE_BENCH_MAX);
+			return;
+		}
+	}
+
+	/* generate a fixed pool up front so only scoring is timed */
+	nicks = smalloc(NICKSCORE_BENCH_NICKS * (COMPAT_NICKLEN + 1));
+
+	for (i = 0; i < NICKSCORE_BENCH_NICKS; i++)
+	{
+		char *nick = nicks + i * (COMPAT_NICKLEN + 1);
+		size_t len = 3 + nickscore_bench_next(&state) % (COMPAT_NICKLEN - 2), j;
+
+		for (j = 0; j < len; j++)
+			nick[j] = alphabet[nickscore_bench_next(&state) % (sizeof alphabet - 1)];
+
+		nick[len] = '\0';
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < count; i++)
+		lame += is_nickname_lame(nicks + (i % NICKSCORE_BENCH_NICKS) * (COMPAT_NICKLEN + 1));
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	sfree(nicks);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	logcommand(si, CMDLOG_ADMIN, "CLEANNICKBENCH: \2%lu\2 nicks", count);
+	command_success_nodata(si, _("Scored \2%lu\2 nicks in %.3fs: \2%.0f\2 nicks/sec, %.1fns each, %lu (%.1f%%) lame."),
+		count, secs, count / secs, secs * 1e9 / count, lame, 100.0 * lame / count);
+}
+
+static command_t os_cleannickbench = {
+	.name           = "CLEANNICKBENCH",
+	.desc           = N_("Measures nickname quality scoring speed."),
+	.access         = PRIV_ADMIN,
+	.maxparc        = 1,
+	.cmd            = &os_cmd_cleannickbench,
+	.help           = { .path = "contrib/cleannickbench" },
+};
+
 static void
 mod_init(module_t *const restrict m)
 {
+	MODULE_TRY_REQUEST_DEPENDENCY(m, "nickserv/main");
+
+	add_uint_conf_item("CLEANNICK_UPPER_WEIGHT", &nicksvs.me->conf_table, 0, &cleannick_upper_weight, 0, 1000, 100);
+	add_uint_conf_item("CLEANNICK_DIGIT_WEIGHT", &nicksvs.me->conf_table, 0, &cleannick_digit_weight, 0, 1000, 0);
+	add_uint_conf_item("CLEANNICK_SYMBOL_WEIGHT", &nicksvs.me->conf_table, 0, &cleannick_symbol_weight, 0, 1000, 0);
+	add_uint_conf_item("CLEANNICK_THRESHOLD", &nicksvs.me->conf_table, 0, &cleannick_threshold, 0, 1000, 35);
+
+	nickscore_build_table(NULL);
+
+	hook_add_event("config_ready");
+	hook_add_config_ready(nickscore_build_table);
+
 	hook_add_event("user_add");
 	hook_add_user_add(user_state_changed);
 
 	hook_add_event("user_nickchange");
 	hook_add_user_nickchange(user_state_changed);
+
+	service_named_bind_command("operserv", &os_cleannickbench);
 }
 
 static void
 mod_deinit(const module_unload_intent_t intent)
 {
+	hook_del_config_ready(nickscore_build_table);
 	hook_del_user_add(user_state_changed);
 	hook_del_user_nickchange(user_state_changed);
+
+	del_conf_item("CLEANNICK_UPPER_WEIGHT", &nicksvs.me->conf_table);
+	del_conf_item("CLEANNICK_DIGIT_WEIGHT", &nicksvs.me->conf_table);
+	del_conf_item("CLEANNICK_SYMBOL_WEIGHT", &nicksvs.me->conf_table);
+	del_conf_item("CLEANNICK_THRESHOLD", &nicksvs.me->conf_table);
+
+	service_named_unbind_command("operserv", &os_cleannickbench);
 }
 
 SIMPLE_DECLARE_MODULE_V1("contrib/ns_cleannick", MODULE_UNLOAD_CAPABILITY_OK)
@@ -3,10 +3,20 @@
  * Rights to this code are as documented in doc/LICENSE.
  *
  * Generates a hash for use as a operserv "password".
+ *
+ * HASHBENCH times the configured password hashing in a child process and
+ * suggests a cost setting that keeps each hash under a latency target.
  */
 
 #include "atheme-compat.h"
 
+#define HASHBENCH_PASSWORD      "hashbench-correct-horse-battery-staple"
+
+static pid_t hashbench_pid = 0;
+static int hashbench_fd = -1;
+static sourceinfo_t *hashbench_si = NULL;
+static bool hashbench_orphaned = false;
+
 static void
 ns_cmd_generatehash(sourceinfo_t *si, int parc, char *parv[])
 {
@@ -29,6 +39,231 @@ ns_cmd_generatehash(sourceinfo_t *si, int parc, char *parv[])
 	logcommand(si, CMDLOG_GET, "GENERATEHASH");
 }
 
+static int
+hashbench_cmp(const void *a, const void *b)
+{
+	const unsigned long *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+/* scales a linear cost parameter (rounds, iterations) to the target */
+static unsigned long
+hashbench_scale(unsigned long cost, unsigned long p99, unsigned long target)
+{
+	const unsigned long long scaled = (unsigned long long) cost * target / (p99 ? p99 : 1);
+
+	return scaled ? scaled : 1;
+}
+
+/* works out the provider and its cost parameter from the hash it produced */
+static void
+hashbench_recommend(char *buf, size_t len, const char *hash, unsigned long p99, unsigned long target)
+{
+	unsigned int cost, prf;
+	const char *p;
+
+	if (sscanf(hash, "$2%*1[aby]$%u$", &cost) == 1)
+	{
+		unsigned int rec = cost;
+		unsigned long t = p99;
+
+		/* each step of bcrypt's cost doubles the work */
+		while (rec < 31 && t * 2 <= target)
+		{
+			t *= 2;
+			rec++;
+		}
+
+		while (rec > 4 && t > target)
+		{
+			t /= 2;
+			rec--;
+		}
+
+		snprintf(buf, len, "Provider bcrypt: recommended cost \2%u\2 (currently %u).", rec, cost);
+	}
+	else if (!strncmp(hash, "$argon2", 7) && (p = strstr(hash, ",t=")) != NULL && sscanf(p, ",t=%u", &cost) == 1)
+		snprintf(buf, len, "Provider argon2: recommended time cost \2%lu\2 (currently %u).",
+			hashbench_scale(cost, p99, target), cost);
+	else if (sscanf(hash, "$z$%u$%u$", &prf, &cost) == 2)
+		snprintf(buf, len, "Provider pbkdf2v2: recommended \2%lu\2 iterations (currently %u).",
+			hashbench_scale(cost, p99, target), cost);
+	else if (!strncmp(hash, "$5$", 3) || !strncmp(hash, "$6$", 3))
+	{
+		/* crypt(3) uses 5000 rounds unless told otherwise */
+		if (sscanf(hash + 3, "rounds=%u$", &cost) != 1)
+			cost = 5000;
+
+		snprintf(buf, len, "Provider sha2-crypt: recommended \2%lu\2 rounds (currently %u).",
+			hashbench_scale(cost, p99, target), cost);
+	}
+	else
+		snprintf(buf, len, "No tunable cost parameter recognised in hash format %.8s...", hash);
+}
+
+/* child side: hash, time, and write the report lines to fd */
+static void ATHEME_FATTR_NORETURN
+hashbench_run(int fd, unsigned int count, unsigned long target)
+{
+	char report[BUFSIZE * 2], hash[BUFSIZE];
+	unsigned long *lat, total = 0;
+	unsigned int i;
+	size_t len;
+
+	lat = smalloc(count * sizeof *lat);
+
+	for (i = 0; i < count; i++)
+	{
+		struct timespec start, end;
+		const char *h;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		h = crypt_password(HASHBENCH_PASSWORD);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		if (h == NULL)
+		{
+			len = snprintf(report, sizeof report, "Hash generation failure -- is a crypto module loaded?\n");
+			_exit(write(fd, report, len) < 0 ? 2 : 1);
+		}
+
+		if (i == 0)
+			mowgli_strlcpy(hash, h, sizeof hash);
+
+		lat[i] = (end.tv_sec - start.tv_sec) * 1000000UL + (end.tv_nsec - start.tv_nsec) / 1000;
+		total += lat[i];
+	}
+
+	qsort(lat, count, sizeof *lat, hashbench_cmp);
+
+	len = snprintf(report, sizeof report, "%u hashes in %lu.%03lus: \2%.1f\2 hashes/sec, p50 %lu.%03lums, p99 \2%lu.%03lums\2\n",
+		count, total / 1000000, total / 1000 % 1000, total ? count * 1e6 / total : 0.0,
+		lat[count / 2] / 1000, lat[count / 2] % 1000,
+		lat[count * 99 / 100] / 1000, lat[count * 99 / 100] % 1000);
+
+	hashbench_recommend(report + len, sizeof report - len - 1, hash, lat[count * 99 / 100], target * 1000);
+	mowgli_strlcat(report, "\n", sizeof report);
+
+	_exit(write(fd, report, strlen(report)) < 0 ? 1 : 0);
+}
+
+static void
+hashbench_done(pid_t pid, int status, void *data)
+{
+	char buf[BUFSIZE * 2], *line, *saveptr = NULL;
+	ssize_t n, len = 0;
+
+	/* the child has exited, so everything it wrote is already in the pipe */
+	while (len < (ssize_t) sizeof buf - 1 && (n = read(hashbench_fd, buf + len, sizeof buf - 1 - len)) > 0)
+		len += n;
+
+	buf[len] = '\0';
+
+	/* the requester quit and the child was killed; there is nobody to tell */
+	if (!hashbench_orphaned)
+	{
+		for (line = strtok_r(buf, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr))
+			command_success_nodata(hashbench_si, "HASHBENCH: %s", line);
+
+		if (len == 0)
+			command_fail(hashbench_si, fault_internalerror, _("HASHBENCH: the benchmark process failed."));
+	}
+
+	close(hashbench_fd);
+	atheme_object_unref(hashbench_si);
+
+	hashbench_fd = -1;
+	hashbench_si = NULL;
+	hashbench_pid = 0;
+	hashbench_orphaned = false;
+}
+
+/* never report to a user or account that has gone away while the child ran */
+static void
+hashbench_user_delete(user_t *u)
+{
+	if (hashbench_si == NULL || hashbench_si->su != u)
+		return;
+
+	hashbench_si->su = NULL;
+	hashbench_si->smu = NULL;
+	hashbench_orphaned = true;
+
+	kill(hashbench_pid, SIGTERM);
+}
+
+static void
+hashbench_myuser_delete(myuser_t *mu)
+{
+	if (hashbench_si != NULL && hashbench_si->smu == mu)
+		hashbench_si->smu = NULL;
+}
+
+static void
+ns_cmd_hashbench(sourceinfo_t *si, int parc, char *parv[])
+{
+	unsigned long count = 20, target = 100;
+	char *end;
+	int fds[2];
+	pid_t pid;
+
+	if (hashbench_pid)
+	{
+		command_fail(si, fault_toomany, _("A HASHBENCH is already in progress."));
+		return;
+	}
+
+	if (parc > 0)
+		count = strtoul(parv[0], &end, 10);
+
+	if (parc > 0 && (*end != '\0' || count < 1 || count > 1000))
+		goto syntax;
+
+	if (parc > 1)
+		target = strtoul(parv[1], &end, 10);
+
+	if (parc > 1 && (*end != '\0' || target < 1 || target > 10000))
+		goto syntax;
+
+	if (pipe(fds) == -1)
+	{
+		command_fail(si, fault_internalerror, _("HASHBENCH: pipe() failed: %s"), strerror(errno));
+		return;
+	}
+
+	switch (pid = fork())
+	{
+		case -1:
+			command_fail(si, fault_internalerror, _("HASHBENCH: fork() failed: %s"), strerror(errno));
+			close(fds[0]);
+			close(fds[1]);
+			return;
+		case 0:
+			close(fds[0]);
+			connection_close_all_fds();
+			hashbench_run(fds[1], count, target);
+		default:
+			close(fds[1]);
+			childproc_add(pid, "hashbench", hashbench_done, NULL);
+
+			hashbench_pid = pid;
+			hashbench_fd = fds[0];
+			hashbench_si = si;
+			atheme_object_ref(si);
+			break;
+	}
+
+	logcommand(si, CMDLOG_ADMIN, "HASHBENCH: \2%lu\2 hashes, \2%lu\2ms target", count, target);
+	command_success_nodata(si, _("Timing \2%lu\2 password hashes in the background (target \2%lu\2ms per hash)."),
+		count, target);
+	return;
+
+syntax:
+	command_fail(si, fault_badparams, STR_INVALID_PARAMS, "HASHBENCH");
+	command_fail(si, fault_badparams, _("Syntax: HASHBENCH [1-1000 hashes] [1-10000 ms target]"));
+}
+
 static command_t ns_generatehash = {
 	.name           = "GENERATEHASH",
 	.desc           = N_("Generates a hash for SOPER."),
@@ -38,16 +273,45 @@ static command_t ns_generatehash = {
 	.help           = { .path = "contrib/generatehash" },
 };
 
+static command_t ns_hashbench = {
+	.name           = "HASHBENCH",
+	.desc           = N_("Measures password hashing speed and suggests a cost."),
+	.access         = PRIV_ADMIN,
+	.maxparc        = 2,
+	.cmd            = &ns_cmd_hashbench,
+	.help           = { .path = "contrib/hashbench" },
+};
+
 static void
 mod_init(module_t *const restrict m)
 {
 	service_named_bind_command("nickserv", &ns_generatehash);
+	service_named_bind_command("nickserv", &ns_hashbench);
+
+	hook_add_event("user_delete");
+	hook_add_user_delete(hashbench_user_delete);
+
+	hook_add_event("myuser_delete");
+	hook_add_myuser_delete(hashbench_myuser_delete);
 }
 
 static void
 mod_deinit(const module_unload_intent_t intent)
 {
 	service_named_unbind_command("nickserv", &ns_generatehash);
+	service_named_unbind_command("nickserv", &ns_hashbench);
+
+	hook_del_user_delete(hashbench_user_delete);
+	hook_del_myuser_delete(hashbench_myuser_delete);
+
+	childproc_delete_all(hashbench_done);
+
+	if (hashbench_pid)
+	{
+		kill(hashbench_pid, SIGTERM);
+		close(hashbench_fd);
+		atheme_object_unref(hashbench_si);
+	}
 }
 
 SIMPLE_DECLARE_MODULE_V1("contrib/ns_generatehash", MODULE_UNLOAD_CAPABILITY_OK)
@@ -7,12 +7,213 @@
 
 #include "atheme-compat.h"
 
-struct sendpassmail_state
+/* key hashing runs in up to this many child processes per request */
+#define SENDPASSMAIL_WORKERS		4
+#define SENDPASSMAIL_MAX_BATCHES	8
+
+/* workers still running this many seconds after the request are killed */
+#define SENDPASSMAIL_DEADLINE		60
+
+#define SENDPASSMAIL_PRIVDATA		"sendpassmail:indexed"
+
+/* the sweep re-checks this many indexed accounts per second */
+#define SENDPASSMAIL_SWEEP_BATCH	1000
+
+/*
+ * email_canonical -> accounts, used as a lookup hint so a SENDPASSMAIL
+ * only touches the accounts filed under the address. It is built by one
+ * walk on first use and updated on register, delete and login. Atheme has
+ * no hook for address changes, so an account whose address changed is
+ * refiled when it is next seen here: by a lookup of its old address, at
+ * its next login, or by a sweep that re-checks SENDPASSMAIL_SWEEP_BATCH
+ * indexed accounts per second. Until then a lookup of its new address
+ * misses it. Accounts created without the user_register hook are indexed
+ * at their first login.
+ */
+struct email_entry
 {
-	sourceinfo_t *origin;
-	stringref email_canonical;
+	myuser_t *mu;
+	stringref filed;
+	mowgli_node_t addr_node;	/* in the list for its address */
+	mowgli_node_t sweep_node;	/* in email_entries */
 };
 
+static mowgli_patricia_t *email_index = NULL;
+static mowgli_list_t email_entries;
+static mowgli_node_t *email_sweep_next = NULL;
+static mowgli_eventloop_timer_t *email_sweep_timer = NULL;
+
+static void
+email_index_file(struct email_entry *e)
+{
+	mowgli_list_t *l;
+
+	e->filed = strshare_ref(e->mu->email_canonical);
+
+	if ((l = mowgli_patricia_retrieve(email_index, e->filed)) == NULL)
+	{
+		l = mowgli_list_create();
+		mowgli_patricia_add(email_index, e->filed, l);
+	}
+
+	mowgli_node_add(e, &e->addr_node, l);
+}
+
+static void
+email_index_unfile(struct email_entry *e)
+{
+	mowgli_list_t *l;
+
+	if ((l = mowgli_patricia_retrieve(email_index, e->filed)) != NULL)
+	{
+		mowgli_node_delete(&e->addr_node, l);
+
+		if (MOWGLI_LIST_LENGTH(l) == 0)
+		{
+			mowgli_patricia_delete(email_index, e->filed);
+			mowgli_list_free(l);
+		}
+	}
+
+	strshare_unref(e->filed);
+	e->filed = NULL;
+}
+
+static void
+email_index_add(myuser_t *mu)
+{
+	struct email_entry *e;
+
+	if (email_index == NULL || mu->email_canonical == NULL || privatedata_get(mu, SENDPASSMAIL_PRIVDATA) != NULL)
+		return;
+
+	e = smalloc(sizeof *e);
+	memset(e, 0, sizeof *e);
+	e->mu = mu;
+
+	email_index_file(e);
+	mowgli_node_add(e, &e->sweep_node, &email_entries);
+	privatedata_set(mu, SENDPASSMAIL_PRIVDATA, e);
+}
+
+static void
+email_index_remove(myuser_t *mu)
+{
+	struct email_entry *e;
+
+	if ((e = privatedata_delete(mu, SENDPASSMAIL_PRIVDATA)) == NULL)
+		return;
+
+	if (email_sweep_next == &e->sweep_node)
+		email_sweep_next = e->sweep_node.next;
+
+	email_index_unfile(e);
+	mowgli_node_delete(&e->sweep_node, &email_entries);
+	sfree(e);
+}
+
+/* files the account under its current address if that is not where it is */
+static void
+email_index_refile(myuser_t *mu)
+{
+	struct email_entry *e;
+
+	if (email_index == NULL || mu == NULL)
+		return;
+
+	if ((e = privatedata_get(mu, SENDPASSMAIL_PRIVDATA)) == NULL)
+	{
+		email_index_add(mu);
+		return;
+	}
+
+	if (e->filed == mu->email_canonical)
+		return;
+
+	if (mu->email_canonical == NULL)
+	{
+		email_index_remove(mu);
+		return;
+	}
+
+	email_index_unfile(e);
+	email_index_file(e);
+}
+
+static void
+email_index_sweep(void *unused)
+{
+	unsigned int i;
+
+	for (i = 0; i < SENDPASSMAIL_SWEEP_BATCH && MOWGLI_LIST_LENGTH(&email_entries) > 0; i++)
+	{
+		struct email_entry *e;
+
+		if (email_sweep_next == NULL)
+			email_sweep_next = email_entries.head;
+
+		e = email_sweep_next->data;
+		email_sweep_next = email_sweep_next->next;
+
+		email_index_refile(e->mu);
+	}
+}
+
+static void
+email_index_destroy(void)
+{
+	mowgli_node_t *n, *tn;
+
+	if (email_index == NULL)
+		return;
+
+	if (email_sweep_timer != NULL)
+		mowgli_timer_destroy(base_eventloop, email_sweep_timer);
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, email_entries.head)
+		email_index_remove(((struct email_entry *) n->data)->mu);
+
+	mowgli_patricia_destroy(email_index, NULL, NULL);
+	email_index = NULL;
+	email_sweep_timer = NULL;
+}
+
+static int
+email_index_build_cb(myentity_t *mt, void *privdata)
+{
+	email_index_add(user(mt));
+	return 0;
+}
+
+static void
+email_index_build(void)
+{
+	email_index = mowgli_patricia_create(NULL);
+
+	myentity_foreach_t(ENT_USER, email_index_build_cb, NULL);
+
+	email_sweep_timer = mowgli_timer_add(base_eventloop, "sendpassmail_sweep", email_index_sweep, NULL, 1);
+}
+
+static void
+email_index_register(myuser_t *mu)
+{
+	email_index_add(mu);
+}
+
+static void
+email_index_delete(myuser_t *mu)
+{
+	if (email_index != NULL)
+		email_index_remove(mu);
+}
+
+static void
+email_index_identify(user_t *u)
+{
+	email_index_refile(u->myuser);
+}
+
 static bool
 can_sendpass(sourceinfo_t *si, myuser_t *mu)
 {
@@ -43,74 +244,369 @@ can_sendpass(sourceinfo_t *si, myuser_t *mu)
 	return true;
 }
 
-static int
-sendpassmail_foreach_cb(myentity_t *mt, void *privdata)
+/* a batch of keys for one address, hashed by forked workers */
+struct sendpassmail_job
 {
-	struct sendpassmail_state *state = (struct sendpassmail_state *) privdata;
-
-	myuser_t *mu = user(mt);
-	sourceinfo_t *si = state->origin;
-	bool ismarked = false;
+	char *account;
 	char *key;
+	char *hash;
+	bool marked;
+};
 
-	hook_user_needforce_t needforce_hdata;
+struct sendpassmail_worker
+{
+	struct sendpassmail_batch *batch;
+	connection_t *conn;
+	pid_t pid;
+	size_t len;
+	char buf[BUFSIZE];
+};
 
-	needforce_hdata.si = si;
-	needforce_hdata.mu = mu;
-	needforce_hdata.allowed = 1;
+struct sendpassmail_batch
+{
+	sourceinfo_t *si;
+	stringref email_canonical;
+	char *email;
+	struct sendpassmail_job *jobs;
+	size_t count;
+	struct sendpassmail_worker workers[SENDPASSMAIL_WORKERS];
+	unsigned int running;
+	bool orphaned;
+	mowgli_eventloop_timer_t *deadline;
+	mowgli_node_t node;
+};
+
+static mowgli_list_t sendpassmail_batches;
+
+/* the source is held across the hashing; never leave it pointing at a
+ * user or account that has gone away in the meantime
+ */
+static void
+sendpassmail_user_delete(user_t *u)
+{
+	mowgli_node_t *n;
 
-	if (state->email_canonical != mu->email_canonical)
+	MOWGLI_ITER_FOREACH(n, sendpassmail_batches.head)
 	{
-		return 0;
+		struct sendpassmail_batch *b = n->data;
+
+		if (b->si->su != u)
+			continue;
+
+		b->si->su = NULL;
+		b->si->smu = NULL;
+		b->orphaned = true;
 	}
+}
 
-	hook_call_user_needforce(&needforce_hdata);
+static void
+sendpassmail_myuser_delete(myuser_t *mu)
+{
+	mowgli_node_t *n;
 
-	if (!needforce_hdata.allowed || metadata_find(mu, "private:mark:setter"))
+	MOWGLI_ITER_FOREACH(n, sendpassmail_batches.head)
 	{
-		ismarked = true;
+		struct sendpassmail_batch *b = n->data;
+
+		if (b->si->smu == mu)
+			b->si->smu = NULL;
 	}
+}
 
-	if (!can_sendpass(si, mu))
+static void
+sendpassmail_batch_free(struct sendpassmail_batch *b)
+{
+	size_t i;
+
+	if (b->deadline != NULL)
+		mowgli_timer_destroy(base_eventloop, b->deadline);
+
+	for (i = 0; i < SENDPASSMAIL_WORKERS; i++)
+	{
+		if (b->workers[i].conn == NULL)
+			continue;
+
+		kill(b->workers[i].pid, SIGKILL);
+		connection_close(b->workers[i].conn);
+	}
+
+	for (i = 0; i < b->count; i++)
 	{
-		return 0;
+		sfree(b->jobs[i].account);
+		sfree(b->jobs[i].key);
+		sfree(b->jobs[i].hash);
 	}
 
-	key = random_string(12);
+	mowgli_node_delete(&b->node, &sendpassmail_batches);
+	atheme_object_unref(b->si);
+	strshare_unref(b->email_canonical);
+	sfree(b->email);
+	sfree(b->jobs);
+	sfree(b);
+}
+
+/* back on the event loop: send the mails whose key was hashed */
+static void
+sendpassmail_commit(struct sendpassmail_batch *b)
+{
+	sourceinfo_t *si = b->si;
+	bool hashfail = false;
+	size_t i;
+
+	/* nobody left to answer to, and nobody whose privileges can be checked */
+	if (b->orphaned)
+	{
+		slog(LG_INFO, "SENDPASSMAIL: requester for %s quit before the keys were ready; nothing sent", b->email);
+		sendpassmail_batch_free(b);
+		return;
+	}
 
-	const char *const hash = crypt_password(key);
+	/* the requester may have logged in or out while the workers ran;
+	 * can_sendpass() below checks privileges as they are now
+	 */
+	if (si->su != NULL)
+		si->smu = si->su->myuser;
 
-	if (!hash)
+	for (i = 0; i < b->count; i++)
 	{
+		struct sendpassmail_job *job = &b->jobs[i];
+		myuser_t *mu;
+
+		if (job->hash == NULL)
+		{
+			hashfail = true;
+			continue;
+		}
+
+		/* things may have changed while the workers ran */
+		if ((mu = myuser_find(job->account)) == NULL || mu->email_canonical != b->email_canonical)
+			continue;
+
+		if (!can_sendpass(si, mu))
+			continue;
+
+		if (sendemail(si->su != NULL ? si->su : si->service->me, mu, EMAIL_SETPASS, mu->email, job->key))
+		{
+			if (job->marked)
+				wallops("%s used SENDPASSMAIL for the \2MARKED\2 account %s (%s).", get_oper_name(si), entity(mu)->name, mu->email_canonical);
+
+			logcommand(si, CMDLOG_ADMIN, "SENDPASSMAIL: \2%s\2 (\2%s\2) (change key)", entity(mu)->name, mu->email_canonical);
+			metadata_add(mu, "private:sendpass:sender", get_oper_name(si));
+			metadata_add(mu, "private:sendpass:timestamp", int64_to_string(time(NULL)));
+			metadata_add(mu, "private:setpass:key", job->hash);
+		}
+		else
+			logcommand(si, CMDLOG_ADMIN, "SENDPASSMAIL failed sending email to  %s", mu->email_canonical);
+	}
+
+	if (hashfail)
 		command_fail(si, fault_internalerror, _("Hash generation for password change key failed."));
-		sfree(key);
-		return 0;
+
+	command_success_nodata(si, _("A password reset email has been sent for all accounts matching address \2%s\2, if any."), b->email);
+
+	sendpassmail_batch_free(b);
+}
+
+/* each line from a worker is "<job index> <hash>", or "<job index> *" on failure */
+static void
+sendpassmail_worker_line(struct sendpassmail_batch *b, char *line)
+{
+	char *hash;
+	unsigned long i;
+
+	i = strtoul(line, &hash, 10);
+
+	if (*hash != ' ' || i >= b->count || b->jobs[i].hash != NULL)
+		return;
+
+	if (strcmp(++hash, "*"))
+		b->jobs[i].hash = sstrdup(hash);
+}
+
+static void
+sendpassmail_worker_read(connection_t *cptr)
+{
+	struct sendpassmail_worker *w = cptr->userdata;
+	struct sendpassmail_batch *b = w->batch;
+	char *line, *nl;
+	ssize_t n;
+
+	n = read(cptr->fd, w->buf + w->len, sizeof w->buf - 1 - w->len);
+
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+
+	if (n > 0)
+	{
+		w->len += n;
+		w->buf[w->len] = '\0';
+
+		for (line = w->buf; (nl = strchr(line, '\n')) != NULL; line = nl + 1)
+		{
+			*nl = '\0';
+			sendpassmail_worker_line(b, line);
+		}
+
+		w->len -= line - w->buf;
+		memmove(w->buf, line, w->len);
+
+		/* a line longer than the buffer can only be garbage */
+		if (w->len < sizeof w->buf - 1)
+			return;
 	}
-	if (sendemail(si->su != NULL ? si->su : si->service->me, mu, EMAIL_SETPASS, mu->email, key))
+
+	connection_close(cptr);
+	w->conn = NULL;
+
+	if (--b->running == 0)
+		sendpassmail_commit(b);
+}
+
+static void
+sendpassmail_worker_exited(pid_t pid, int status, void *data)
+{
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		slog(LG_ERROR, "SENDPASSMAIL: hashing worker %ld failed with status %d", (long) pid, status);
+}
+
+/* child side: hash every nworkers-th key starting at first and report back */
+static void ATHEME_FATTR_NORETURN
+sendpassmail_worker_run(struct sendpassmail_batch *b, size_t first, size_t nworkers, int fd)
+{
+	char line[BUFSIZE];
+	size_t i;
+
+	for (i = first; i < b->count; i += nworkers)
 	{
-		if (ismarked)
-			wallops("%s used SENDPASSMAIL for the \2MARKED\2 account %s (%s).", get_oper_name(si), entity(mu)->name, mu->email_canonical);
+		const char *const hash = crypt_password(b->jobs[i].key);
+		const int len = snprintf(line, sizeof line, "%zu %s\n", i, hash != NULL ? hash : "*");
 
-		logcommand(si, CMDLOG_ADMIN, "SENDPASSMAIL: \2%s\2 (\2%s\2) (change key)", entity(mu)->name, mu->email_canonical);
-		metadata_add(mu, "private:sendpass:sender", get_oper_name(si));
-		metadata_add(mu, "private:sendpass:timestamp", int64_to_string(time(NULL)));
-		metadata_add(mu, "private:setpass:key", hash);
+		if (len <= 0 || (size_t) len >= sizeof line || write(fd, line, len) != len)
+			_exit(1);
 	}
-	else
-		logcommand(si, CMDLOG_ADMIN, "SENDPASSMAIL failed sending email to  %s", mu->email_canonical);
 
-	sfree(key);
-	return 0;
+	_exit(0);
+}
+
+static bool
+sendpassmail_worker_start(struct sendpassmail_batch *b, size_t first, size_t nworkers)
+{
+	struct sendpassmail_worker *w = &b->workers[first];
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) == -1)
+		return false;
+
+	switch (pid = fork())
+	{
+		case -1:
+			slog(LG_ERROR, "SENDPASSMAIL: fork() failed for hashing worker: %s", strerror(errno));
+			close(fds[0]);
+			close(fds[1]);
+			return false;
+		case 0:
+			close(fds[0]);
+			connection_close_all_fds();
+			sendpassmail_worker_run(b, first, nworkers, fds[1]);
+		default:
+			close(fds[1]);
+			childproc_add(pid, "ns_sendpassmail", sendpassmail_worker_exited, NULL);
+
+			w->batch = b;
+			w->pid = pid;
+			w->len = 0;
+			w->conn = connection_add("sendpassmail worker", fds[0], 0, sendpassmail_worker_read, NULL);
+			w->conn->userdata = w;
+			b->running++;
+			return true;
+	}
+}
+
+/* a hung worker must not hold a batch slot forever; whatever was not
+ * hashed by now is reported as a hash failure
+ */
+static void
+sendpassmail_deadline(void *arg)
+{
+	struct sendpassmail_batch *b = arg;
+	size_t i;
+
+	b->deadline = NULL;
+
+	for (i = 0; i < SENDPASSMAIL_WORKERS; i++)
+	{
+		struct sendpassmail_worker *w = &b->workers[i];
+
+		if (w->conn == NULL)
+			continue;
+
+		slog(LG_ERROR, "SENDPASSMAIL: hashing worker %ld timed out; killing it", (long) w->pid);
+		kill(w->pid, SIGKILL);
+		connection_close(w->conn);
+		w->conn = NULL;
+	}
+
+	b->running = 0;
+	sendpassmail_commit(b);
+}
+
+/* hashes every nworkers-th key starting at first, in this process */
+static void
+sendpassmail_hash_here(struct sendpassmail_batch *b, size_t first, size_t nworkers)
+{
+	size_t j;
+
+	for (j = first; j < b->count; j += nworkers)
+	{
+		const char *const hash = crypt_password(b->jobs[j].key);
+
+		if (hash != NULL)
+			b->jobs[j].hash = sstrdup(hash);
+	}
+}
+
+static void
+sendpassmail_collect(sourceinfo_t *si, myuser_t *mu, struct sendpassmail_batch *b)
+{
+	struct sendpassmail_job *job;
+	bool ismarked = false;
+
+	hook_user_needforce_t needforce_hdata;
+
+	needforce_hdata.si = si;
+	needforce_hdata.mu = mu;
+	needforce_hdata.allowed = 1;
+
+	hook_call_user_needforce(&needforce_hdata);
+
+	if (!needforce_hdata.allowed || metadata_find(mu, "private:mark:setter"))
+	{
+		ismarked = true;
+	}
+
+	if (!can_sendpass(si, mu))
+	{
+		return;
+	}
+
+	b->jobs = srealloc(b->jobs, (b->count + 1) * sizeof *b->jobs);
+
+	job = &b->jobs[b->count++];
+	job->account = sstrdup(entity(mu)->name);
+	job->key = random_string(12);
+	job->hash = NULL;
+	job->marked = ismarked;
 }
 
 static void
 ns_cmd_sendpassmail(sourceinfo_t *si, int parc, char *parv[])
 {
-	myuser_t *mu;
 	char *email = parv[0];
-	char cmdtext[COMPAT_NICKLEN + 20];
-
-	struct sendpassmail_state state;
+	struct sendpassmail_batch *b;
+	mowgli_list_t *l;
+	mowgli_node_t *n, *tn;
+	size_t i, nworkers;
 
 	if (!email)
 	{
@@ -119,18 +615,70 @@ ns_cmd_sendpassmail(sourceinfo_t *si, int parc, char *parv[])
 		return;
 	}
 
-	state.email_canonical = canonicalize_email(email);
-	state.origin = si;
-
 	if (!validemail(email)) {
 		command_fail(si, fault_badparams, _("\2%s\2 is not a valid email address."), email);
 		return;
 	}
 
-	myentity_foreach_t(ENT_USER, sendpassmail_foreach_cb, &state);
-	strshare_unref(state.email_canonical);
+	if (MOWGLI_LIST_LENGTH(&sendpassmail_batches) >= SENDPASSMAIL_MAX_BATCHES)
+	{
+		command_fail(si, fault_toomany, _("Too many password reset requests are in progress. Try again later."));
+		return;
+	}
+
+	if (email_index == NULL)
+		email_index_build();
+
+	b = smalloc(sizeof *b);
+	memset(b, 0, sizeof *b);
+	b->si = si;
+	b->email_canonical = canonicalize_email(email);
+	b->email = sstrdup(email);
+	atheme_object_ref(si);
+	mowgli_node_add(b, &b->node, &sendpassmail_batches);
+
+	if ((l = mowgli_patricia_retrieve(email_index, b->email_canonical)) != NULL)
+	{
+		MOWGLI_ITER_FOREACH_SAFE(n, tn, l->head)
+		{
+			myuser_t *mu = ((struct email_entry *) n->data)->mu;
+
+			/* moved to another address since it was filed */
+			if (mu->email_canonical != b->email_canonical)
+			{
+				email_index_refile(mu);
+				continue;
+			}
+
+			sendpassmail_collect(si, mu, b);
+		}
+	}
+
+	/* a source that is not a user (XML-RPC, JSON-RPC) can only be answered
+	 * during this call, so its keys are hashed here and committed at once
+	 */
+	if (si->su == NULL)
+	{
+		sendpassmail_hash_here(b, 0, 1);
+		sendpassmail_commit(b);
+		return;
+	}
+
+	/* the keys are made here; only the slow hashing is handed off */
+	nworkers = b->count < SENDPASSMAIL_WORKERS ? b->count : SENDPASSMAIL_WORKERS;
 
-	command_success_nodata(si, _("A password reset email has been sent for all accounts matching address \2%s\2, if any."), email);
+	for (i = 0; i < nworkers; i++)
+	{
+		/* no worker for this slice; hash it here rather than fail */
+		if (!sendpassmail_worker_start(b, i, nworkers))
+			sendpassmail_hash_here(b, i, nworkers);
+	}
+
+	if (b->running == 0)
+		sendpassmail_commit(b);
+	else
+		b->deadline = mowgli_timer_add_once(base_eventloop, "sendpassmail_deadline", sendpassmail_deadline, b,
+			SENDPASSMAIL_DEADLINE);
 }
 
 static command_t ns_sendpassmail = {
@@ -145,13 +693,41 @@ static command_t ns_sendpassmail = {
 static void
 mod_init(module_t *const restrict m)
 {
+	hook_add_event("user_register");
+	hook_add_user_register(email_index_register);
+
+	hook_add_event("myuser_delete");
+	hook_add_myuser_delete(email_index_delete);
+	hook_add_myuser_delete(sendpassmail_myuser_delete);
+
+	hook_add_event("user_identify");
+	hook_add_user_identify(email_index_identify);
+
+	hook_add_event("user_delete");
+	hook_add_user_delete(sendpassmail_user_delete);
+
 	service_named_bind_command("nickserv", &ns_sendpassmail);
 }
 
 static void
 mod_deinit(const module_unload_intent_t intent)
 {
+	mowgli_node_t *n, *tn;
+
+	hook_del_user_register(email_index_register);
+	hook_del_myuser_delete(email_index_delete);
+	hook_del_myuser_delete(sendpassmail_myuser_delete);
+	hook_del_user_delete(sendpassmail_user_delete);
+	hook_del_user_identify(email_index_identify);
+
 	service_named_unbind_command("nickserv", &ns_sendpassmail);
+
+	childproc_delete_all(sendpassmail_worker_exited);
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, sendpassmail_batches.head)
+		sendpassmail_batch_free(n->data);
+
+	email_index_destroy();
 }
 
 SIMPLE_DECLARE_MODULE_V1("contrib/ns_sendpassmail", MODULE_UNLOAD_CAPABILITY_OK)
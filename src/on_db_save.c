@@ -7,21 +7,148 @@
 
 #ifndef _WIN32
 
+/* Runs db_update_command after the database has been saved.
+ *
+ * Saves that happen while the command is still running are coalesced
+ * into at most one pending run, and with db_update_delay set a burst of
+ * saves is debounced into a single run once the database has been quiet
+ * for that long. If db_update_checksum_file is set (normally to the
+ * database file itself), runs are skipped when its contents have not
+ * changed since the last successful run. The file is checksummed in the
+ * forked child before it execs the command, so a large database does
+ * not stall the main loop on every save.
+ */
+
 static struct update_command_state {
 	connection_t *out, *err;
+	int sumfd;
 	pid_t pid;
 	int running;
-} update_command_proc;
+	int pending;
+	mowgli_eventloop_timer_t *timer;
+	struct timespec started;
+	uint64_t checksum;
+	int have_checksum;
+	unsigned int runs, coalesced, skipped;
+	int last_status;
+	unsigned long last_msec;
+	time_t last_run;
+} update_command_proc = { .sumfd = -1 };
 
 static char *command = NULL;
+static char *checksum_file = NULL;
+static unsigned int update_delay = 0;
+
+static void update_command_run(void);
+
+/* 64-bit FNV-1a; this only needs to notice that the file changed.
+ * Runs in the child, whose stderr is logged by the parent.
+ */
+static int
+update_command_checksum(const char *path, uint64_t *sum)
+{
+	unsigned char buf[65536];
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t len, i;
+	FILE *f;
+	int errno1;
+
+	if (!(f = fopen(path, "rb")))
+	{
+		errno1 = errno;
+		fprintf(stderr, "Couldn't open %s to checksum it: %s\n", path, strerror(errno1));
+		return 0;
+	}
+
+	while ((len = fread(buf, 1, sizeof buf, f)) > 0)
+	{
+		for (i = 0; i < len; i++)
+		{
+			hash ^= buf[i];
+			hash *= 0x100000001b3ULL;
+		}
+	}
+
+	if (ferror(f))
+	{
+		errno1 = errno;
+		fprintf(stderr, "Couldn't read %s to checksum it: %s\n", path, strerror(errno1));
+		fclose(f);
+		return 0;
+	}
+
+	fclose(f);
+	*sum = hash;
+	return 1;
+}
+
+/* the child writes "skip", or the checksum of the file it is about to run for */
+static int
+update_command_read_sum(uint64_t *sum)
+{
+	char buf[32];
+	ssize_t len;
+
+	if (update_command_proc.sumfd < 0)
+		return 0;
+
+	len = read(update_command_proc.sumfd, buf, sizeof buf - 1);
+	close(update_command_proc.sumfd);
+	update_command_proc.sumfd = -1;
+
+	if (len <= 0)
+		return 0;
+
+	buf[len] = '\0';
+
+	if (!strcmp(buf, "skip"))
+		return -1;
+
+	*sum = strtoull(buf, NULL, 16);
+	return 1;
+}
 
 static void
 update_command_finished(pid_t pid, int status, void *data)
 {
-	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
-		slog(LG_ERROR, "ERROR: Database update command failed with error %d", WEXITSTATUS(status));
+	struct timespec now;
+	uint64_t sum = 0;
+	int have_sum;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
+	have_sum = update_command_read_sum(&sum);
 	update_command_proc.running = 0;
+
+	if (have_sum < 0)
+	{
+		slog(LG_DEBUG, "db update command: %s is unchanged, skipping", checksum_file);
+		update_command_proc.skipped++;
+	}
+	else
+	{
+		update_command_proc.runs++;
+		update_command_proc.last_status = status;
+		update_command_proc.last_run = CURRTIME;
+		update_command_proc.last_msec = (now.tv_sec - update_command_proc.started.tv_sec) * 1000UL +
+		                                (now.tv_nsec - update_command_proc.started.tv_nsec) / 1000000L;
+
+		if (WIFSIGNALED(status))
+			slog(LG_ERROR, "ERROR: Database update command was killed by signal %d", WTERMSIG(status));
+		else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			slog(LG_ERROR, "ERROR: Database update command failed with error %d", WEXITSTATUS(status));
+		else if (have_sum > 0)
+		{
+			update_command_proc.checksum = sum;
+			update_command_proc.have_checksum = 1;
+		}
+	}
+
+	if (update_command_proc.pending)
+	{
+		update_command_proc.pending = 0;
+		update_command_run();
+	}
 }
 
 static void
@@ -60,18 +187,31 @@ update_command_stderr_handler(connection_t *cptr)
 }
 
 static void
-on_db_save(void *unused)
+update_command_close_pair(int fds[2])
+{
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+}
+
+static void
+update_command_run(void)
 {
-	int stdout_pipes[2], stderr_pipes[2];
+	int stdout_pipes[2], stderr_pipes[2], sum_pipes[2];
+	uint64_t sum;
 	pid_t pid;
 	int errno1;
 
 	if (!command)
 		return;
 
-	if (update_command_proc.running)
+	sum_pipes[0] = sum_pipes[1] = -1;
+
+	if (checksum_file && pipe(sum_pipes) == -1)
 	{
-		slog(LG_ERROR, "ERROR: database update command is still running");
+		int err = errno;
+		slog(LG_ERROR, "ERROR: Couldn't create pipe for database update command: %s", strerror(err));
 		return;
 	}
 
@@ -79,6 +219,7 @@ on_db_save(void *unused)
 	{
 		int err = errno;
 		slog(LG_ERROR, "ERROR: Couldn't create pipe for database update command: %s", strerror(err));
+		update_command_close_pair(sum_pipes);
 		return;
 	}
 
@@ -86,8 +227,8 @@ on_db_save(void *unused)
 	{
 		int err = errno;
 		slog(LG_ERROR, "ERROR: Couldn't create pipe for database update command: %s", strerror(err));
-		close(stdout_pipes[0]);
-		close(stdout_pipes[1]);
+		update_command_close_pair(stdout_pipes);
+		update_command_close_pair(sum_pipes);
 		return;
 	}
 
@@ -98,6 +239,9 @@ on_db_save(void *unused)
 		case -1:
 			errno1 = errno;
 			slog(LG_ERROR, "Failed to fork for database update command: %s", strerror(errno1));
+			update_command_close_pair(stdout_pipes);
+			update_command_close_pair(stderr_pipes);
+			update_command_close_pair(sum_pipes);
 			return;
 		case 0:
 			connection_close_all_fds();
@@ -107,6 +251,25 @@ on_db_save(void *unused)
 			dup2(stderr_pipes[1], 2);
 			close(stdout_pipes[1]);
 			close(stderr_pipes[1]);
+			if (checksum_file)
+			{
+				char line[32];
+				int len;
+
+				close(sum_pipes[0]);
+
+				if (update_command_checksum(checksum_file, &sum))
+				{
+					if (update_command_proc.have_checksum && sum == update_command_proc.checksum)
+						_exit(write(sum_pipes[1], "skip", 4) == 4 ? 0 : 1);
+
+					len = snprintf(line, sizeof line, "%016llx", (unsigned long long) sum);
+					if (write(sum_pipes[1], line, len) != len)
+						_exit(1);
+				}
+
+				close(sum_pipes[1]);
+			}
 			execl("/bin/sh", "sh",  "-c", command, NULL);
 			write(2, "Failed to exec /bin/sh\n", 23);
 			_exit(255);
@@ -114,32 +277,125 @@ on_db_save(void *unused)
 		default:
 			close(stdout_pipes[1]);
 			close(stderr_pipes[1]);
+			if (checksum_file)
+			{
+				close(sum_pipes[1]);
+				update_command_proc.sumfd = sum_pipes[0];
+			}
 			update_command_proc.out = connection_add("update_command_stdout", stdout_pipes[0], 0, recvq_put, NULL);
 			update_command_proc.err = connection_add("update_command_stderr", stderr_pipes[0], 0, recvq_put, NULL);
 			update_command_proc.out->recvq_handler = update_command_stdout_handler;
 			update_command_proc.err->recvq_handler = update_command_stderr_handler;
 			update_command_proc.pid = pid;
 			update_command_proc.running = 1;
+			clock_gettime(CLOCK_MONOTONIC, &update_command_proc.started);
 			childproc_add(pid, "db_update", update_command_finished, NULL);
 			break;
 	}
 }
 
+static void
+update_command_request(void)
+{
+	if (update_command_proc.running)
+	{
+		/* at most one run is queued behind the running one */
+		if (update_command_proc.pending)
+			update_command_proc.coalesced++;
+
+		update_command_proc.pending = 1;
+		return;
+	}
+
+	update_command_run();
+}
+
+static void
+update_command_timer_cb(void *unused)
+{
+	update_command_proc.timer = NULL;
+	update_command_request();
+}
+
+static void
+on_db_save(void *unused)
+{
+	if (!command)
+		return;
+
+	if (!update_delay)
+	{
+		update_command_request();
+		return;
+	}
+
+	/* restart the quiet period on every save */
+	if (update_command_proc.timer)
+	{
+		mowgli_timer_destroy(base_eventloop, update_command_proc.timer);
+		update_command_proc.coalesced++;
+	}
+
+	update_command_proc.timer = mowgli_timer_add_once(base_eventloop, "db_update_command", update_command_timer_cb, NULL, update_delay);
+}
+
+static void
+osinfo_hook(sourceinfo_t *si)
+{
+	int status = update_command_proc.last_status;
+
+	if (!command)
+		return;
+
+	command_success_nodata(si, _("Database update command: %u runs, %u coalesced saves, %u skipped (unchanged)"),
+			update_command_proc.runs, update_command_proc.coalesced, update_command_proc.skipped);
+
+	if (update_command_proc.running)
+		command_success_nodata(si, _("Database update command is running (pid %d)%s"),
+				(int)update_command_proc.pid, update_command_proc.pending ? _(", another run is pending") : "");
+
+	if (!update_command_proc.last_run)
+		return;
+
+	if (WIFSIGNALED(status))
+		command_success_nodata(si, _("Last database update command: killed by signal %d after %lu ms, %s ago"),
+				WTERMSIG(status), update_command_proc.last_msec, time_ago(update_command_proc.last_run));
+	else
+		command_success_nodata(si, _("Last database update command: exit status %d after %lu ms, %s ago"),
+				WEXITSTATUS(status), update_command_proc.last_msec, time_ago(update_command_proc.last_run));
+}
+
 static void
 mod_init(module_t *const restrict m)
 {
 	hook_add_event("db_saved");
 	hook_add_db_saved(on_db_save);
 
+	hook_add_event("operserv_info");
+	hook_add_operserv_info(osinfo_hook);
+
 	add_dupstr_conf_item("db_update_command", &conf_gi_table, 0, &command, NULL);
+	add_dupstr_conf_item("db_update_checksum_file", &conf_gi_table, 0, &checksum_file, NULL);
+	add_duration_conf_item("db_update_delay", &conf_gi_table, 0, &update_delay, "s", 0);
 }
 
 static void
 mod_deinit(const module_unload_intent_t intent)
 {
 	hook_del_db_saved(on_db_save);
+	hook_del_operserv_info(osinfo_hook);
+
+	if (update_command_proc.timer)
+		mowgli_timer_destroy(base_eventloop, update_command_proc.timer);
+
+	childproc_delete_all(update_command_finished);
+
+	if (update_command_proc.sumfd >= 0)
+		close(update_command_proc.sumfd);
 
 	del_conf_item("db_update_command", &conf_gi_table);
+	del_conf_item("db_update_checksum_file", &conf_gi_table);
+	del_conf_item("db_update_delay", &conf_gi_table);
 }
 
 SIMPLE_DECLARE_MODULE_V1("contrib/on_db_save", MODULE_UNLOAD_CAPABILITY_OK)
@@ -9,16 +9,57 @@
  * to change this, add a defcon_timeout = X; option to the operserv{}
  * block in your atheme.con. X = amount of time in minutes for a defcon
  * setting to time out/expire.
+ *
+ * Channel modes are applied in the background, defcon_chans_per_tick
+ * channels per second (default 500), so that changing the level on a
+ * large network does not burst modes for every channel at once.
+ *
+ * At DEFCON 1 connecting users are collected for defcon_kline_window
+ * seconds (default 5) and then KLINEd as one batch. An ident seen from
+ * defcon_kline_user_threshold or more distinct hosts is banned as user@*,
+ * and defcon_kline_cidr_threshold or more distinct addresses within one
+ * IPv4 /24 or IPv6 /64 are banned as a CIDR mask; clones of a single host
+ * only ever count once. Ranges already banned this way are
+ * remembered until their KLINE expires, so no redundant KLINEs are sent.
  */
 
 #include "atheme-compat.h"
 
+#include <arpa/inet.h>
+#include <limits.h>
+
 #define DEFCON_CMODE "R"
+#define DEFCON_KLINE_DURATION 900
+#define DEFCON_KLINE_REASON "This network is currently not accepting connections, please try again later."
+
+struct defcon_kline_pending {
+	char user[COMPAT_USERLEN + 1];
+	char host[COMPAT_HOSTLEN + 1];
+	char ip[COMPAT_HOSTIPLEN + 1];
+	char prefix[COMPAT_HOSTIPLEN + 4];
+};
 
 static int level = 5;
 static unsigned int defcon_timeout = 900;
+static unsigned int defcon_chans_per_tick = 500;
 static mowgli_eventloop_timer_t *defcon_timer = NULL;
 
+static unsigned int defcon_kline_window = 5;
+static unsigned int defcon_kline_user_threshold = 8;
+static unsigned int defcon_kline_cidr_threshold = 4;
+static mowgli_eventloop_timer_t *defcon_kline_timer = NULL;
+static mowgli_list_t defcon_kline_pending;
+
+/* "u:ident", "p:prefix" and "h:user@host" -> expiry time of our KLINE */
+static mowgli_patricia_t *defcon_kline_covered = NULL;
+
+static struct {
+	mowgli_list_t queue;    // names of channels still to be changed
+	mowgli_eventloop_timer_t *timer;
+	int dir;                // MTYPE_ADD or MTYPE_DEL
+	unsigned int total, changed, skipped;
+} modejob;
+
 static void
 defcon_nouserreg(hook_user_register_check_t *hdata)
 {
@@ -45,11 +86,161 @@ defcon_nochanreg(hook_channel_register_check_t *hdatac)
 	}
 }
 
+/* the /24 or /64 containing ip, as a CIDR mask */
+static bool
+defcon_ip_prefix(const char *ip, char *buf, size_t len)
+{
+	struct in_addr a4;
+	struct in6_addr a6;
+	char addr[INET6_ADDRSTRLEN];
+
+	if (ip == NULL || *ip == '\0')
+		return false;
+
+	if (inet_pton(AF_INET, ip, &a4) == 1)
+	{
+		a4.s_addr &= htonl(0xFFFFFF00U);
+		inet_ntop(AF_INET, &a4, addr, sizeof addr);
+		snprintf(buf, len, "%s/24", addr);
+		return true;
+	}
+
+	if (inet_pton(AF_INET6, ip, &a6) == 1)
+	{
+		memset(&a6.s6_addr[8], 0, 8);
+		inet_ntop(AF_INET6, &a6, addr, sizeof addr);
+		snprintf(buf, len, "%s/64", addr);
+		return true;
+	}
+
+	return false;
+}
+
+static bool
+defcon_kline_is_covered(const char *kind, const char *what)
+{
+	char key[BUFSIZE];
+	void *expiry;
+
+	snprintf(key, sizeof key, "%s:%s", kind, what);
+
+	if ((expiry = mowgli_patricia_retrieve(defcon_kline_covered, key)) == NULL)
+		return false;
+
+	if ((time_t)(uintptr_t)expiry > CURRTIME)
+		return true;
+
+	mowgli_patricia_delete(defcon_kline_covered, key);
+	return false;
+}
+
+static void
+defcon_kline_issue(const char *kind, const char *what, const char *user, const char *host)
+{
+	char key[BUFSIZE];
+
+	if (defcon_kline_is_covered(kind, what))
+		return;
+
+	slog(LG_INFO, "DEFCON:KLINE: %s@%s", user, host);
+	kline_add(user, host, DEFCON_KLINE_REASON, DEFCON_KLINE_DURATION, "*");
+
+	snprintf(key, sizeof key, "%s:%s", kind, what);
+	mowgli_patricia_add(defcon_kline_covered, key, (void *)(uintptr_t)(CURRTIME + DEFCON_KLINE_DURATION));
+}
+
+/* files member under key; each key holds a set, so clones count once */
+static void
+defcon_kline_count(mowgli_patricia_t *sets, const char *key, const char *member)
+{
+	mowgli_patricia_t *set;
+
+	if ((set = mowgli_patricia_retrieve(sets, key)) == NULL)
+	{
+		set = mowgli_patricia_create(irccasecanon);
+		mowgli_patricia_add(sets, key, set);
+	}
+
+	if (mowgli_patricia_retrieve(set, member) == NULL)
+		mowgli_patricia_add(set, member, set);
+}
+
+static void
+defcon_kline_free_set(const char *key, void *set, void *privdata)
+{
+	mowgli_patricia_destroy(set, NULL, NULL);
+}
+
+static int
+defcon_kline_flush_user_cb(const char *ident, void *hosts, void *privdata)
+{
+	if (mowgli_patricia_size(hosts) >= defcon_kline_user_threshold)
+		defcon_kline_issue("u", ident, ident, "*");
+
+	return 0;
+}
+
+static int
+defcon_kline_flush_prefix_cb(const char *prefix, void *ips, void *privdata)
+{
+	if (mowgli_patricia_size(ips) >= defcon_kline_cidr_threshold)
+		defcon_kline_issue("p", prefix, "*", prefix);
+
+	return 0;
+}
+
+static void
+defcon_kline_flush(void *unused)
+{
+	mowgli_patricia_t *users, *prefixes;
+	struct defcon_kline_pending *p;
+	mowgli_node_t *n, *tn;
+	char userhost[BUFSIZE];
+
+	defcon_kline_timer = NULL;
+
+	users = mowgli_patricia_create(NULL);
+	prefixes = mowgli_patricia_create(NULL);
+
+	MOWGLI_ITER_FOREACH(n, defcon_kline_pending.head)
+	{
+		p = n->data;
+
+		defcon_kline_count(users, p->user, p->host);
+		if (*p->prefix != '\0')
+			defcon_kline_count(prefixes, p->prefix, p->ip);
+	}
+
+	/* aggregated bans first, so that individual ones they cover are skipped */
+	mowgli_patricia_foreach(users, defcon_kline_flush_user_cb, NULL);
+	mowgli_patricia_foreach(prefixes, defcon_kline_flush_prefix_cb, NULL);
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, defcon_kline_pending.head)
+	{
+		p = n->data;
+
+		if (!defcon_kline_is_covered("u", p->user) &&
+		    (*p->prefix == '\0' || !defcon_kline_is_covered("p", p->prefix)))
+		{
+			snprintf(userhost, sizeof userhost, "%s@%s", p->user, p->host);
+			defcon_kline_issue("h", userhost, p->user, p->host);
+		}
+
+		mowgli_node_delete(n, &defcon_kline_pending);
+		mowgli_node_free(n);
+		sfree(p);
+	}
+
+	mowgli_patricia_destroy(users, defcon_kline_free_set, NULL);
+	mowgli_patricia_destroy(prefixes, defcon_kline_free_set, NULL);
+}
+
 static void
 defcon_useradd(hook_user_nick_t *data)
 {
 	user_t *u = data->u;
-	kline_t *k;
+	struct defcon_kline_pending *p;
+	char userhost[BUFSIZE];
 
 	if (!u)
 		return;
@@ -59,11 +250,34 @@ defcon_useradd(hook_user_nick_t *data)
 
 	if (level == 1)
 	{
-		slog(LG_INFO, "DEFCON:KLINE: %s!%s@%s", u->nick, u->user, u->host);
-		if (! (u->flags & UF_KLINESENT)) {
-			k = kline_add(u->user, u->host, "This network is currently not accepting connections, please try again later.", 900, "*");
-			u->flags |= UF_KLINESENT;
+		if (u->flags & UF_KLINESENT)
+			return;
+
+		u->flags |= UF_KLINESENT;
+
+		p = smalloc(sizeof *p);
+		mowgli_strlcpy(p->user, u->user, sizeof p->user);
+		mowgli_strlcpy(p->host, u->host, sizeof p->host);
+		if (defcon_ip_prefix(u->ip, p->prefix, sizeof p->prefix))
+			mowgli_strlcpy(p->ip, u->ip, sizeof p->ip);
+		else
+			p->prefix[0] = '\0';
+
+		snprintf(userhost, sizeof userhost, "%s@%s", p->user, p->host);
+
+		/* already inside a range we banned */
+		if (defcon_kline_is_covered("u", p->user) ||
+		    defcon_kline_is_covered("h", userhost) ||
+		    (*p->prefix != '\0' && defcon_kline_is_covered("p", p->prefix)))
+		{
+			sfree(p);
+			return;
 		}
+
+		mowgli_node_add(p, mowgli_node_create(), &defcon_kline_pending);
+
+		if (defcon_kline_timer == NULL)
+			defcon_kline_timer = mowgli_timer_add_once(base_eventloop, "defcon_kline_flush", defcon_kline_flush, NULL, defcon_kline_window);
 	}
 }
 
@@ -103,35 +317,113 @@ defcon_svsignore(void)
 	}
 }
 
+static bool
+defcon_chan_is_done(channel_t *chptr, int dir)
+{
+	unsigned int flag = mode_to_flag(DEFCON_CMODE[0]);
+
+	if (!flag)
+		return false;
+
+	return dir == MTYPE_ADD ? (chptr->modes & flag) != 0 : (chptr->modes & flag) == 0;
+}
+
 static void
-defcon_forcechanmodes(void)
+defcon_modejob_clear(void)
+{
+	mowgli_node_t *n, *tn;
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, modejob.queue.head)
+	{
+		sfree(n->data);
+		mowgli_node_delete(n, &modejob.queue);
+		mowgli_node_free(n);
+	}
+}
+
+static void
+defcon_modejob_tick(void *unused)
 {
 	channel_t *chptr;
-	mowgli_patricia_iteration_state_t state;
+	mowgli_node_t *n;
 	service_t *svs;
-	char modesetbuf[256];
-	char modeunsetbuf[256];
+	char modebuf[256];
+	char *name;
+	unsigned int count = 0;
+
+	modejob.timer = NULL;
 
 	svs = service_find("operserv");
 
-	if (level <= 3)
+	snprintf(modebuf, sizeof modebuf, "%c%s", modejob.dir == MTYPE_ADD ? '+' : '-', DEFCON_CMODE);
+
+	while ((n = modejob.queue.head) != NULL && count < defcon_chans_per_tick)
 	{
-		snprintf(modesetbuf, sizeof modesetbuf, "+%s", DEFCON_CMODE);
-		slog(LG_INFO, "DEFCON:MODE: %s", modesetbuf);
-		MOWGLI_PATRICIA_FOREACH(chptr, &state, chanlist)
+		name = n->data;
+		mowgli_node_delete(n, &modejob.queue);
+		mowgli_node_free(n);
+
+		/* the channel may have gone away or been fixed by someone else meanwhile */
+		if ((chptr = channel_find(name)) != NULL && !defcon_chan_is_done(chptr, modejob.dir))
 		{
-			channel_mode_va(svs->me, chptr, 1, modesetbuf);
+			channel_mode_va(svs->me, chptr, 1, modebuf);
+			modejob.changed++;
+			count++;
 		}
+		else
+			modejob.skipped++;
+
+		sfree(name);
 	}
-	else if (level >= 4)
+
+	if (MOWGLI_LIST_LENGTH(&modejob.queue) != 0)
 	{
-		snprintf(modeunsetbuf, sizeof modeunsetbuf, "-%s", DEFCON_CMODE);
-		slog(LG_INFO, "DEFCON:MODE: %s", modeunsetbuf);
-		MOWGLI_PATRICIA_FOREACH(chptr, &state, chanlist)
-		{
-			channel_mode_va(svs->me, chptr, 1, modeunsetbuf);
-		}
+		modejob.timer = mowgli_timer_add_once(base_eventloop, "defcon_modejob", defcon_modejob_tick, NULL, 1);
+		return;
 	}
+
+	slog(LG_INFO, "DEFCON:MODE: %s done (%u changed, %u skipped)", modebuf, modejob.changed, modejob.skipped);
+}
+
+static void
+defcon_forcechanmodes(void)
+{
+	channel_t *chptr;
+	mowgli_patricia_iteration_state_t state;
+	int dir = level <= 3 ? MTYPE_ADD : MTYPE_DEL;
+
+	/* already heading the right way */
+	if (modejob.timer != NULL && modejob.dir == dir)
+		return;
+
+	if (modejob.timer != NULL)
+	{
+		mowgli_timer_destroy(base_eventloop, modejob.timer);
+		modejob.timer = NULL;
+	}
+
+	/* on a reversal, channels the previous job never got to are
+	 * already correct and simply are not queued again
+	 */
+	defcon_modejob_clear();
+
+	modejob.dir = dir;
+	modejob.changed = 0;
+	modejob.skipped = 0;
+
+	MOWGLI_PATRICIA_FOREACH(chptr, &state, chanlist)
+	{
+		if (defcon_chan_is_done(chptr, dir))
+			continue;
+
+		mowgli_node_add(sstrdup(chptr->name), mowgli_node_create(), &modejob.queue);
+	}
+
+	modejob.total = MOWGLI_LIST_LENGTH(&modejob.queue);
+
+	slog(LG_INFO, "DEFCON:MODE: %c%s on %u channels", dir == MTYPE_ADD ? '+' : '-', DEFCON_CMODE, modejob.total);
+
+	defcon_modejob_tick(NULL);
 }
 
 static void
@@ -160,6 +452,10 @@ os_cmd_defcon(sourceinfo_t *si, int parc, char *parv[])
 	if (!defcon)
 	{
 		command_success_nodata(si, _("Defense condition is currently level \2%d\2."), level);
+		if (modejob.timer != NULL)
+			command_success_nodata(si, _("Applying \2%c%s\2 to channels: %u of %u done, %u skipped."),
+					modejob.dir == MTYPE_ADD ? '+' : '-', DEFCON_CMODE,
+					modejob.changed + modejob.skipped, modejob.total, modejob.skipped);
 		return;
 	}
 
@@ -224,6 +520,12 @@ mod_init(module_t *const restrict m)
 	service_t *svs;
 	svs = service_find("operserv");
 	add_duration_conf_item("DEFCON_TIMEOUT", &svs->conf_table, 0, &defcon_timeout, "m", 900);
+	add_uint_conf_item("DEFCON_CHANS_PER_TICK", &svs->conf_table, 0, &defcon_chans_per_tick, 1, INT_MAX, 500);
+	add_duration_conf_item("DEFCON_KLINE_WINDOW", &svs->conf_table, 0, &defcon_kline_window, "s", 5);
+	add_uint_conf_item("DEFCON_KLINE_USER_THRESHOLD", &svs->conf_table, 0, &defcon_kline_user_threshold, 2, INT_MAX, 8);
+	add_uint_conf_item("DEFCON_KLINE_CIDR_THRESHOLD", &svs->conf_table, 0, &defcon_kline_cidr_threshold, 2, INT_MAX, 4);
+
+	defcon_kline_covered = mowgli_patricia_create(NULL);
 }
 
 static void
@@ -238,9 +540,27 @@ mod_deinit(const module_unload_intent_t intent)
 	service_t *svs;
 	svs = service_find("operserv");
 	del_conf_item("DEFCON_TIMEOUT", &svs->conf_table);
+	del_conf_item("DEFCON_CHANS_PER_TICK", &svs->conf_table);
+	del_conf_item("DEFCON_KLINE_WINDOW", &svs->conf_table);
+	del_conf_item("DEFCON_KLINE_USER_THRESHOLD", &svs->conf_table);
+	del_conf_item("DEFCON_KLINE_CIDR_THRESHOLD", &svs->conf_table);
 
 	if (defcon_timer != NULL)
 		mowgli_timer_destroy(base_eventloop, defcon_timer);
+
+	if (modejob.timer != NULL)
+		mowgli_timer_destroy(base_eventloop, modejob.timer);
+
+	defcon_modejob_clear();
+
+	/* don't let anyone caught during the window slip through */
+	if (defcon_kline_timer != NULL)
+	{
+		mowgli_timer_destroy(base_eventloop, defcon_kline_timer);
+		defcon_kline_flush(NULL);
+	}
+
+	mowgli_patricia_destroy(defcon_kline_covered, NULL, NULL);
 }
 
 SIMPLE_DECLARE_MODULE_V1("contrib/os_defcon", MODULE_UNLOAD_CAPABILITY_OK)
@@ -2,8 +2,9 @@
  * Copyright (c) 2009 Jilles Tjoelker, et al
  * Rights to this code are as documented in doc/LICENSE.
  *
- * Monitors exit of given processes, using kqueue.
- * The kqueue is added to the main poll loop.
+ * Monitors exit of given processes, using kqueue on FreeBSD and pidfds
+ * (or the netlink process connector on kernels without them) on Linux.
+ * The kqueue, pidfds or netlink socket are added to the main poll loop.
  */
 
 #include "atheme-compat.h"
@@ -32,12 +33,357 @@ procwatch_readhandler(connection_t *cptr)
 	}
 }
 
+static bool
+procwatch_add(sourceinfo_t *si, pid_t pid)
+{
+	struct kevent ev;
+
+	EV_SET(&ev, pid, EVFILT_PROC, EV_ADD | EV_ENABLE, NOTE_EXIT, 0, NULL);
+
+	if (kevent(kq_conn->fd, &ev, 1, NULL, 0, NULL) == -1)
+	{
+		command_fail(si, fault_toomany, _("Failed to add pid %ld"), (long)pid);
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+procwatch_init(void)
+{
+	const int kq = kqueue();
+
+	if (kq == -1)
+		return false;
+
+	kq_conn = connection_add("procwatch kqueue", kq, 0, procwatch_readhandler, NULL);
+
+	return true;
+}
+
+static void
+procwatch_deinit(void)
+{
+	if (kq_conn != NULL)
+		connection_close_soon(kq_conn);
+}
+
+#endif /* __FreeBSD__ */
+
+#ifdef __linux__
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+
+#ifndef SYS_pidfd_open
+#  define SYS_pidfd_open		434
+#endif
+#ifndef SYS_pidfd_send_signal
+#  define SYS_pidfd_send_signal		424
+#endif
+#ifndef P_PIDFD
+#  define P_PIDFD			3
+#endif
+
+/* one per watched pid; conn is its pidfd, or NULL with the netlink backend */
+struct procwatch
+{
+	pid_t pid;
+	connection_t *conn;
+	char key[16];
+};
+
+static mowgli_patricia_t *procwatch_pids = NULL;
+static connection_t *nl_conn = NULL;
+
+static void
+procwatch_forget(struct procwatch *pw)
+{
+	mowgli_patricia_delete(procwatch_pids, pw->key);
+
+	if (pw->conn != NULL)
+		connection_close_soon(pw->conn);
+
+	sfree(pw);
+}
+
+/* converts waitid(2) results to the wait(2) status kqueue reports */
+static unsigned int
+procwatch_status(const siginfo_t *info)
+{
+	switch (info->si_code)
+	{
+		case CLD_EXITED:
+			return (info->si_status & 0xff) << 8;
+		case CLD_DUMPED:
+			return (info->si_status & 0x7f) | 0x80;
+		default:
+			return info->si_status & 0x7f;
+	}
+}
+
+/* reads exit code and cpu ticks from /proc for a zombie that is not our child */
+static bool
+procwatch_proc_stat(const struct procwatch *pw, unsigned int *status, unsigned long *utime, unsigned long *stime)
+{
+	char path[64], buf[1024], *p;
+	int fd, field;
+	ssize_t n;
+
+	snprintf(path, sizeof path, "/proc/%ld/stat", (long)pw->pid);
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+
+	n = read(fd, buf, sizeof buf - 1);
+	close(fd);
+
+	if (n <= 0)
+		return false;
+
+	buf[n] = '\0';
+
+	/* fields start after the parenthesised command name, which may contain spaces */
+	if ((p = strrchr(buf, ')')) == NULL)
+		return false;
+
+	*status = 0;
+	*utime = *stime = 0;
+
+	for (field = 3, p++; *p != '\0'; field++)
+	{
+		while (*p == ' ')
+			p++;
+
+		if (field == 14)
+			*utime = strtoul(p, NULL, 10);
+		else if (field == 15)
+			*stime = strtoul(p, NULL, 10);
+		else if (field == 52)
+			*status = strtoul(p, NULL, 10);
+
+		while (*p != ' ' && *p != '\0')
+			p++;
+	}
+
+	/* the pid may have been reaped and reused while we read; the pidfd still knows */
+	if (syscall(SYS_pidfd_send_signal, pw->conn->fd, 0, NULL, 0) == -1)
+		return false;
+
+	return field > 52;
+}
+
+static void
+procwatch_pidfd_readhandler(connection_t *cptr)
+{
+	struct procwatch *pw = cptr->userdata;
+	unsigned long utime, stime;
+	unsigned int status;
+	struct rusage ru;
+	siginfo_t info;
+
+	memset(&info, '\0', sizeof info);
+
+	/* our own children: exact status and rusage, left waitable for whoever reaps them */
+	if (syscall(SYS_waitid, P_PIDFD, cptr->fd, &info, WEXITED | WNOHANG | WNOWAIT, &ru) == 0 && info.si_pid == pw->pid)
+	{
+		slog(LG_INFO, "PROCWATCH: %ld exited with status %x (%ld.%03lds user, %ld.%03lds system, %ld KiB max RSS)",
+				(long)pw->pid, procwatch_status(&info),
+				(long)ru.ru_utime.tv_sec, (long)ru.ru_utime.tv_usec / 1000,
+				(long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec / 1000,
+				ru.ru_maxrss);
+	}
+	else if (procwatch_proc_stat(pw, &status, &utime, &stime))
+	{
+		const long hz = sysconf(_SC_CLK_TCK);
+
+		slog(LG_INFO, "PROCWATCH: %ld exited with status %x (%ld.%02lds user, %ld.%02lds system)",
+				(long)pw->pid, status,
+				(long)(utime / hz), (long)(utime % hz) * 100 / hz,
+				(long)(stime / hz), (long)(stime % hz) * 100 / hz);
+	}
+	else
+		slog(LG_INFO, "PROCWATCH: %ld exited (status unavailable)", (long)pw->pid);
+
+	procwatch_forget(pw);
+}
+
+static void
+procwatch_netlink_readhandler(connection_t *cptr)
+{
+	char buf[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct nlmsghdr *nlh;
+	int len;
+
+	while ((len = recv(cptr->fd, buf, sizeof buf, MSG_DONTWAIT)) > 0)
+	{
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len))
+		{
+			const struct cn_msg *cn = NLMSG_DATA(nlh);
+			const struct proc_event *ev = (const struct proc_event *)cn->data;
+			struct procwatch *pw;
+			char key[16];
+
+			if (nlh->nlmsg_type != NLMSG_DONE || ev->what != PROC_EVENT_EXIT)
+				continue;
+
+			/* thread exits are reported too; only the thread group leader is the process */
+			if (ev->event_data.exit.process_pid != ev->event_data.exit.process_tgid)
+				continue;
+
+			snprintf(key, sizeof key, "%ld", (long)ev->event_data.exit.process_pid);
+
+			if ((pw = mowgli_patricia_retrieve(procwatch_pids, key)) == NULL)
+				continue;
+
+			slog(LG_INFO, "PROCWATCH: %ld exited with status %x",
+					(long)pw->pid, (unsigned)ev->event_data.exit.exit_code);
+
+			procwatch_forget(pw);
+		}
+	}
+}
+
+static bool
+procwatch_add(sourceinfo_t *si, pid_t pid)
+{
+	struct procwatch *pw;
+	char key[16];
+	int fd = -1;
+
+	snprintf(key, sizeof key, "%ld", (long)pid);
+
+	if (mowgli_patricia_retrieve(procwatch_pids, key) != NULL)
+	{
+		command_fail(si, fault_alreadyexists, _("Pid %ld is already being watched."), (long)pid);
+		return false;
+	}
+
+	if (nl_conn == NULL)
+	{
+		if ((fd = syscall(SYS_pidfd_open, pid, 0)) == -1)
+		{
+			command_fail(si, fault_toomany, _("Failed to add pid %ld: %s"), (long)pid, strerror(errno));
+			return false;
+		}
+	}
+	else if (kill(pid, 0) == -1 && errno != EPERM)
+	{
+		command_fail(si, fault_toomany, _("Failed to add pid %ld: %s"), (long)pid, strerror(errno));
+		return false;
+	}
+
+	pw = smalloc(sizeof *pw);
+	pw->pid = pid;
+	pw->conn = NULL;
+	mowgli_strlcpy(pw->key, key, sizeof pw->key);
+
+	if (fd != -1)
+	{
+		pw->conn = connection_add("procwatch pidfd", fd, 0, procwatch_pidfd_readhandler, NULL);
+		pw->conn->userdata = pw;
+	}
+
+	mowgli_patricia_add(procwatch_pids, pw->key, pw);
+
+	return true;
+}
+
+/* subscribes to process events, which needs CAP_NET_ADMIN */
+static bool
+procwatch_netlink_open(void)
+{
+	struct sockaddr_nl sa = { .nl_family = AF_NETLINK, .nl_groups = CN_IDX_PROC };
+	char buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	struct cn_msg *cn = NLMSG_DATA(nlh);
+	const enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+	int fd;
+
+	if ((fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR)) == -1)
+		return false;
+
+	memset(buf, '\0', sizeof buf);
+	nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof op);
+	nlh->nlmsg_type = NLMSG_DONE;
+	cn->id.idx = CN_IDX_PROC;
+	cn->id.val = CN_VAL_PROC;
+	cn->len = sizeof op;
+	memcpy(cn->data, &op, sizeof op);
+
+	if (bind(fd, (struct sockaddr *)&sa, sizeof sa) == -1 || send(fd, nlh, nlh->nlmsg_len, 0) == -1)
+	{
+		slog(LG_ERROR, "procwatch_netlink_open(): process connector unavailable: %s", strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	nl_conn = connection_add("procwatch netlink", fd, 0, procwatch_netlink_readhandler, NULL);
+
+	return true;
+}
+
+static bool
+procwatch_init(void)
+{
+	int fd;
+
+	procwatch_pids = mowgli_patricia_create(NULL);
+
+	/* pidfd_open(2) is Linux 5.3 and later */
+	if ((fd = syscall(SYS_pidfd_open, getpid(), 0)) != -1)
+	{
+		close(fd);
+		return true;
+	}
+
+	if (procwatch_netlink_open())
+	{
+		slog(LG_INFO, "procwatch_init(): pidfd_open(2) unavailable, using the process connector");
+		return true;
+	}
+
+	mowgli_patricia_destroy(procwatch_pids, NULL, NULL);
+	procwatch_pids = NULL;
+
+	return false;
+}
+
+static void
+procwatch_deinit(void)
+{
+	mowgli_patricia_iteration_state_t state;
+	struct procwatch *pw;
+
+	if (procwatch_pids != NULL)
+	{
+		MOWGLI_PATRICIA_FOREACH(pw, &state, procwatch_pids)
+			procwatch_forget(pw);
+
+		mowgli_patricia_destroy(procwatch_pids, NULL, NULL);
+	}
+
+	if (nl_conn != NULL)
+		connection_close_soon(nl_conn);
+}
+
+#endif /* __linux__ */
+
+#if defined(__FreeBSD__) || defined(__linux__)
+
 static void
 os_cmd_procwatch(sourceinfo_t *si, int parc, char *parv[])
 {
 	long v;
 	char *end;
-	struct kevent ev;
 
 	if (parc == 0)
 	{
@@ -56,13 +402,8 @@ os_cmd_procwatch(sourceinfo_t *si, int parc, char *parv[])
 		return;
 	}
 
-	EV_SET(&ev, v, EVFILT_PROC, EV_ADD | EV_ENABLE, NOTE_EXIT, 0, NULL);
-
-	if (kevent(kq_conn->fd, &ev, 1, NULL, 0, NULL) == -1)
-	{
-		command_fail(si, fault_toomany, _("Failed to add pid %ld"), v);
+	if (!procwatch_add(si, v))
 		return;
-	}
 
 	command_success_nodata(si, "Added pid %ld to list.", v);
 }
@@ -79,16 +420,12 @@ static command_t os_procwatch = {
 static void
 mod_init(module_t *const restrict m)
 {
-	const int kq = kqueue();
-
-	if (kq == -1)
+	if (!procwatch_init())
 	{
 		m->mflags |= MODFLAG_FAIL;
 		return;
 	}
 
-	kq_conn = connection_add("procwatch kqueue", kq, 0, procwatch_readhandler, NULL);
-
 	service_named_bind_command("operserv", &os_procwatch);
 }
 
@@ -97,8 +434,7 @@ mod_deinit(const module_unload_intent_t intent)
 {
 	service_named_unbind_command("operserv", &os_procwatch);
 
-	if (kq_conn != NULL)
-		connection_close_soon(kq_conn);
+	procwatch_deinit();
 }
 
 SIMPLE_DECLARE_MODULE_V1("contrib/os_procwatch", MODULE_UNLOAD_CAPABILITY_OK)
@@ -2,97 +2,513 @@
  * Copyright (c) 2011 William Pitcock <nenolod@dereferenced.org>
  * Rights to this code are as documented in doc/LICENSE.
  *
- * Does an A/AAAA record lookup.
+ * Does A/AAAA record lookups for hostnames and PTR lookups for addresses
+ * or whole CIDR ranges. Queries are pipelined with a concurrency cap,
+ * answers are cached briefly, and the results come back as one table.
  */
 
 #include "atheme-compat.h"
 
-struct resolve_request
+#define RESOLVE_CONCURRENCY     16
+#define RESOLVE_MAX_QUERIES     1024
+#define RESOLVE_MAX_BATCHES     4
+#define RESOLVE_CACHE_TTL       60
+
+/* the smallest CIDR ranges a PTR sweep may cover: 1024 addresses */
+#define RESOLVE_MIN_PREFIX4     22
+#define RESOLVE_MIN_PREFIX6     118
+
+enum resolve_type
+{
+	RESOLVE_A,
+	RESOLVE_AAAA,
+	RESOLVE_PTR,
+};
+
+static const char *const resolve_type_names[] = {
+	[RESOLVE_A]     = "A",
+	[RESOLVE_AAAA]  = "AAAA",
+	[RESOLVE_PTR]   = "PTR",
+};
+
+struct resolve_query
 {
 	mowgli_dns_query_t dns_query;
+	struct resolve_batch *batch;
+	enum resolve_type type;
+	char *name;
+	char *result;
+	bool answered;
+	struct sockaddr_storage addr;
+};
+
+struct resolve_batch
+{
 	sourceinfo_t *si;
+	struct resolve_query *queries;
+	size_t count;
+	size_t next;
+	size_t inflight;
+	size_t done;
+	size_t cached;
+	bool pumping;
+	bool orphaned;
+	struct timespec start;
+	mowgli_node_t node;
+};
+
+struct resolve_cache_entry
+{
+	char *key;
+	time_t expires;
+	char *result;
+	bool answered;
 };
 
-static mowgli_heap_t *request_heap = NULL;
 static mowgli_dns_t *dns_base = NULL;
+static mowgli_patricia_t *resolve_cache = NULL;
+static mowgli_list_t resolve_batches;
+
+static void
+resolve_cache_free(const char *key, void *data, void *privdata)
+{
+	struct resolve_cache_entry *ce = data;
+
+	sfree(ce->key);
+	sfree(ce->result);
+	sfree(ce);
+}
+
+static void
+resolve_cache_key(char *buf, size_t len, const struct resolve_query *q)
+{
+	snprintf(buf, len, "%s %s", resolve_type_names[q->type], q->name);
+}
+
+static void
+resolve_cache_expire(void)
+{
+	mowgli_patricia_iteration_state_t state;
+	struct resolve_cache_entry *ce;
+
+	MOWGLI_PATRICIA_FOREACH(ce, &state, resolve_cache)
+	{
+		if (ce->expires > CURRTIME)
+			continue;
+
+		mowgli_patricia_delete(resolve_cache, ce->key);
+		resolve_cache_free(NULL, ce, NULL);
+	}
+}
+
+static void
+resolve_cache_store(const struct resolve_query *q)
+{
+	struct resolve_cache_entry *ce;
+	char key[BUFSIZE];
+
+	resolve_cache_key(key, sizeof key, q);
+
+	if ((ce = mowgli_patricia_retrieve(resolve_cache, key)) == NULL)
+	{
+		ce = smalloc(sizeof *ce);
+		ce->key = sstrdup(key);
+		ce->result = NULL;
+		mowgli_patricia_add(resolve_cache, ce->key, ce);
+	}
+
+	sfree(ce->result);
+	ce->result = sstrdup(q->result);
+	ce->answered = q->answered;
+	ce->expires = CURRTIME + RESOLVE_CACHE_TTL;
+}
+
+static bool
+resolve_cache_lookup(struct resolve_query *q)
+{
+	struct resolve_cache_entry *ce;
+	char key[BUFSIZE];
+
+	resolve_cache_key(key, sizeof key, q);
+
+	if ((ce = mowgli_patricia_retrieve(resolve_cache, key)) == NULL || ce->expires <= CURRTIME)
+		return false;
+
+	q->result = sstrdup(ce->result);
+	q->answered = ce->answered;
+	return true;
+}
+
+static void
+resolve_batch_free(struct resolve_batch *b)
+{
+	size_t i;
+
+	for (i = 0; i < b->count; i++)
+	{
+		sfree(b->queries[i].name);
+		sfree(b->queries[i].result);
+	}
+
+	mowgli_node_delete(&b->node, &resolve_batches);
+	atheme_object_unref(b->si);
+	sfree(b->queries);
+	sfree(b);
+}
+
+static void
+resolve_batch_report(struct resolve_batch *b)
+{
+	struct timespec now;
+	size_t i, failed = 0;
+	int width = 0;
+	double secs;
+
+	/* the requester quit; nobody is left to read the table */
+	if (b->orphaned)
+	{
+		resolve_batch_free(b);
+		return;
+	}
+
+	for (i = 0; i < b->count; i++)
+	{
+		const int len = strlen(b->queries[i].name);
+
+		if (len > width)
+			width = len < 45 ? len : 45;
+	}
+
+	for (i = 0; i < b->count; i++)
+	{
+		const struct resolve_query *q = &b->queries[i];
+
+		if (!q->answered)
+			failed++;
+
+		command_success_nodata(b->si, "%-*s %-4s %s", width, q->name, resolve_type_names[q->type], q->result);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec - b->start.tv_sec) + (now.tv_nsec - b->start.tv_nsec) / 1e9;
+
+	command_success_nodata(b->si, _("End of results: %zu queries (%zu from cache, %zu without an answer) in %.2fs."),
+		b->count, b->cached, failed, secs);
+
+	resolve_batch_free(b);
+}
+
+static void os_cmd_resolve_cb(mowgli_dns_reply_t *reply, int result, void *vptr);
+
+/* keeps up to RESOLVE_CONCURRENCY queries of the batch in flight */
+static void
+resolve_batch_pump(struct resolve_batch *b)
+{
+	/* a query may complete before mowgli_dns returns; the outer call finishes up */
+	if (b->pumping)
+		return;
+
+	b->pumping = true;
+
+	/* nobody will read the answers; let the queries in flight drain and stop */
+	if (b->orphaned)
+	{
+		b->done += b->count - b->next;
+		b->next = b->count;
+	}
+
+	while (b->inflight < RESOLVE_CONCURRENCY && b->next < b->count)
+	{
+		struct resolve_query *q = &b->queries[b->next++];
+
+		if (resolve_cache_lookup(q))
+		{
+			b->cached++;
+			b->done++;
+			continue;
+		}
+
+		q->dns_query.ptr = q;
+		q->dns_query.callback = &os_cmd_resolve_cb;
+		b->inflight++;
+
+		if (q->type == RESOLVE_PTR)
+			mowgli_dns_gethost_byaddr(dns_base, &q->addr, &q->dns_query);
+		else
+			mowgli_dns_gethost_byname(dns_base, q->name, &q->dns_query,
+				q->type == RESOLVE_A ? MOWGLI_DNS_T_A : MOWGLI_DNS_T_AAAA);
+	}
+
+	b->pumping = false;
+
+	if (b->done == b->count)
+		resolve_batch_report(b);
+}
 
 static void
 os_cmd_resolve_cb(mowgli_dns_reply_t *reply, int result, void *vptr)
 {
 	char buf[BUFSIZE];
 
-	return_if_fail(reply != NULL);
 	return_if_fail(vptr != NULL);
 
-	const struct sockaddr *const sa = (const struct sockaddr *) &reply->addr.addr;
-	struct resolve_request *const req = vptr;
+	struct resolve_query *const q = vptr;
+	struct resolve_batch *const b = q->batch;
+
+	q->answered = false;
 
-	if (sa->sa_family == AF_INET)
+	if (reply == NULL || (q->type == RESOLVE_PTR && reply->h_name == NULL))
+		mowgli_strlcpy(buf, "(no answer)", sizeof buf);
+	else if (q->type == RESOLVE_PTR)
+	{
+		mowgli_strlcpy(buf, reply->h_name, sizeof buf);
+		q->answered = true;
+	}
+	else
 	{
-		const struct sockaddr_in *const sa4 = (const struct sockaddr_in *) sa;
+		const struct sockaddr *const sa = (const struct sockaddr *) &reply->addr.addr;
 
-		if (inet_ntop(AF_INET, &sa4->sin_addr, buf, sizeof buf))
-			(void) command_success_nodata(req->si, _("Result: %s"), buf);
+		if (sa->sa_family == AF_INET)
+		{
+			const struct sockaddr_in *const sa4 = (const struct sockaddr_in *) sa;
+
+			if (inet_ntop(AF_INET, &sa4->sin_addr, buf, sizeof buf))
+				q->answered = true;
+			else
+				snprintf(buf, sizeof buf, "(inet_ntop(3) failed: %s)", strerror(errno));
+		}
+		else if (sa->sa_family == AF_INET6)
+		{
+			const struct sockaddr_in6 *const sa6 = (const struct sockaddr_in6 *) sa;
+
+			if (inet_ntop(AF_INET6, &sa6->sin6_addr, buf, sizeof buf))
+				q->answered = true;
+			else
+				snprintf(buf, sizeof buf, "(inet_ntop(3) failed: %s)", strerror(errno));
+		}
 		else
-			(void) command_fail(req->si, fault_internalerror, _("Error: inet_ntop(3) failed: %s"),
-			                    strerror(errno));
+			snprintf(buf, sizeof buf, "(unrecognised address family %d)", (int) sa->sa_family);
 	}
-	else if (sa->sa_family == AF_INET6)
+
+	q->result = sstrdup(buf);
+
+	/* failures are cached too, so a sweep does not hammer a dead server */
+	resolve_cache_store(q);
+
+	b->inflight--;
+	b->done++;
+
+	resolve_batch_pump(b);
+}
+
+/* a batch can run for minutes; never reply to a user that has gone away */
+static void
+resolve_user_delete(user_t *u)
+{
+	mowgli_node_t *n;
+
+	MOWGLI_ITER_FOREACH(n, resolve_batches.head)
 	{
-		const struct sockaddr_in6 *const sa6 = (const struct sockaddr_in6 *) sa;
+		struct resolve_batch *b = n->data;
 
-		if (inet_ntop(AF_INET6, &sa6->sin6_addr, buf, sizeof buf))
-			(void) command_success_nodata(req->si, _("Result: %s"), buf);
-		else
-			(void) command_fail(req->si, fault_internalerror, _("Error: inet_ntop(3) failed: %s"),
-			                    strerror(errno));
+		if (b->si->su != u)
+			continue;
+
+		b->si->su = NULL;
+		b->si->smu = NULL;
+		b->orphaned = true;
 	}
-	else
-		(void) command_fail(req->si, fault_internalerror, _("Error: Unrecognised address family %d"),
-		                    (int) sa->sa_family);
+}
+
+static bool
+resolve_batch_add(struct resolve_batch *b, mowgli_patricia_t *seen, enum resolve_type type, const char *name,
+                  const struct sockaddr_storage *addr)
+{
+	struct resolve_query *q;
+	char key[BUFSIZE];
 
-	(void) atheme_object_unref(req->si);
-	(void) mowgli_heap_free(request_heap, req);
+	snprintf(key, sizeof key, "%s %s", resolve_type_names[type], name);
+
+	if (mowgli_patricia_retrieve(seen, key) != NULL)
+		return true;
+
+	if (b->count == RESOLVE_MAX_QUERIES)
+		return false;
+
+	mowgli_patricia_add(seen, key, b);
+
+	q = &b->queries[b->count++];
+	q->batch = b;
+	q->type = type;
+	q->name = sstrdup(name);
+	q->result = NULL;
+	q->answered = false;
+
+	if (addr != NULL)
+		memcpy(&q->addr, addr, sizeof q->addr);
+
+	return true;
+}
+
+/* adds PTR queries for every address in an IPv4 or IPv6 CIDR range */
+static bool
+resolve_batch_add_cidr(sourceinfo_t *si, struct resolve_batch *b, mowgli_patricia_t *seen, char *token)
+{
+	struct sockaddr_storage ss;
+	char *slash = strchr(token, '/'), *end, name[INET6_ADDRSTRLEN];
+	unsigned long prefix, i, count;
+
+	*slash = '\0';
+	prefix = strtoul(slash + 1, &end, 10);
+	memset(&ss, 0, sizeof ss);
+
+	if (*end == '\0' && inet_pton(AF_INET, token, &((struct sockaddr_in *) &ss)->sin_addr) == 1)
+	{
+		struct sockaddr_in *const sa4 = (struct sockaddr_in *) &ss;
+		uint32_t base;
+
+		if (prefix < RESOLVE_MIN_PREFIX4 || prefix > 32)
+		{
+			command_fail(si, fault_badparams, _("IPv4 ranges must be between /%d and /32."), RESOLVE_MIN_PREFIX4);
+			return false;
+		}
+
+		sa4->sin_family = AF_INET;
+		count = 1UL << (32 - prefix);
+		base = ntohl(sa4->sin_addr.s_addr) & ~(uint32_t) (count - 1);
+
+		for (i = 0; i < count; i++)
+		{
+			sa4->sin_addr.s_addr = htonl(base + i);
+			inet_ntop(AF_INET, &sa4->sin_addr, name, sizeof name);
+
+			if (!resolve_batch_add(b, seen, RESOLVE_PTR, name, &ss))
+				return false;
+		}
+
+		return true;
+	}
+
+	if (*end == '\0' && inet_pton(AF_INET6, token, &((struct sockaddr_in6 *) &ss)->sin6_addr) == 1)
+	{
+		struct sockaddr_in6 *const sa6 = (struct sockaddr_in6 *) &ss;
+		unsigned int base;
+
+		if (prefix < RESOLVE_MIN_PREFIX6 || prefix > 128)
+		{
+			command_fail(si, fault_badparams, _("IPv6 ranges must be between /%d and /128."), RESOLVE_MIN_PREFIX6);
+			return false;
+		}
+
+		/* at most the low 10 bits vary, so only the last two bytes change */
+		sa6->sin6_family = AF_INET6;
+		count = 1UL << (128 - prefix);
+		base = ((sa6->sin6_addr.s6_addr[14] << 8) | sa6->sin6_addr.s6_addr[15]) & ~(unsigned int) (count - 1);
+
+		for (i = 0; i < count; i++)
+		{
+			sa6->sin6_addr.s6_addr[14] = (base + i) >> 8;
+			sa6->sin6_addr.s6_addr[15] = (base + i) & 0xff;
+			inet_ntop(AF_INET6, &sa6->sin6_addr, name, sizeof name);
+
+			if (!resolve_batch_add(b, seen, RESOLVE_PTR, name, &ss))
+				return false;
+		}
+
+		return true;
+	}
+
+	*slash = '/';
+	command_fail(si, fault_badparams, _("\2%s\2 is not a valid CIDR range."), token);
+	return false;
+}
+
+static bool
+resolve_batch_add_token(sourceinfo_t *si, struct resolve_batch *b, mowgli_patricia_t *seen, char *token)
+{
+	struct sockaddr_storage ss;
+	struct sockaddr_in *const sa4 = (struct sockaddr_in *) &ss;
+	struct sockaddr_in6 *const sa6 = (struct sockaddr_in6 *) &ss;
+
+	if (strchr(token, '/') != NULL)
+		return resolve_batch_add_cidr(si, b, seen, token);
+
+	memset(&ss, 0, sizeof ss);
+
+	if (inet_pton(AF_INET, token, &sa4->sin_addr) == 1)
+	{
+		sa4->sin_family = AF_INET;
+		return resolve_batch_add(b, seen, RESOLVE_PTR, token, &ss);
+	}
+
+	if (inet_pton(AF_INET6, token, &sa6->sin6_addr) == 1)
+	{
+		sa6->sin6_family = AF_INET6;
+		return resolve_batch_add(b, seen, RESOLVE_PTR, token, &ss);
+	}
+
+	return resolve_batch_add(b, seen, RESOLVE_A, token, NULL) &&
+	       resolve_batch_add(b, seen, RESOLVE_AAAA, token, NULL);
 }
 
 static void
 os_cmd_resolve_func(sourceinfo_t *si, int parc, char *parv[])
 {
+	struct resolve_batch *b;
+	mowgli_patricia_t *seen;
+	char *token, *saveptr = NULL;
+	bool ok = true;
+
 	if (!parv[0])
 	{
 		(void) command_fail(si, fault_needmoreparams, STR_INSUFFICIENT_PARAMS, "RESOLVE");
+		(void) command_fail(si, fault_needmoreparams, _("Syntax: RESOLVE <hostname|address|CIDR> [...]"));
 		return;
 	}
 
-	struct resolve_request *const req4 = mowgli_heap_alloc(request_heap);
-	struct resolve_request *const req6 = mowgli_heap_alloc(request_heap);
-
-	if (!req4 || !req6)
+	if (MOWGLI_LIST_LENGTH(&resolve_batches) >= RESOLVE_MAX_BATCHES)
 	{
-		(void) command_fail(si, fault_internalerror, _("mowgli_heap_alloc: memory allocation failure"));
+		(void) command_fail(si, fault_toomany, _("Too many RESOLVE requests are in progress. Try again later."));
+		return;
+	}
 
-		if (req4)
-			(void) mowgli_heap_free(request_heap, req4);
+	resolve_cache_expire();
 
-		if (req6)
-			(void) mowgli_heap_free(request_heap, req6);
+	b = smalloc(sizeof *b);
+	memset(b, 0, sizeof *b);
+	b->queries = smalloc(RESOLVE_MAX_QUERIES * sizeof *b->queries);
 
-		return;
-	}
+	/* duplicates within one request are asked once */
+	seen = mowgli_patricia_create(irccasecanon);
 
-	req4->si = si;
-	req4->dns_query.ptr = req4;
-	req4->dns_query.callback = &os_cmd_resolve_cb;
+	for (token = strtok_r(parv[0], " ", &saveptr); ok && token != NULL; token = strtok_r(NULL, " ", &saveptr))
+		ok = resolve_batch_add_token(si, b, seen, token);
 
-	req6->si = si;
-	req6->dns_query.ptr = req6;
-	req6->dns_query.callback = &os_cmd_resolve_cb;
+	mowgli_patricia_destroy(seen, NULL, NULL);
 
+	if (!ok && b->count == RESOLVE_MAX_QUERIES)
+		(void) command_fail(si, fault_toomany, _("At most %d queries fit in one request."), RESOLVE_MAX_QUERIES);
+
+	if (!ok || b->count == 0)
+	{
+		size_t i;
+
+		for (i = 0; i < b->count; i++)
+			sfree(b->queries[i].name);
+
+		sfree(b->queries);
+		sfree(b);
+		return;
+	}
+
+	b->si = si;
 	(void) atheme_object_ref(si);
-	(void) atheme_object_ref(si);
+	(void) clock_gettime(CLOCK_MONOTONIC, &b->start);
+	mowgli_node_add(b, &b->node, &resolve_batches);
 
-	(void) mowgli_dns_gethost_byname(dns_base, parv[0], &req4->dns_query, MOWGLI_DNS_T_A);
-	(void) mowgli_dns_gethost_byname(dns_base, parv[0], &req6->dns_query, MOWGLI_DNS_T_AAAA);
+	logcommand(si, CMDLOG_ADMIN, "RESOLVE: \2%zu\2 queries", b->count);
+
+	resolve_batch_pump(b);
 }
 
 static command_t os_cmd_resolve = {
@@ -107,13 +523,6 @@ static command_t os_cmd_resolve = {
 static void
 mod_init(module_t *const restrict m)
 {
-	if (! (request_heap = mowgli_heap_create(sizeof(struct resolve_request), 32, BH_NOW)))
-	{
-		(void) slog(LG_ERROR, "%s: failed to create Mowgli heap object", m->name);
-		m->mflags |= MODFLAG_FAIL;
-		return;
-	}
-
 	if (! (dns_base = mowgli_dns_create(base_eventloop, MOWGLI_DNS_TYPE_ASYNC)))
 	{
 		(void) slog(LG_ERROR, "%s: failed to create Mowgli DNS resolver object", m->name);
@@ -121,15 +530,30 @@ mod_init(module_t *const restrict m)
 		return;
 	}
 
+	resolve_cache = mowgli_patricia_create(irccasecanon);
+
+	hook_add_event("user_delete");
+	hook_add_user_delete(resolve_user_delete);
+
 	(void) service_named_bind_command("operserv", &os_cmd_resolve);
 }
 
 static void
 mod_deinit(const module_unload_intent_t intent)
 {
+	mowgli_node_t *n, *tn;
+
 	(void) service_named_unbind_command("operserv", &os_cmd_resolve);
-	(void) mowgli_heap_destroy(request_heap);
+
+	hook_del_user_delete(resolve_user_delete);
+
+	/* no callbacks can arrive once the resolver is gone */
 	(void) mowgli_dns_destroy(dns_base);
+
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, resolve_batches.head)
+		resolve_batch_free(n->data);
+
+	mowgli_patricia_destroy(resolve_cache, resolve_cache_free, NULL);
 }
 
 SIMPLE_DECLARE_MODULE_V1("contrib/os_resolve", MODULE_UNLOAD_CAPABILITY_OK)
@@ -7,43 +7,156 @@
 
 #include "atheme-compat.h"
 
+#define CHANMODES_FILE          DATADIR "/chanmodes.txt"
+
+// channels restored per second by LOADCHANMODES unless given on the command line
+#define RESTORE_DEFAULT_RATE    100
+#define RESTORE_MAX_RATE        10000
+
+struct snapshot
+{
+	char   *buf;
+	size_t  len;
+	size_t  alloc;
+};
+
+static struct
+{
+	FILE                       *in;
+	mowgli_eventloop_timer_t   *timer;
+	char                       *oper;
+	char                        buf[2048];
+	bool                        have_pending;
+	unsigned int                rate;
+	unsigned int                channels;
+	unsigned int                bans;
+} restore;
+
+static pid_t save_pid = 0;
+
+static void ATHEME_FATTR_PRINTF(2, 3)
+snapshot_printf(struct snapshot *snap, const char *fmt, ...)
+{
+	va_list args;
+	int len;
+
+	for (;;)
+	{
+		va_start(args, fmt);
+		len = vsnprintf(snap->buf + snap->len, snap->alloc - snap->len, fmt, args);
+		va_end(args);
+
+		if (len < 0)
+			return;
+
+		if ((size_t)len < snap->alloc - snap->len)
+			break;
+
+		snap->alloc = snap->alloc ? snap->alloc * 2 : 65536;
+		while (snap->alloc - snap->len <= (size_t)len)
+			snap->alloc *= 2;
+		snap->buf = srealloc(snap->buf, snap->alloc);
+	}
+
+	snap->len += len;
+}
+
+static int
+snapshot_write(const struct snapshot *snap)
+{
+	FILE *out;
+
+	if (!(out = fopen(CHANMODES_FILE ".new", "w")))
+		return -1;
+
+	fwrite(snap->buf, 1, snap->len, out);
+
+	if (ferror(out) | fclose(out))
+		return -1;
+
+	return srename(CHANMODES_FILE ".new", CHANMODES_FILE);
+}
+
+static void
+save_finished(pid_t pid, int status, void *data)
+{
+	save_pid = 0;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		slog(LG_ERROR, "SAVECHANMODES: cannot write %s", CHANMODES_FILE);
+		wallops("Dumping channel modes to %s failed", CHANMODES_FILE);
+		return;
+	}
+
+	wallops("Channel modes saved to %s", CHANMODES_FILE);
+}
+
 static void
 os_cmd_savechanmodes(sourceinfo_t *si, int parc, char *parv[])
 {
-	FILE *out;
+	struct snapshot snap = { NULL, 0, 0 };
 	mowgli_patricia_iteration_state_t state;
 	channel_t *c;
 	mowgli_node_t *n;
 	chanban_t *cb;
+	pid_t pid;
+	int errno1;
 
-	if (!(out = fopen(DATADIR "/chanmodes.txt", "w")))
+	if (save_pid)
 	{
-		command_fail(si, fault_nosuch_source, "Cannot open %s: %s",
-				DATADIR "/chanmodes.txt", strerror(errno));
+		command_fail(si, fault_toomany, "A channel mode dump is already in progress.");
 		return;
 	}
 
 	logcommand(si, CMDLOG_ADMIN, "SAVECHANMODES");
 	wallops("\2%s\2 is dumping channel modes", get_oper_name(si));
 
+	/* copy everything into one buffer on the main loop; the slow part
+	 * (the actual file I/O) happens in a child process
+	 */
 	MOWGLI_PATRICIA_FOREACH(c, &state, chanlist)
 	{
-		fprintf(out, "chan %s %s\n", c->name, channel_modes(c, true));
+		snapshot_printf(&snap, "chan %s %s\n", c->name, channel_modes(c, true));
 		if (c->topic)
-			fprintf(out, "topic %s %lu %s\n", c->topic_setter,
+			snapshot_printf(&snap, "topic %s %lu %s\n", c->topic_setter,
 					(unsigned long)c->topicts,
 					c->topic);
 		MOWGLI_ITER_FOREACH(n, c->bans.head)
 		{
 			cb = n->data;
-			fprintf(out, "ban %c %s\n", cb->type, cb->mask);
+			snapshot_printf(&snap, "ban %c %s\n", cb->type, cb->mask);
 		}
 	}
 
-	fclose(out);
+	pid = fork();
+
+	switch (pid)
+	{
+		case -1:
+			errno1 = errno;
+			slog(LG_ERROR, "SAVECHANMODES: cannot fork, writing in the foreground: %s", strerror(errno1));
+
+			if (snapshot_write(&snap) < 0)
+			{
+				errno1 = errno;
+				command_fail(si, fault_nosuch_source, "Cannot write %s: %s",
+						CHANMODES_FILE, strerror(errno1));
+				break;
+			}
+
+			command_success_nodata(si, "Channel modes saved to %s.", CHANMODES_FILE);
+			break;
+		case 0:
+			_exit(snapshot_write(&snap) < 0 ? 1 : 0);
+		default:
+			save_pid = pid;
+			childproc_add(pid, "savechanmodes", save_finished, NULL);
+			command_success_nodata(si, "Saving channel modes to %s in the background.", CHANMODES_FILE);
+			break;
+	}
 
-	command_success_nodata(si, "Channel modes saved to %s.",
-			DATADIR "/chanmodes.txt");
+	sfree(snap.buf);
 }
 
 static channel_t *
@@ -68,32 +181,60 @@ restore_channel(char *name, char *modes)
 	return c;
 }
 
+/* the modestack packs the bans of a channel into as few MODE lines as the
+ * protocol module allows
+ */
 static void
-os_cmd_loadchanmodes(sourceinfo_t *si, int parc, char *parv[])
+restore_add_ban(channel_t *c, char type, const char *mask)
+{
+	chanban_add(c, mask, type);
+	modestack_mode_param(chansvs.nick, c, MTYPE_ADD, type, mask);
+	restore.bans++;
+}
+
+static void
+restore_finish(void)
+{
+	fclose(restore.in);
+	restore.in = NULL;
+
+	slog(LG_INFO, "LOADCHANMODES: restored %u channels and %u bans from %s", restore.channels, restore.bans, CHANMODES_FILE);
+	wallops("Channel modes restored from %s for \2%s\2 (%u channels, %u bans)",
+			CHANMODES_FILE, restore.oper, restore.channels, restore.bans);
+
+	sfree(restore.oper);
+	restore.oper = NULL;
+}
+
+static void
+restore_tick(void *unused)
 {
-	FILE *in;
-	char *item, buf[2048];
+	char *item;
 	char *name, *modes, *setter, *tsstr, *topic, *type, *mask;
 	time_t ts, prevtopicts;
-	channel_t *c;
-	int line;
+	channel_t *c = NULL;
+	unsigned int n = 0;
+
+	restore.timer = NULL;
 
-	if (!(in = fopen(DATADIR "/chanmodes.txt", "r")))
+	for (;;)
 	{
-		command_fail(si, fault_nosuch_source, "Cannot open %s: %s",
-				DATADIR "/chanmodes.txt", strerror(errno));
-		return;
-	}
+		if (restore.have_pending)
+			restore.have_pending = false;
+		else if (!fgets(restore.buf, sizeof restore.buf, restore.in))
+		{
+			restore_finish();
+			return;
+		}
 
-	logcommand(si, CMDLOG_ADMIN, "LOADCHANMODES");
-	wallops("\2%s\2 is restoring channel modes", get_oper_name(si));
+		/* stop at the first channel that does not fit in this tick */
+		if (!strncmp(restore.buf, "chan ", 5) && n == restore.rate)
+		{
+			restore.have_pending = true;
+			break;
+		}
 
-	line = 0;
-	c = NULL;
-	while (fgets(buf, sizeof buf, in))
-	{
-		line++;
-		item = strtok(buf, " ");
+		item = strtok(restore.buf, " ");
 		strip(item);
 
 		if (item == NULL || *item == '#')
@@ -104,9 +245,12 @@ os_cmd_loadchanmodes(sourceinfo_t *si, int parc, char *parv[])
 			name = strtok(NULL, " ");
 			modes = strtok(NULL, "\n");
 
+			c = NULL;
 			if (name == NULL || modes == NULL)
 				continue;
 			c = restore_channel(name, modes);
+			restore.channels++;
+			n++;
 		}
 		else if (!strcmp(item, "topic"))
 		{
@@ -136,17 +280,60 @@ os_cmd_loadchanmodes(sourceinfo_t *si, int parc, char *parv[])
 
 			if (type == NULL || mask == NULL)
 				continue;
-			modestack_mode_param(chansvs.nick, c, MTYPE_ADD, type[0], mask);
-			chanban_add(c, mask, type[0]);
+			restore_add_ban(c, type[0], mask);
 		}
 	}
 
-	fclose(in);
+	restore.timer = mowgli_timer_add_once(base_eventloop, "loadchanmodes", restore_tick, NULL, 1);
+}
+
+static void
+os_cmd_loadchanmodes(sourceinfo_t *si, int parc, char *parv[])
+{
+	unsigned long rate = RESTORE_DEFAULT_RATE;
+	char *end;
 
-	command_success_nodata(si, "Channel modes restored from %s.",
-			DATADIR "/chanmodes.txt");
+	if (restore.in != NULL)
+	{
+		command_success_nodata(si, "Channel modes are being restored from %s for \2%s\2: %u channels and %u bans so far.",
+				CHANMODES_FILE, restore.oper, restore.channels, restore.bans);
+		return;
+	}
+
+	if (parc > 0 && parv[0] != NULL)
+	{
+		rate = strtoul(parv[0], &end, 10);
+
+		if (!isdigit((unsigned char) *parv[0]) || *end != '\0' || rate < 1 || rate > RESTORE_MAX_RATE)
+		{
+			command_fail(si, fault_badparams, STR_INVALID_PARAMS, "LOADCHANMODES");
+			command_fail(si, fault_badparams, _("Syntax: LOADCHANMODES [1-%u channels per second]"), RESTORE_MAX_RATE);
+			return;
+		}
+	}
+
+	if (!(restore.in = fopen(CHANMODES_FILE, "r")))
+	{
+		command_fail(si, fault_nosuch_source, "Cannot open %s: %s",
+				CHANMODES_FILE, strerror(errno));
+		return;
+	}
+
+	logcommand(si, CMDLOG_ADMIN, "LOADCHANMODES: %lu channels per second", rate);
+	wallops("\2%s\2 is restoring channel modes", get_oper_name(si));
+
+	restore.oper = sstrdup(get_oper_name(si));
+	restore.have_pending = false;
+	restore.rate = rate;
+	restore.channels = 0;
+	restore.bans = 0;
+
+	command_success_nodata(si, "Restoring channel modes from %s at %lu channels per second.",
+			CHANMODES_FILE, rate);
 	command_success_nodata(si, "Remember to restart services to make %s leave channels it should not be in.",
 			chansvs.nick);
+
+	restore_tick(NULL);
 }
 
 static command_t os_savechanmodes = {
@@ -179,6 +366,17 @@ mod_deinit(const module_unload_intent_t intent)
 {
 	service_named_unbind_command("operserv", &os_savechanmodes);
 	service_named_unbind_command("operserv", &os_loadchanmodes);
+
+	childproc_delete_all(save_finished);
+
+	if (restore.timer != NULL)
+		mowgli_timer_destroy(base_eventloop, restore.timer);
+
+	if (restore.in != NULL)
+	{
+		fclose(restore.in);
+		sfree(restore.oper);
+	}
 }
 
 VENDOR_DECLARE_MODULE_V1("contrib/os_savechanmodes", MODULE_UNLOAD_CAPABILITY_OK, CONTRIB_VENDOR_JILLEST)
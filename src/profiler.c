@@ -0,0 +1,463 @@
+/*
+ * Copyright (C) 2026 Atheme Development Group (https://atheme.github.io/)
+ * Rights to this code are documented in doc/LICENSE.
+ *
+ * Sampling profiler: records stack traces on SIGPROF and writes them out
+ * as folded stacks, suitable for flame graph tools.
+ */
+
+#include "atheme-compat.h"
+
+#if (defined(__linux__) || defined(__Linux__)) && defined(__GLIBC__)
+#  if (__GLIBC__ == 2) && defined(__GLIBC_MINOR__) && (__GLIBC_MINOR__ >= 1)
+#    define HAVE_BACKTRACE_SUPPORT      1
+#  else /* (__GLIBC__ == 2) && __GLIBC_MINOR__ && (__GLIBC_MINOR >= 1) */
+#    if (__GLIBC__ > 2)
+#      define HAVE_BACKTRACE_SUPPORT    1
+#    endif /* (__GLIBC__ > 2) */
+#  endif /* !((__GLIBC__ == 2) && __GLIBC_MINOR__ && (__GLIBC_MINOR__ >= 1)) */
+#endif /* (__linux__ || __Linux__) && __GLIBC__ */
+
+#ifdef HAVE_BACKTRACE_SUPPORT
+
+#include <execinfo.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+
+#define MAX_STACK_FRAMES        32
+
+// The signal handler and the kernel's signal trampoline
+#define SKIP_STACK_FRAMES       2
+
+// Must be a power of two; drained every second, so it holds > 4s at the maximum rate
+#define RING_SLOTS              4096
+
+#define DEFAULT_SAMPLE_HZ       99
+#define MAX_SAMPLE_HZ           1000
+
+#ifdef DATADIR
+#define PROFILE_FILE            DATADIR "/profile.folded"
+#else /* DATADIR */
+#define PROFILE_FILE            "profile.folded"
+#endif /* !DATADIR */
+
+struct profile_sample
+{
+	int     depth;
+	void *  frames[MAX_STACK_FRAMES];
+};
+
+struct profile_stack
+{
+	unsigned int    count;
+	int             depth;
+	void *          frames[];
+};
+
+/* Single producer (the signal handler), single consumer (the event loop).
+ * The handler only ever writes the slot at ring_head, which the consumer
+ * does not read until ring_head has been advanced past it.
+ */
+static struct profile_sample *ring = NULL;
+static atomic_uint ring_head;
+static atomic_uint ring_tail;
+static atomic_uint ring_dropped;
+
+static mowgli_patricia_t *profile_stacks = NULL;
+static mowgli_eventloop_timer_t *drain_timer = NULL;
+static struct sigaction oldprofaction;
+
+static bool profiling = false;
+static unsigned int profile_hz = 0;
+static unsigned int profile_samples = 0;
+static time_t profile_started = 0;
+
+static void
+contrib_profiler_signal_handler(const int ATHEME_VATTR_UNUSED signum,
+                                siginfo_t ATHEME_VATTR_UNUSED *const restrict info,
+                                void ATHEME_VATTR_UNUSED *const restrict ucontext)
+{
+	const int saved_errno = errno;
+	const unsigned int head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+	const unsigned int tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+
+	if (head - tail >= RING_SLOTS)
+	{
+		(void) atomic_fetch_add_explicit(&ring_dropped, 1, memory_order_relaxed);
+		errno = saved_errno;
+		return;
+	}
+
+	struct profile_sample *const sample = &ring[head & (RING_SLOTS - 1)];
+
+	sample->depth = backtrace(sample->frames, MAX_STACK_FRAMES);
+
+	atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+	errno = saved_errno;
+}
+
+static void
+profile_stack_free(const char ATHEME_VATTR_UNUSED *const restrict key, void *const restrict data,
+                   void ATHEME_VATTR_UNUSED *const restrict privdata)
+{
+	sfree(data);
+}
+
+// Folds everything the signal handler has recorded into profile_stacks
+static void
+profile_drain(void)
+{
+	const unsigned int head = atomic_load_explicit(&ring_head, memory_order_acquire);
+	unsigned int tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+	char key[MAX_STACK_FRAMES * (2 + (2 * sizeof(void *)) + 1) + 1];
+
+	for (; tail != head; tail++)
+	{
+		const struct profile_sample *const sample = &ring[tail & (RING_SLOTS - 1)];
+
+		if (sample->depth <= SKIP_STACK_FRAMES)
+			continue;
+
+		void *const *const frames = sample->frames + SKIP_STACK_FRAMES;
+		const int depth = sample->depth - SKIP_STACK_FRAMES;
+		size_t keylen = 0;
+
+		for (int i = 0; i < depth; i++)
+			keylen += (size_t) snprintf(key + keylen, sizeof key - keylen, "%p,", frames[i]);
+
+		struct profile_stack *stack = mowgli_patricia_retrieve(profile_stacks, key);
+
+		if (! stack)
+		{
+			stack = smalloc(sizeof *stack + ((size_t) depth * sizeof(void *)));
+			stack->count = 0;
+			stack->depth = depth;
+			(void) memcpy(stack->frames, frames, (size_t) depth * sizeof(void *));
+
+			(void) mowgli_patricia_add(profile_stacks, key, stack);
+		}
+
+		stack->count++;
+		profile_samples++;
+	}
+
+	atomic_store_explicit(&ring_tail, tail, memory_order_release);
+}
+
+static void
+profile_drain_timer(void ATHEME_VATTR_UNUSED *const restrict unused)
+{
+	profile_drain();
+}
+
+static bool
+profile_start(const unsigned int hz)
+{
+	const unsigned int usec = 1000000U / hz;
+	const struct itimerval interval = {
+		.it_interval    = { .tv_sec = usec / 1000000U, .tv_usec = usec % 1000000U },
+		.it_value       = { .tv_sec = usec / 1000000U, .tv_usec = usec % 1000000U },
+	};
+
+	if (! ring)
+		ring = smalloc(RING_SLOTS * sizeof *ring);
+
+	// The first backtrace(3) call loads libgcc, which allocates; never let that happen in the handler
+	void *warmup[1];
+	(void) backtrace(warmup, 1);
+
+	if (profile_stacks)
+		mowgli_patricia_destroy(profile_stacks, &profile_stack_free, NULL);
+
+	profile_stacks = mowgli_patricia_create(NULL);
+	profile_samples = 0;
+
+	atomic_store(&ring_head, 0);
+	atomic_store(&ring_tail, 0);
+	atomic_store(&ring_dropped, 0);
+
+	struct sigaction newsigaction = {
+		.sa_sigaction   = &contrib_profiler_signal_handler,
+		.sa_flags       = SA_SIGINFO | SA_RESTART,
+	};
+
+	(void) sigemptyset(&newsigaction.sa_mask);
+
+	if (sigaction(SIGPROF, &newsigaction, &oldprofaction) != 0)
+	{
+		(void) slog(LG_ERROR, "%s: sigaction(2) for SIGPROF failed: %s", __func__, strerror(errno));
+		return false;
+	}
+
+	if (setitimer(ITIMER_PROF, &interval, NULL) != 0)
+	{
+		(void) slog(LG_ERROR, "%s: setitimer(2) failed: %s", __func__, strerror(errno));
+
+		(void) sigaction(SIGPROF, &oldprofaction, NULL);
+		return false;
+	}
+
+	drain_timer = mowgli_timer_add(base_eventloop, "profile_drain", &profile_drain_timer, NULL, 1);
+
+	profiling = true;
+	profile_hz = hz;
+	profile_started = CURRTIME;
+
+	return true;
+}
+
+static void
+profile_stop(void)
+{
+	const struct itimerval disarm = { .it_interval = { 0, 0 }, .it_value = { 0, 0 } };
+
+	(void) setitimer(ITIMER_PROF, &disarm, NULL);
+	(void) sigaction(SIGPROF, &oldprofaction, NULL);
+
+	mowgli_timer_destroy(base_eventloop, drain_timer);
+	drain_timer = NULL;
+
+	profile_drain();
+
+	profiling = false;
+}
+
+// Writes the function name for a backtrace_symbols(3) entry, or object+offset for static functions
+static void
+profile_write_frame(FILE *const restrict fp, const char *const restrict symbol, const void *const restrict frame)
+{
+	if (! symbol)
+	{
+		(void) fprintf(fp, "%p", frame);
+		return;
+	}
+
+	// "path(function+0x1a) [0x...]", "path(+0x1a) [0x...]" or "path [0x...]"
+	const char *const lparen = strchr(symbol, '(');
+	const char *const plus = lparen ? strpbrk(lparen, "+)") : NULL;
+
+	if (lparen && plus && plus > lparen + 1)
+	{
+		(void) fprintf(fp, "%.*s", (int) (plus - lparen - 1), lparen + 1);
+		return;
+	}
+
+	const char *end = lparen ? lparen : strchr(symbol, ' ');
+	const char *base = symbol;
+
+	if (! end)
+		end = symbol + strlen(symbol);
+
+	for (const char *p = symbol; p < end; p++)
+		if (*p == '/')
+			base = p + 1;
+
+	if (lparen && plus && *plus == '+')
+	{
+		const char *const close = strchr(plus, ')');
+
+		(void) fprintf(fp, "%.*s%.*s", (int) (end - base), base,
+		               (int) ((close ? close : plus + strlen(plus)) - plus), plus);
+	}
+	else
+		(void) fprintf(fp, "%.*s@%p", (int) (end - base), base, frame);
+}
+
+static bool
+profile_dump(unsigned int *const restrict stacks)
+{
+	FILE *const fp = fopen(PROFILE_FILE, "w");
+
+	if (! fp)
+	{
+		(void) slog(LG_ERROR, "%s: fopen('%s') failed: %s", __func__, PROFILE_FILE, strerror(errno));
+		return false;
+	}
+
+	mowgli_patricia_iteration_state_t state;
+	struct profile_stack *stack;
+
+	*stacks = 0;
+
+	MOWGLI_PATRICIA_FOREACH(stack, &state, profile_stacks)
+	{
+		char **const symbols = backtrace_symbols(stack->frames, stack->depth);
+
+		// backtrace(3) returns the innermost frame first; folded stacks start at the root
+		for (int i = stack->depth - 1; i >= 0; i--)
+		{
+			profile_write_frame(fp, symbols ? symbols[i] : NULL, stack->frames[i]);
+
+			if (i)
+				(void) fputc(';', fp);
+		}
+
+		(void) fprintf(fp, " %u\n", stack->count);
+		free(symbols);
+
+		(*stacks)++;
+	}
+
+	if (fclose(fp) != 0)
+	{
+		(void) slog(LG_ERROR, "%s: fclose('%s') failed: %s", __func__, PROFILE_FILE, strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+static void
+os_cmd_profile(sourceinfo_t *si, int parc, char *parv[])
+{
+	if (parc < 1)
+	{
+		if (! profiling)
+		{
+			(void) command_success_nodata(si, _("The profiler is not running."));
+			return;
+		}
+
+		profile_drain();
+		(void) command_success_nodata(si, _("Profiling at \2%u\2 Hz for %s: \2%u\2 samples in \2%u\2 "
+		                                    "distinct stacks, \2%u\2 dropped."), profile_hz,
+		                              time_ago(profile_started), profile_samples,
+		                              mowgli_patricia_size(profile_stacks),
+		                              atomic_load(&ring_dropped));
+		return;
+	}
+
+	if (strcasecmp(parv[0], "START") == 0)
+	{
+		unsigned int hz = DEFAULT_SAMPLE_HZ;
+
+		if (profiling)
+		{
+			(void) command_fail(si, fault_nochange, _("The profiler is already running."));
+			return;
+		}
+
+		if (parc > 1)
+		{
+			char *end;
+			const unsigned long v = strtoul(parv[1], &end, 10);
+
+			if (*end != '\0' || v < 1 || v > MAX_SAMPLE_HZ)
+			{
+				(void) command_fail(si, fault_badparams, STR_INVALID_PARAMS, "PROFILE");
+				(void) command_fail(si, fault_badparams, _("Syntax: PROFILE START [1-%u Hz]"),
+				                    MAX_SAMPLE_HZ);
+				return;
+			}
+
+			hz = (unsigned int) v;
+		}
+
+		if (! profile_start(hz))
+		{
+			(void) command_fail(si, fault_internalerror, _("The profiler could not be started; "
+			                                               "check the services log."));
+			return;
+		}
+
+		(void) logcommand(si, CMDLOG_ADMIN, "PROFILE:START: \2%u\2 Hz", hz);
+		(void) command_success_nodata(si, _("Profiling at \2%u\2 Hz."), hz);
+		return;
+	}
+
+	if (strcasecmp(parv[0], "STOP") == 0)
+	{
+		if (! profiling)
+		{
+			(void) command_fail(si, fault_nochange, _("The profiler is not running."));
+			return;
+		}
+
+		profile_stop();
+
+		(void) logcommand(si, CMDLOG_ADMIN, "PROFILE:STOP");
+		(void) command_success_nodata(si, _("Profiler stopped after \2%u\2 samples (\2%u\2 dropped)."),
+		                              profile_samples, atomic_load(&ring_dropped));
+		return;
+	}
+
+	if (strcasecmp(parv[0], "DUMP") == 0)
+	{
+		unsigned int stacks;
+
+		if (! profile_stacks)
+		{
+			(void) command_fail(si, fault_nosuch_target, _("Nothing has been profiled yet."));
+			return;
+		}
+
+		if (profiling)
+			profile_drain();
+
+		if (! profile_dump(&stacks))
+		{
+			(void) command_fail(si, fault_internalerror, _("Could not write \2%s\2; check the services "
+			                                               "log."), PROFILE_FILE);
+			return;
+		}
+
+		(void) logcommand(si, CMDLOG_ADMIN, "PROFILE:DUMP");
+		(void) command_success_nodata(si, _("Wrote \2%u\2 stacks (\2%u\2 samples) to \2%s\2."),
+		                              stacks, profile_samples, PROFILE_FILE);
+		return;
+	}
+
+	(void) command_fail(si, fault_badparams, STR_INVALID_PARAMS, "PROFILE");
+	(void) command_fail(si, fault_badparams, _("Syntax: PROFILE [START [hz]|STOP|DUMP]"));
+}
+
+static command_t os_profile = {
+	.name           = "PROFILE",
+	.desc           = N_("Samples where services spends its time."),
+	.access         = PRIV_ADMIN,
+	.maxparc        = 2,
+	.cmd            = &os_cmd_profile,
+	.help           = { .path = "contrib/profile" },
+};
+
+static void
+mod_init(module_t *const restrict m)
+{
+	(void) service_named_bind_command("operserv", &os_profile);
+}
+
+static void
+mod_deinit(const module_unload_intent_t ATHEME_VATTR_UNUSED intent)
+{
+	(void) service_named_unbind_command("operserv", &os_profile);
+
+	if (profiling)
+		profile_stop();
+
+	if (profile_stacks)
+		mowgli_patricia_destroy(profile_stacks, &profile_stack_free, NULL);
+
+	sfree(ring);
+}
+
+#else /* HAVE_BACKTRACE_SUPPORT */
+
+static void
+mod_init(module_t *const restrict m)
+{
+	(void) slog(LG_ERROR, "%s: this module only supports Linux systems with GNU libc >= 2.1", m->name);
+	(void) slog(LG_ERROR, "%s: please check your configuration and build environment", m->name);
+
+	m->mflags |= MODFLAG_FAIL;
+}
+
+static void
+mod_deinit(const module_unload_intent_t ATHEME_VATTR_UNUSED intent)
+{
+
+}
+
+#endif /* !HAVE_BACKTRACE_SUPPORT */
+
+SIMPLE_DECLARE_MODULE_V1("contrib/profiler", MODULE_UNLOAD_CAPABILITY_OK)
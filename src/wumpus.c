@@ -10,6 +10,25 @@
 
 #include "atheme-compat.h"
 
+#include <limits.h>
+
+/* every room has exactly this many (one-way) exits */
+#define ROOM_EXITS	3
+
+/* wumpus distance of rooms the wumpus cannot be reached from */
+#define WUMPUS_FAR	UINT_MAX
+
+/* how many channels may host a game at the same time */
+#define WUMPUS_MAX_GAMES	64
+
+/* BENCH runs on the main loop; rooms x rounds is capped to keep it short */
+#define BENCH_MAX_ROOMS		100000
+#define BENCH_MAX_ROOM_ROUNDS	500000
+
+/* game arenas grow in chunks of at least this many bytes */
+#define ARENA_CHUNK_SIZE	4096
+#define ARENA_ALIGN		16
+
 /* contents */
 typedef enum {
 	E_NOTHING = 0,
@@ -23,25 +42,47 @@ typedef enum {
 /* room_t: Describes a room that the wumpus or players could be in. */
 struct room_ {
 	int id;			/* room 3 or whatever */
-	mowgli_list_t exits;		/* old int count == exits.count */
+	struct room_ *exits[ROOM_EXITS];
 	contents_t contents;
 	mowgli_list_t players;		/* player_t players */
 };
 
 typedef struct room_ room_t;
 
+/* arena_t: Bump allocator owning all memory of one game. */
+struct arena_chunk_ {
+	struct arena_chunk_ *next;
+	size_t size;
+	size_t used;
+};
+
+#define ARENA_HDR	((sizeof(struct arena_chunk_) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+typedef struct arena_ {
+	struct arena_chunk_ *head;
+} arena_t;
+
+struct game_;
+
 /* player_t: A player object. */
 struct player_ {
+	struct game_ *game;
 	user_t    *u;
 	room_t    *location;
 	int        arrows;
 	int	   hp;
 	bool  has_moved;
+
+	mowgli_node_t gnode;	/* in game->players */
+	mowgli_node_t rnode;	/* in location->players */
 };
 
 typedef struct player_ player_t;
 
 struct game_ {
+	char chan[CHANNELLEN + 1];
+	bool joined;		/* we joined chan for this game and part it at the end */
+
 	int wumpus;
 	int mazesize;
 	mowgli_list_t players;
@@ -49,7 +90,17 @@ struct game_ {
 	bool starting;
 
 	room_t *rmemctx;	/* memory page context */
-	service_t *svs;
+
+	/* reverse adjacency (CSR): rooms with an exit into room i are
+	 * rev_exits[rev_offsets[i]] .. rev_exits[rev_offsets[i + 1] - 1]
+	 */
+	unsigned int *rev_offsets;
+	unsigned int *rev_exits;
+
+	/* number of moves from each room to the wumpus, updated when it moves */
+	unsigned int *wdist;
+	unsigned int *bfs_queue;
+
 	int wump_hp;
 	int speed;
 
@@ -57,11 +108,15 @@ struct game_ {
 
 	mowgli_eventloop_timer_t *move_timer;
 	mowgli_eventloop_timer_t *start_game_timer;
+
+	arena_t arena;		/* rooms, players and maze indexes */
 };
 
 typedef struct game_ game_t;
 
-game_t wumpus;
+/* running and starting games, keyed by channel */
+static mowgli_patricia_t *games;
+static service_t *wumpus_svs;
 
 struct __wumpusconfig
 {
@@ -78,72 +133,134 @@ struct __wumpusconfig
 	"Hunt the Wumpus"
 };
 
-/* ------------------------------ utility functions */
+/* ------------------------------ arena functions */
 
-/* returns 1 or 2 depending on if the wumpus is 1 or 2 rooms away */
-static int
-distance_to_wumpus(player_t *player)
+/* returns zeroed memory that lives until the arena is destroyed */
+static void *
+arena_alloc(arena_t *a, size_t size)
 {
-	mowgli_node_t *n, *tn;
+	struct arena_chunk_ *c = a->head;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
 
-	MOWGLI_ITER_FOREACH(n, player->location->exits.head)
+	if (c == NULL || c->size - c->used < size)
 	{
-		room_t *r = (room_t *) n->data;
+		size_t csize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
 
-		if (r->contents == E_WUMPUS)
-			return 1;
+		c = smalloc(ARENA_HDR + csize);
+		c->size = csize;
+		c->used = 0;
+
+		/* keep the partly used chunk in front for small allocations */
+		if (size >= ARENA_CHUNK_SIZE && a->head != NULL)
+		{
+			c->next = a->head->next;
+			a->head->next = c;
+		}
+		else
+		{
+			c->next = a->head;
+			a->head = c;
+		}
+	}
+
+	p = (char *) c + ARENA_HDR + c->used;
+	c->used += size;
+
+	memset(p, '\0', size);
+
+	return p;
+}
+
+static void
+arena_destroy(arena_t *a)
+{
+	struct arena_chunk_ *c, *next;
+
+	for (c = a->head; c != NULL; c = next)
+	{
+		next = c->next;
+		sfree(c);
+	}
+
+	a->head = NULL;
+}
+
+/* ------------------------------ utility functions */
+
+/* recomputes wdist with a breadth-first search backwards from the wumpus */
+static void
+update_wumpus_distances(game_t *g)
+{
+	unsigned int head = 0, tail = 0;
+	unsigned int v, k, r;
+	int i;
+
+	for (i = 0; i < g->mazesize; i++)
+		g->wdist[i] = WUMPUS_FAR;
+
+	g->wdist[g->wumpus] = 0;
+	g->bfs_queue[tail++] = g->wumpus;
 
-		MOWGLI_ITER_FOREACH(tn, r->exits.head)
+	while (head < tail)
+	{
+		v = g->bfs_queue[head++];
+
+		for (k = g->rev_offsets[v]; k < g->rev_offsets[v + 1]; k++)
 		{
-			room_t *r2 = (room_t *) tn->data;
+			r = g->rev_exits[k];
 
-			if (r2->contents == E_WUMPUS)
-				return 2;
+			if (g->wdist[r] != WUMPUS_FAR)
+				continue;
 
-			/* we don't evaluate exitpoints at this depth */
+			g->wdist[r] = g->wdist[v] + 1;
+			g->bfs_queue[tail++] = r;
 		}
 	}
+}
 
-	return 0;
+/* returns 1 or 2 depending on if the wumpus is 1 or 2 rooms away */
+static int
+distance_to_wumpus(player_t *player)
+{
+	unsigned int d = player->game->wdist[player->location->id];
+
+	return (d == 1 || d == 2) ? (int) d : 0;
 }
 
 /* can we move or perform an action on this room? */
 static bool
 adjacent_room(player_t *p, int id)
 {
-	mowgli_node_t *n;
+	unsigned int i;
 
-	MOWGLI_ITER_FOREACH(n, p->location->exits.head)
+	for (i = 0; i < ROOM_EXITS; i++)
 	{
-		room_t *r = (room_t *) n->data;
-
-		if (r->id == id)
+		if (p->location->exits[i]->id == id)
 			return true;
 	}
 
 	return false;
 }
 
-/* finds a player in the list */
+/* finds the game played in a channel */
+static game_t *
+find_game(const char *chan)
+{
+	return mowgli_patricia_retrieve(games, chan);
+}
+
+/* finds the game a user is playing in */
 static player_t *
 find_player(user_t *u)
 {
-	mowgli_node_t *n;
-
-	MOWGLI_ITER_FOREACH(n, wumpus.players.head)
-	{
-		player_t *p = n->data;
-
-		if (p->u == u)
-			return p;
-	}
-
-	return NULL;
+	return privatedata_get(u, "wumpus:player");
 }
 
 /* adds a player to the game */
 static player_t *
-create_player(user_t *u)
+create_player(game_t *g, user_t *u)
 {
 	player_t *p;
 
@@ -153,54 +270,46 @@ create_player(user_t *u)
 		return NULL;
 	}
 
-	if (wumpus.running)
+	if (g->running)
 	{
 		notice(wumpus_cfg.nick, u->nick, "The game is already in progress. Sorry!");
 		return NULL;
 	}
 
-	p = smalloc(sizeof(player_t));
-	memset(p, '\0', sizeof(player_t));
+	p = arena_alloc(&g->arena, sizeof(player_t));
 
+	p->game = g;
 	p->u = u;
 	p->arrows = 10;
 	p->hp = 30;
 
-	mowgli_node_add(p, mowgli_node_create(), &wumpus.players);
+	mowgli_node_add(p, &p->gnode, &g->players);
+	privatedata_set(u, "wumpus:player", p);
 
 	return p;
 }
 
-/* destroys a player object and removes them from the game */
+/* removes a player from the game; their memory goes away with the game's arena */
 static void
 resign_player(player_t *player)
 {
-	mowgli_node_t *n;
-
 	if (player == NULL)
 		return;
 
 	if (player->location)
-	{
-		n = mowgli_node_find(player, &player->location->players);
-		mowgli_node_delete(n, &player->location->players);
-		mowgli_node_free(n);
-	}
+		mowgli_node_delete(&player->rnode, &player->location->players);
 
-	n = mowgli_node_find(player, &wumpus.players);
-	mowgli_node_delete(n, &wumpus.players);
-	mowgli_node_free(n);
-
-	sfree(player);
+	mowgli_node_delete(&player->gnode, &player->game->players);
+	privatedata_delete(player->u, "wumpus:player");
 }
 
 /* ------------------------------ game functions */
 
 /* builds the maze, and returns false if the maze is too small */
 static bool
-build_maze(unsigned int size)
+build_maze(game_t *g, unsigned int size)
 {
-	unsigned int i, j;
+	unsigned int i, j, k;
 	room_t *w;
 
 	if (size < 10)
@@ -209,47 +318,57 @@ build_maze(unsigned int size)
 	slog(LG_DEBUG, "wumpus: building maze of %u chambers", size);
 
 	/* allocate rooms */
-	wumpus.mazesize = size;
-	wumpus.rmemctx = scalloc(size, sizeof(room_t));
+	g->mazesize = size;
+	g->rmemctx = arena_alloc(&g->arena, size * sizeof(room_t));
+	g->rev_offsets = arena_alloc(&g->arena, (size + 1) * sizeof(unsigned int));
+	g->rev_exits = arena_alloc(&g->arena, size * ROOM_EXITS * sizeof(unsigned int));
+	g->wdist = arena_alloc(&g->arena, size * sizeof(unsigned int));
+	g->bfs_queue = arena_alloc(&g->arena, size * sizeof(unsigned int));
 
 	for (i = 0; i < size; i++)
 	{
-		room_t *r = &wumpus.rmemctx[i];
-		memset(r, '\0', sizeof(room_t));
+		room_t *r = &g->rmemctx[i];
 
 		r->id = i;
 
 		/* rooms have 3 exit points, exits are one-way */
-		for (j = 0; j < 3 && r->exits.count < 3; j++)
+		for (j = 0; j < ROOM_EXITS; j++)
 		{
-			int t = rand() % size;
+			unsigned int t;
 
-			/* make sure this isn't a tunnel to itself */
-			while (t == r->id)
+			/* no tunnels to itself, and no path twice */
+			do
 			{
-				mowgli_node_t *rn;
 				t = rand() % size;
 
-				/* also check that this path doesn't already exist. */
-				MOWGLI_ITER_FOREACH(rn, r->exits.head)
-				{
-					room_t *rm = (room_t *) rn->data;
-
-					if (rm->id == t)
-						t = r->id;
-				}
-			}
+				for (k = 0; k < j; k++)
+					if ((unsigned int) r->exits[k]->id == t)
+						break;
+			} while (t == i || k < j);
 
-			slog(LG_DEBUG, "wumpus: creating link for route %u -> %d", i, t);
-			mowgli_node_add(&wumpus.rmemctx[t], mowgli_node_create(), &r->exits);
+			r->exits[j] = &g->rmemctx[t];
+			g->rev_offsets[t + 1]++;
 		}
+	}
+
+	/* index the exits backwards, for the wumpus distance search */
+	for (i = 0; i < size; i++)
+		g->rev_offsets[i + 1] += g->rev_offsets[i];
+
+	for (i = 0; i < size; i++)
+	{
+		for (j = 0; j < ROOM_EXITS; j++)
+		{
+			unsigned int t = g->rmemctx[i].exits[j]->id;
 
-		slog(LG_DEBUG, "wumpus: finished creating exit paths for chamber %u", i);
+			/* wdist doubles as the fill cursor until the first search */
+			g->rev_exits[g->rev_offsets[t] + g->wdist[t]++] = i;
+		}
 	}
 
 	/* place the wumpus in the maze */
-	wumpus.wumpus = rand() % size;
-	w = &wumpus.rmemctx[wumpus.wumpus];
+	g->wumpus = rand() % size;
+	w = &g->rmemctx[g->wumpus];
 	w->contents = E_WUMPUS;
 
 	/* pits */
@@ -257,13 +376,7 @@ build_maze(unsigned int size)
 	{
 		/* 42 will do very nicely */
 		if (rand() % (42 * 2) == 0)
-		{
-			room_t *r = &wumpus.rmemctx[j];
-
-			r->contents = E_PIT;
-
-			slog(LG_DEBUG, "wumpus: added pit to chamber %u", j);
-		}
+			g->rmemctx[j].contents = E_PIT;
 	}
 
 	/* bats */
@@ -273,13 +386,7 @@ build_maze(unsigned int size)
 		{
 			/* 42 will do very nicely */
 			if (rand() % 42 == 0)
-			{
-				room_t *r = &wumpus.rmemctx[j];
-
-				r->contents = E_BATS;
-
-				slog(LG_DEBUG, "wumpus: added bats to chamber %u", j);
-			}
+				g->rmemctx[j].contents = E_BATS;
 		}
 	}
 
@@ -290,124 +397,128 @@ build_maze(unsigned int size)
 		{
 			/* 42 will do very nicely */
 			if (rand() % 42 == 0)
-			{
-				room_t *r = &wumpus.rmemctx[j];
-
-				r->contents = E_ARROWS;
-
-				slog(LG_DEBUG, "wumpus: added arrows to chamber %u", j);
-			}
+				g->rmemctx[j].contents = E_ARROWS;
 		}
 	}
 
 	/* find a place to put the crystal ball */
-	w = &wumpus.rmemctx[rand() % size];
+	w = &g->rmemctx[rand() % size];
 	w->contents = E_CRYSTALBALL;
 	slog(LG_DEBUG, "wumpus: added crystal ball to chamber %d", w->id);
 
-	/* ok, do some sanity checking */
-	for (j = 0; j < size; j++)
-		if (wumpus.rmemctx[j].exits.count < 3)
-		{
-			slog(LG_DEBUG, "wumpus: sanity checking failed");
-			return false;
-		}
+	update_wumpus_distances(g);
 
 	slog(LG_DEBUG, "wumpus: built maze");
 
 	return true;
 }
 
+/* sets up an empty game in a channel */
+static game_t *
+create_game(const char *chan)
+{
+	game_t *g = smalloc(sizeof(game_t));
+
+	memset(g, '\0', sizeof(game_t));
+	mowgli_strlcpy(g->chan, chan, sizeof g->chan);
+	g->wumpus = -1;
+
+	mowgli_patricia_add(games, g->chan, g);
+
+	/* the default channel is joined for as long as we are loaded */
+	if (irccasecmp(g->chan, wumpus_cfg.chan) && me.connected)
+	{
+		join(g->chan, wumpus_svs->me->nick);
+		g->joined = true;
+	}
+
+	return g;
+}
+
 /* init_game depends on these */
-static void move_wumpus(void *unused);
+static void move_wumpus_timer(void *arg);
 static void look_player(player_t *p);
-static void end_game(void);
+static void end_game(game_t *g);
 
 /* sets the game up */
 static void
-init_game(unsigned int size)
+init_game(game_t *g, unsigned int size)
 {
 	mowgli_node_t *n;
 
-	if (!build_maze(size))
+	if (!build_maze(g, size))
 	{
-		msg(wumpus_cfg.nick, wumpus_cfg.chan, "Maze generation failed, please try again.");
-		end_game();
+		msg(wumpus_cfg.nick, g->chan, "Maze generation failed, please try again.");
+		end_game(g);
 		return;
 	}
 
 	/* place players in random positions */
-	MOWGLI_ITER_FOREACH(n, wumpus.players.head)
+	MOWGLI_ITER_FOREACH(n, g->players.head)
 	{
 		player_t *p = (player_t *) n->data;
 
-		p->location = &wumpus.rmemctx[rand() % wumpus.mazesize];
-		mowgli_node_add(p, mowgli_node_create(), &p->location->players);
+		p->location = &g->rmemctx[rand() % g->mazesize];
+		mowgli_node_add(p, &p->rnode, &p->location->players);
 
 		look_player(p);
 	}
 
-	/* timer initialization */
-	wumpus.move_timer = mowgli_timer_add(base_eventloop, "move_wumpus", move_wumpus, NULL, 60);
+	g->running = true;
+	g->speed = 60;
+	g->wump_hp = 70;
 
-	msg(wumpus_cfg.nick, wumpus_cfg.chan, "The game has started!");
-
-	wumpus.running = true;
-	wumpus.speed = 60;
-	wumpus.wump_hp = 70;
+	/* timer initialization */
+	g->move_timer = mowgli_timer_add_once(base_eventloop, "move_wumpus", move_wumpus_timer, g, g->speed);
 
-	wumpus.start_game_timer = NULL;
+	msg(wumpus_cfg.nick, g->chan, "The game has started!");
 }
 
 /* starts the game */
 static void
-start_game(void *unused)
+start_game(void *arg)
 {
-	wumpus.starting = false;
+	game_t *g = arg;
+
+	g->start_game_timer = NULL;
+	g->starting = false;
 
-	if (wumpus.players.count < 2)
+	if (g->players.count < 2)
 	{
-		msg(wumpus_cfg.nick, wumpus_cfg.chan, "Not enough players to play. :(");
+		msg(wumpus_cfg.nick, g->chan, "Not enough players to play. :(");
+		end_game(g);
 		return;
 	}
 
-	if (wumpus.wantsize >= 300)
-		wumpus.wantsize = 300;
+	if (g->wantsize >= 300)
+		g->wantsize = 300;
 
-	init_game(wumpus.wantsize);
+	init_game(g, g->wantsize);
 }
 
-/* destroys game objects */
+/* destroys a game and everything in its arena */
 static void
-end_game(void)
+end_game(game_t *g)
 {
 	mowgli_node_t *n, *tn;
-	int i;
 
-	/* destroy players */
-	MOWGLI_ITER_FOREACH_SAFE(n, tn, wumpus.players.head)
-		resign_player((player_t *) n->data);
+	/* players only need to be detached from their users */
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, g->players.head)
+		privatedata_delete(((player_t *) n->data)->u, "wumpus:player");
 
-	/* free memory vector */
-	if (wumpus.rmemctx)
-	{
-		/* destroy links between rooms */
-		for (i = 0; i < wumpus.mazesize; i++)
-		{
-			room_t *r = &wumpus.rmemctx[i];
+	if (g->move_timer)
+		mowgli_timer_destroy(base_eventloop, g->move_timer);
 
-			MOWGLI_ITER_FOREACH_SAFE(n, tn, r->exits.head)
-				mowgli_node_delete(n, &r->exits);
-		}
-		sfree(wumpus.rmemctx);
-		wumpus.rmemctx = NULL;
-	}
+	if (g->start_game_timer)
+		mowgli_timer_destroy(base_eventloop, g->start_game_timer);
 
-	wumpus.wumpus = -1;
-	wumpus.running = false;
+	mowgli_patricia_delete(games, g->chan);
 
-	mowgli_timer_destroy(base_eventloop, wumpus.move_timer);
-	wumpus.move_timer = NULL;
+	if (g->joined)
+		part(g->chan, wumpus_svs->me->nick);
+
+	arena_destroy(&g->arena);
+	sfree(g);
 
 	/* game is now ended */
 }
@@ -416,27 +527,23 @@ end_game(void)
 static void
 look_player(player_t *p)
 {
-	mowgli_node_t *n;
+	unsigned int i;
 
 	return_if_fail(p != NULL);
 	return_if_fail(p->location != NULL);
 
 	notice(wumpus_cfg.nick, p->u->nick, "You are in room %d.", p->location->id);
 
-	MOWGLI_ITER_FOREACH(n, p->location->exits.head)
-	{
-		room_t *r = (room_t *) n->data;
-
-		notice(wumpus_cfg.nick, p->u->nick, "You can move to room %d.", r->id);
-	}
+	for (i = 0; i < ROOM_EXITS; i++)
+		notice(wumpus_cfg.nick, p->u->nick, "You can move to room %d.", p->location->exits[i]->id);
 
 	if (distance_to_wumpus(p))
 		notice(wumpus_cfg.nick, p->u->nick, "You smell a wumpus!");
 
 	/* provide warnings */
-	MOWGLI_ITER_FOREACH(n, p->location->exits.head)
+	for (i = 0; i < ROOM_EXITS; i++)
 	{
-		room_t *r = (room_t *) n->data;
+		room_t *r = p->location->exits[i];
 
 		if (r->contents == E_WUMPUS)
 			notice(wumpus_cfg.nick, p->u->nick, "You smell a wumpus!");
@@ -449,10 +556,14 @@ look_player(player_t *p)
 	}
 }
 
+/* move_wumpus depends on this */
+static bool move_wumpus(game_t *g);
+
 /* shoot and kill other players */
 static void
 shoot_player(player_t *p, int target_id)
 {
+	game_t *g = p->game;
 	room_t *r;
 	player_t *tp;
 	/* chance to hit; moved up here for convenience. */
@@ -476,7 +587,7 @@ shoot_player(player_t *p, int target_id)
 		return;
 	}
 
-	r = &wumpus.rmemctx[target_id];
+	r = &g->rmemctx[target_id];
 	tp = r->players.head ? r->players.head->data : NULL;
 
 	p->arrows--;
@@ -491,7 +602,7 @@ shoot_player(player_t *p, int target_id)
 	{
 		if ((hit < 2) && (tp->hp <= 10))
 		{
-			msg(wumpus_cfg.nick, wumpus_cfg.chan, "\2%s\2 has been killed by \2%s\2!",
+			msg(wumpus_cfg.nick, g->chan, "\2%s\2 has been killed by \2%s\2!",
 				tp->u->nick, p->u->nick);
 			resign_player(tp);
 		}
@@ -510,111 +621,115 @@ shoot_player(player_t *p, int target_id)
 	}
 	else if (r->contents == E_WUMPUS) /* Shootin' at the wumpus, we are... */
 	{
-		if (((wumpus.wump_hp > 0) && wumpus.wump_hp <= 5) && (hit < 2))
+		if (((g->wump_hp > 0) && g->wump_hp <= 5) && (hit < 2))
 			/* we killed the wumpus */
 		{
 			notice(wumpus_cfg.nick, p->u->nick, "You have killed the wumpus!");
-			msg(wumpus_cfg.nick, wumpus_cfg.chan, "The wumpus was killed by \2%s\2.",
+			msg(wumpus_cfg.nick, g->chan, "The wumpus was killed by \2%s\2.",
 				p->u->nick);
-			msg(wumpus_cfg.nick, wumpus_cfg.chan,
+			msg(wumpus_cfg.nick, g->chan,
 				"%s has won the game! Congratulations!", p->u->nick);
-			end_game();
+			end_game(g);
 		}
-		else if ((wumpus.wump_hp > 5) && (hit < 2))
+		else if ((g->wump_hp > 5) && (hit < 2))
 		{
 			notice(wumpus_cfg.nick, p->u->nick,
 				"You shoot the Wumpus, but he shrugs it off and seems angrier!");
 
-			wumpus.wump_hp -= 5;
-			wumpus.speed -= 3;
+			g->wump_hp -= 5;
+			g->speed -= 3;
 
-			move_wumpus(NULL);
+			/* the game may have ended, taking g with it */
+			if (!move_wumpus(g))
+				return;
 
-			mowgli_timer_destroy(base_eventloop, wumpus.move_timer);
-			wumpus.move_timer = mowgli_timer_add(base_eventloop, "move_wumpus", move_wumpus, NULL, wumpus.speed);
+			if (g->move_timer)
+				mowgli_timer_destroy(base_eventloop, g->move_timer);
+			g->move_timer = mowgli_timer_add_once(base_eventloop, "move_wumpus", move_wumpus_timer, g, g->speed);
 		}
 		else
 		{
 			notice(wumpus_cfg.nick, p->u->nick, "You miss what you were shooting at.");
-			move_wumpus(NULL);
+			move_wumpus(g);
 		}
 	}
 }
 
 /* move_wumpus depends on this */
-static void regen_obj(contents_t);
+static void regen_obj(game_t *g, contents_t);
 
-/* check for last-man-standing win condition. */
-static void
-check_last_person_alive(void)
+/* check for last-man-standing win condition, returns true if the game was ended */
+static bool
+check_last_person_alive(game_t *g)
 {
-	if (wumpus.players.count == 1)
+	if (g->players.count == 1)
 	{
-		player_t *p = (player_t *) wumpus.players.head->data;
+		player_t *p = (player_t *) g->players.head->data;
 
-		msg(wumpus_cfg.nick, wumpus_cfg.chan, "%s won the game! Congratulations!", p->u->nick);
+		msg(wumpus_cfg.nick, g->chan, "%s won the game! Congratulations!", p->u->nick);
 
-		end_game();
+		end_game(g);
+		return true;
 	}
-	else if (wumpus.players.count == 0)
+	else if (g->players.count == 0)
 	{
-		msg(wumpus_cfg.nick, wumpus_cfg.chan, "Everyone lost. Sucks. :(");
-		end_game();
+		msg(wumpus_cfg.nick, g->chan, "Everyone lost. Sucks. :(");
+		end_game(g);
+		return true;
 	}
+
+	return false;
 }
 
-/* move the wumpus, the wumpus moves every 60 seconds */
-static void
-move_wumpus(void *unused)
+/* move the wumpus, returns false if this ended the game */
+static bool
+move_wumpus(game_t *g)
 {
 	mowgli_node_t *n, *tn;
 	room_t *r, *tr;
 	int w_kills = 0;
 
 	/* can we do any of this? if this is null, we really shouldn't be here */
-	if (wumpus.rmemctx == NULL)
+	if (g->rmemctx == NULL)
 	{
 		slog(LG_DEBUG, "wumpus: move_wumpus() called while game not running!");
-		mowgli_timer_destroy(base_eventloop, wumpus.move_timer);
-		return;
+		return false;
 	}
 
-	msg(wumpus_cfg.nick, wumpus_cfg.chan, "You hear footsteps...");
+	msg(wumpus_cfg.nick, g->chan, "You hear footsteps...");
 
 	/* start moving */
-	r = &wumpus.rmemctx[wumpus.wumpus]; /* memslice describing the wumpus's current location */
+	r = &g->rmemctx[g->wumpus]; /* memslice describing the wumpus's current location */
 
-	regen_obj(r->contents);
+	regen_obj(g, r->contents);
 	r->contents = E_NOTHING;
 
-	tr = mowgli_node_nth_data(&r->exits, rand() % MOWGLI_LIST_LENGTH(&r->exits));
+	tr = r->exits[rand() % ROOM_EXITS];
 
 #ifdef DEBUG_AI
-	msg(wumpus_cfg.nick, wumpus_cfg.chan, "I moved to chamber %d", tr->id);
+	msg(wumpus_cfg.nick, g->chan, "I moved to chamber %d", tr->id);
 #endif
 
-	slog(LG_DEBUG, "wumpus: the wumpus is now in room %d! (was in %d)",
-	     tr->id, wumpus.wumpus);
-	wumpus.wumpus = tr->id;
+	slog(LG_DEBUG, "wumpus: the wumpus in %s is now in room %d! (was in %d)",
+	     g->chan, tr->id, g->wumpus);
+	g->wumpus = tr->id;
 	tr->contents = E_WUMPUS;
 
-#ifdef DEBUG_AI
-	msg(wumpus_cfg.nick, wumpus_cfg.chan, "On my next turn, I can move to:");
-	r = &wumpus.rmemctx[wumpus.wumpus];
+	update_wumpus_distances(g);
 
-	MOWGLI_ITER_FOREACH(n, r->exits.head)
-	{
-		room_t *tr = (room_t *) n->data;
+#ifdef DEBUG_AI
+	msg(wumpus_cfg.nick, g->chan, "On my next turn, I can move to:");
+	r = &g->rmemctx[g->wumpus];
 
-		msg(wumpus_cfg.nick, wumpus_cfg.chan, "- %d", tr->id);
-	}
+	for (unsigned int i = 0; i < ROOM_EXITS; i++)
+		msg(wumpus_cfg.nick, g->chan, "- %d", r->exits[i]->id);
 #endif
 
-	MOWGLI_ITER_FOREACH_SAFE(n, tn, wumpus.players.head)
+	MOWGLI_ITER_FOREACH_SAFE(n, tn, g->players.head)
 	{
 		player_t *p = (player_t *) n->data;
 
-		if (wumpus.wumpus == p->location->id)
+		if (g->wumpus == p->location->id)
 		{
 			notice(wumpus_cfg.nick, p->u->nick, "The wumpus has joined your room and eaten you. Sorry.");
 			w_kills++;
@@ -631,23 +746,36 @@ move_wumpus(void *unused)
 
 	/* report any wumpus kills */
 	if (w_kills)
-		msg(wumpus_cfg.nick, wumpus_cfg.chan, "You hear the screams of %d surprised adventurer%s.", w_kills,
+		msg(wumpus_cfg.nick, g->chan, "You hear the screams of %d surprised adventurer%s.", w_kills,
 			w_kills != 1 ? "s" : "");
 
-	check_last_person_alive();
+	return !check_last_person_alive(g);
+}
+
+/* the wumpus moves every 60 seconds, and faster as it gets angrier */
+static void
+move_wumpus_timer(void *arg)
+{
+	game_t *g = arg;
+
+	g->move_timer = NULL;
+
+	if (move_wumpus(g))
+		g->move_timer = mowgli_timer_add_once(base_eventloop, "move_wumpus", move_wumpus_timer, g, g->speed);
 }
 
 /* regenerates objects */
 static void
-regen_obj(contents_t obj)
+regen_obj(game_t *g, contents_t obj)
 {
-	wumpus.rmemctx[rand() % wumpus.mazesize].contents = obj;
+	g->rmemctx[rand() % g->mazesize].contents = obj;
 }
 
 /* handles movement requests from players */
 static void
 move_player(player_t *p, int id)
 {
+	game_t *g = p->game;
 	mowgli_node_t *n;
 
 	if (adjacent_room(p, id) == false)
@@ -657,17 +785,17 @@ move_player(player_t *p, int id)
 	}
 
 	/* What about bats? We check for this first because yeah... */
-	if (wumpus.rmemctx[id].contents == E_BATS)
+	if (g->rmemctx[id].contents == E_BATS)
 	{
-		int target_id = rand() % wumpus.mazesize;
+		int target_id = rand() % g->mazesize;
 
 		notice(wumpus_cfg.nick, p->u->nick, "Bats have picked you up and taken you to room %d.",
 			target_id);
-		msg(wumpus_cfg.nick, wumpus_cfg.chan, "You hear a surprised yell.");
+		msg(wumpus_cfg.nick, g->chan, "You hear a surprised yell.");
 
 		/* move the bats */
-		wumpus.rmemctx[id].contents = E_NOTHING;
-		wumpus.rmemctx[target_id].contents = E_BATS;
+		g->rmemctx[id].contents = E_NOTHING;
+		g->rmemctx[target_id].contents = E_BATS;
 
 		id = target_id;
 
@@ -675,31 +803,31 @@ move_player(player_t *p, int id)
 	}
 
 	/* Is the wumpus in here? */
-	if (wumpus.wumpus == id)
+	if (g->wumpus == id)
 	{
 		notice(wumpus_cfg.nick, p->u->nick, "You see the wumpus approaching you. You scream for help, but it is too late.");
-		msg(wumpus_cfg.nick, wumpus_cfg.chan, "You hear a blood-curdling scream.");
+		msg(wumpus_cfg.nick, g->chan, "You hear a blood-curdling scream.");
 
 		/* player_t *p has been killed by the wumpus, remove him from the game */
 		resign_player(p);
-		check_last_person_alive();
+		check_last_person_alive(g);
 		return;
 	}
 
 	/* What about a pit? */
-	if (wumpus.rmemctx[id].contents == E_PIT)
+	if (g->rmemctx[id].contents == E_PIT)
 	{
 		notice(wumpus_cfg.nick, p->u->nick, "You have fallen into a bottomless pit. Sorry.");
-		msg(wumpus_cfg.nick, wumpus_cfg.chan, "You hear a faint wail, which gets fainter and fainter.");
+		msg(wumpus_cfg.nick, g->chan, "You hear a faint wail, which gets fainter and fainter.");
 
 		/* player_t *p has fallen down a hole, remove him from the game */
 		resign_player(p);
-		check_last_person_alive();
+		check_last_person_alive(g);
 		return;
 	}
 
 	/* and arrows? */
-	if (wumpus.rmemctx[id].contents == E_ARROWS)
+	if (g->rmemctx[id].contents == E_ARROWS)
 	{
 		if (p->arrows == 0)
 		{
@@ -710,29 +838,27 @@ move_player(player_t *p, int id)
 			notice(wumpus_cfg.nick, p->u->nick, "You found some arrows. You don't have any room to take them however, "
 						"so you break them in half and continue on your way.");
 
-		wumpus.rmemctx[id].contents = E_NOTHING;
+		g->rmemctx[id].contents = E_NOTHING;
 
-		regen_obj(E_ARROWS);
+		regen_obj(g, E_ARROWS);
 	}
 
 	/* crystal ball */
-	if (wumpus.rmemctx[id].contents == E_CRYSTALBALL)
+	if (g->rmemctx[id].contents == E_CRYSTALBALL)
 	{
 		notice(wumpus_cfg.nick, p->u->nick, "You find a strange pulsating crystal ball. You examine it, and it shows room %d with the wumpus in it.",
-			wumpus.wumpus);
+			g->wumpus);
 		notice(wumpus_cfg.nick, p->u->nick, "The crystal ball then vanishes into the miasma.");
 
-		wumpus.rmemctx[id].contents = E_NOTHING;
-		wumpus.rmemctx[rand() % wumpus.mazesize].contents = E_CRYSTALBALL;
+		g->rmemctx[id].contents = E_NOTHING;
+		g->rmemctx[rand() % g->mazesize].contents = E_CRYSTALBALL;
 	}
 
-	/* we recycle the mowgli_node_t here for speed */
-	n = mowgli_node_find(p, &p->location->players);
-	mowgli_node_delete(n, &p->location->players);
-	mowgli_node_free(n);
+	/* the player's room node is embedded, so moving allocates nothing */
+	mowgli_node_delete(&p->rnode, &p->location->players);
 
-	p->location = &wumpus.rmemctx[id];
-	mowgli_node_add(p, mowgli_node_create(), &p->location->players);
+	p->location = &g->rmemctx[id];
+	mowgli_node_add(p, &p->rnode, &p->location->players);
 
 	/* provide player with information, including their new location */
 	look_player(p);
@@ -757,42 +883,83 @@ move_player(player_t *p, int id)
 
 /* ------------------------------ -*-atheme-*- code */
 
+/* commands addressing a game take an optional leading channel */
+static const char *
+game_channel(int parc, char *parv[])
+{
+	if (parc > 0 && parv[0] != NULL && *parv[0] == '#')
+		return parv[0];
+
+	return wumpus_cfg.chan;
+}
+
 static void
 cmd_start(sourceinfo_t *si, int parc, char *parv[])
 {
-	if (wumpus.running || wumpus.starting)
+	const char *chan = game_channel(parc, parv);
+	const char *size = chan == parv[0] ? (parc > 1 ? parv[1] : NULL) : parv[0];
+	game_t *g;
+
+	if (find_game(chan) != NULL)
 	{
 		notice(wumpus_cfg.nick, si->su->nick, "A game is already in progress. Sorry.");
 		return;
 	}
 
-	msg(wumpus_cfg.nick, wumpus_cfg.chan, "\2%s\2 has started the game! Use \2/msg Wumpus JOIN\2 to play! You have\2 60 seconds\2.",
-		si->su->nick);
+	if (mowgli_patricia_size(games) >= WUMPUS_MAX_GAMES)
+	{
+		notice(wumpus_cfg.nick, si->su->nick, "Too many games are in progress. Sorry.");
+		return;
+	}
 
-	wumpus.starting = true;
-	wumpus.wantsize = 100;
+	if (strlen(chan) > CHANNELLEN)
+	{
+		notice(wumpus_cfg.nick, si->su->nick, "\2%s\2 is not a valid channel name.", chan);
+		return;
+	}
 
-	if (parv[0])
-		wumpus.wantsize = atoi(parv[0]);
+	/* games outside the default channel are started from inside the channel */
+	if (irccasecmp(chan, wumpus_cfg.chan))
+	{
+		channel_t *c = channel_find(chan);
+
+		if (c == NULL || chanuser_find(c, si->su) == NULL)
+		{
+			notice(wumpus_cfg.nick, si->su->nick, "You must be in \2%s\2 to start a game there.", chan);
+			return;
+		}
+	}
+
+	g = create_game(chan);
+
+	msg(wumpus_cfg.nick, g->chan, "\2%s\2 has started the game! Use \2/msg Wumpus JOIN %s\2 to play! You have\2 60 seconds\2.",
+		si->su->nick, g->chan);
 
-	wumpus.start_game_timer = mowgli_timer_add_once(base_eventloop, "start_game", start_game, NULL, 60);
+	g->starting = true;
+	g->wantsize = 100;
+
+	if (size)
+		g->wantsize = atoi(size);
+
+	g->start_game_timer = mowgli_timer_add_once(base_eventloop, "start_game", start_game, g, 60);
 }
 
 static void
 cmd_join(sourceinfo_t *si, int parc, char *parv[])
 {
+	game_t *g = find_game(game_channel(parc, parv));
 	player_t *p;
 
-	if (!wumpus.starting || wumpus.running)
+	if (g == NULL || !g->starting || g->running)
 	{
 		notice(wumpus_cfg.nick, si->su->nick, "You cannot use this command right now. Sorry.");
 		return;
 	}
 
-	p = create_player(si->su);
+	p = create_player(g, si->su);
 
 	if (p)
-		msg(wumpus_cfg.nick, wumpus_cfg.chan, "\2%s\2 has joined the game!", si->su->nick);
+		msg(wumpus_cfg.nick, g->chan, "\2%s\2 has joined the game!", si->su->nick);
 }
 
 static void
@@ -806,7 +973,7 @@ cmd_look(sourceinfo_t *si, int parc, char *parv[])
 		return;
 	}
 
-	if (!wumpus.running)
+	if (!p->game->running)
 	{
 		notice(wumpus_cfg.nick, si->su->nick, "You cannot use this command right now. Sorry.");
 		return;
@@ -833,7 +1000,7 @@ cmd_move(sourceinfo_t *si, int parc, char *parv[])
 		return;
 	}
 
-	if (!wumpus.running)
+	if (!p->game->running)
 	{
 		notice(wumpus_cfg.nick, si->su->nick, "The game must be running in order to use this command.");
 		return;
@@ -860,7 +1027,7 @@ cmd_shoot(sourceinfo_t *si, int parc, char *parv[])
 		return;
 	}
 
-	if (!wumpus.running)
+	if (!p->game->running)
 	{
 		notice(wumpus_cfg.nick, si->su->nick, "The game must be running in order to use this command.");
 		return;
@@ -880,13 +1047,13 @@ cmd_resign(sourceinfo_t *si, int parc, char *parv[])
 		return;
 	}
 
-	if (!wumpus.running)
+	if (!p->game->running)
 	{
 		notice(wumpus_cfg.nick, si->su->nick, "The game must be running in order to use this command.");
 		return;
 	}
 
-	msg(wumpus_cfg.nick, wumpus_cfg.chan, "\2%s\2 has quit the game!", p->u->nick);
+	msg(wumpus_cfg.nick, p->game->chan, "\2%s\2 has quit the game!", p->u->nick);
 
 	resign_player(p);
 }
@@ -894,14 +1061,13 @@ cmd_resign(sourceinfo_t *si, int parc, char *parv[])
 static void
 cmd_reset(sourceinfo_t *si, int parc, char *parv[])
 {
-	if (wumpus.running)
-	{
-		msg(wumpus_cfg.nick, wumpus_cfg.chan, "\2%s\2 has ended the game.", si->su->nick);
+	game_t *g = find_game(game_channel(parc, parv));
 
-		end_game();
+	if (g != NULL && g->running)
+	{
+		msg(wumpus_cfg.nick, g->chan, "\2%s\2 has ended the game.", si->su->nick);
 
-		wumpus.running = false;
-		wumpus.starting = false;
+		end_game(g);
 	}
 }
 
@@ -914,11 +1080,19 @@ cmd_help(sourceinfo_t *si, int parc, char *parv[])
 static void
 cmd_who(sourceinfo_t *si, int parc, char *parv[])
 {
+	const char *chan = game_channel(parc, parv);
+	game_t *g = find_game(chan);
 	mowgli_node_t *n;
 
+	if (g == NULL)
+	{
+		notice(wumpus_cfg.nick, si->su->nick, "No game is being played in \2%s\2.", chan);
+		return;
+	}
+
 	notice(wumpus_cfg.nick, si->su->nick, "The following people are playing:");
 
-	MOWGLI_ITER_FOREACH(n, wumpus.players.head)
+	MOWGLI_ITER_FOREACH(n, g->players.head)
 	{
 		player_t *p = (player_t *) n->data;
 
@@ -926,6 +1100,62 @@ cmd_who(sourceinfo_t *si, int parc, char *parv[])
 	}
 }
 
+static double
+elapsed_msec(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_nsec - from->tv_nsec) / 1000000.0;
+}
+
+/* times maze generation and wumpus distance searches on scratch mazes */
+static void
+cmd_bench(sourceinfo_t *si, int parc, char *parv[])
+{
+	game_t g;
+	struct timespec start, built, searched;
+	double build_ms = 0, search_ms = 0;
+	unsigned int size = 50000, rounds = 10, i, j;
+
+	if (parv[0])
+		size = atoi(parv[0]);
+	if (parc > 1 && parv[1])
+		rounds = atoi(parv[1]);
+
+	if (size < 10 || size > BENCH_MAX_ROOMS || rounds < 1 || rounds > 100 ||
+	    (unsigned long) size * rounds > BENCH_MAX_ROOM_ROUNDS)
+	{
+		notice(wumpus_cfg.nick, si->su->nick, "Syntax: BENCH [10-%u rooms] [1-100 rounds], at most %u rooms x rounds",
+			BENCH_MAX_ROOMS, BENCH_MAX_ROOM_ROUNDS);
+		return;
+	}
+
+	for (i = 0; i < rounds; i++)
+	{
+		memset(&g, '\0', sizeof g);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		build_maze(&g, size);
+		clock_gettime(CLOCK_MONOTONIC, &built);
+
+		/* the same work as 100 wumpus moves */
+		for (j = 0; j < 100; j++)
+		{
+			g.wumpus = rand() % size;
+			update_wumpus_distances(&g);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &searched);
+
+		build_ms += elapsed_msec(&start, &built);
+		search_ms += elapsed_msec(&built, &searched) / 100;
+
+		arena_destroy(&g.arena);
+	}
+
+	notice(wumpus_cfg.nick, si->su->nick, "Built %u mazes of %u rooms: %.3f ms per maze, %.3f ms per wumpus move.",
+		rounds, size, build_ms / rounds, search_ms / rounds);
+
+	logcommand(si, CMDLOG_ADMIN, "BENCH: \2%u\2 rooms, \2%u\2 rounds", size, rounds);
+}
+
 /* removes quitting players */
 static void
 user_deleted(user_t *u)
@@ -934,7 +1164,7 @@ user_deleted(user_t *u)
 
 	if ((p = find_player(u)) != NULL)
 	{
-		msg(wumpus_cfg.nick, wumpus_cfg.chan, "\2%s\2 has quit the game!", p->u->nick);
+		msg(wumpus_cfg.nick, p->game->chan, "\2%s\2 has quit the game!", p->u->nick);
 		resign_player(p);
 	}
 }
@@ -942,7 +1172,7 @@ user_deleted(user_t *u)
 static void
 join_wumpus_channel(server_t *s)
 {
-	join(wumpus_cfg.chan, wumpus.svs->me->nick);
+	join(wumpus_cfg.chan, wumpus_svs->me->nick);
 
 	hook_del_server_eob(join_wumpus_channel);
 }
@@ -951,7 +1181,7 @@ static command_t wumpus_start = {
 	.name           = "START",
 	.desc           = N_("Starts the game."),
 	.access         = AC_NONE,
-	.maxparc        = 1,
+	.maxparc        = 2,
 	.cmd            = &cmd_start,
 	.help           = { .path = "" },
 };
@@ -960,7 +1190,7 @@ static command_t wumpus_join = {
 	.name           = "JOIN",
 	.desc           = N_("Joins the game."),
 	.access         = AC_NONE,
-	.maxparc        = 0,
+	.maxparc        = 1,
 	.cmd            = &cmd_join,
 	.help           = { .path = "" },
 };
@@ -1005,11 +1235,20 @@ static command_t wumpus_reset = {
 	.name           = "RESET",
 	.desc           = N_("Resets the game."),
 	.access         = AC_IRCOP,
-	.maxparc        = 0,
+	.maxparc        = 1,
 	.cmd            = &cmd_reset,
 	.help           = { .path = "" },
 };
 
+static command_t wumpus_bench = {
+	.name           = "BENCH",
+	.desc           = N_("Benchmarks maze generation."),
+	.access         = PRIV_ADMIN,
+	.maxparc        = 2,
+	.cmd            = &cmd_bench,
+	.help           = { .path = "" },
+};
+
 static command_t wumpus_help = {
 	.name           = "HELP",
 	.desc           = N_("Displays this command listing."),
@@ -1023,7 +1262,7 @@ static command_t wumpus_who = {
 	.name           = "WHO",
 	.desc           = N_("Displays who is playing the game."),
 	.access         = AC_NONE,
-	.maxparc        = 0,
+	.maxparc        = 1,
 	.cmd            = &cmd_who,
 	.help           = { .path = "" },
 };
@@ -1032,8 +1271,10 @@ static command_t wumpus_who = {
 static void
 mod_init(module_t *m)
 {
-	wumpus.svs = service_add("Wumpus", NULL);
-	service_set_chanmsg(wumpus.svs, false);
+	games = mowgli_patricia_create(irccasecanon);
+
+	wumpus_svs = service_add("Wumpus", NULL);
+	service_set_chanmsg(wumpus_svs, false);
 
 	if (cold_start)
 	{
@@ -1041,48 +1282,49 @@ mod_init(module_t *m)
 		hook_add_server_eob(join_wumpus_channel);
 	}
 	else if (me.connected)
-		join(wumpus_cfg.chan, wumpus.svs->me->nick);
+		join(wumpus_cfg.chan, wumpus_svs->me->nick);
 
 	hook_add_event("user_delete");
 	hook_add_user_delete(user_deleted);
 
-	service_bind_command(wumpus.svs, &wumpus_help);
-	service_bind_command(wumpus.svs, &wumpus_start);
-	service_bind_command(wumpus.svs, &wumpus_join);
-	service_bind_command(wumpus.svs, &wumpus_move);
-	service_bind_command(wumpus.svs, &wumpus_shoot);
-	service_bind_command(wumpus.svs, &wumpus_resign);
-	service_bind_command(wumpus.svs, &wumpus_reset);
-	service_bind_command(wumpus.svs, &wumpus_who);
-	service_bind_command(wumpus.svs, &wumpus_look);
+	service_bind_command(wumpus_svs, &wumpus_help);
+	service_bind_command(wumpus_svs, &wumpus_start);
+	service_bind_command(wumpus_svs, &wumpus_join);
+	service_bind_command(wumpus_svs, &wumpus_move);
+	service_bind_command(wumpus_svs, &wumpus_shoot);
+	service_bind_command(wumpus_svs, &wumpus_resign);
+	service_bind_command(wumpus_svs, &wumpus_reset);
+	service_bind_command(wumpus_svs, &wumpus_who);
+	service_bind_command(wumpus_svs, &wumpus_look);
+	service_bind_command(wumpus_svs, &wumpus_bench);
 }
 
 static void
 mod_deinit(module_unload_intent_t intent)
 {
+	mowgli_patricia_iteration_state_t state;
+	game_t *g;
+
 	/* cleanup after ourselves if necessary */
-	if (wumpus.running)
-		end_game();
+	MOWGLI_PATRICIA_FOREACH(g, &state, games)
+		end_game(g);
+
+	mowgli_patricia_destroy(games, NULL, NULL);
 
-	service_delete(wumpus.svs);
+	service_delete(wumpus_svs);
 
 	hook_del_user_delete(user_deleted);
 
-	service_unbind_command(wumpus.svs, &wumpus_help);
-	service_unbind_command(wumpus.svs, &wumpus_start);
-	service_unbind_command(wumpus.svs, &wumpus_join);
-	service_unbind_command(wumpus.svs, &wumpus_move);
-	service_unbind_command(wumpus.svs, &wumpus_shoot);
-	service_unbind_command(wumpus.svs, &wumpus_resign);
-	service_unbind_command(wumpus.svs, &wumpus_reset);
-	service_unbind_command(wumpus.svs, &wumpus_who);
-	service_unbind_command(wumpus.svs, &wumpus_look);
-
-	if (wumpus.move_timer)
-		mowgli_timer_destroy(base_eventloop, wumpus.move_timer);
-
-	if (wumpus.start_game_timer)
-		mowgli_timer_destroy(base_eventloop, wumpus.start_game_timer);
+	service_unbind_command(wumpus_svs, &wumpus_help);
+	service_unbind_command(wumpus_svs, &wumpus_start);
+	service_unbind_command(wumpus_svs, &wumpus_join);
+	service_unbind_command(wumpus_svs, &wumpus_move);
+	service_unbind_command(wumpus_svs, &wumpus_shoot);
+	service_unbind_command(wumpus_svs, &wumpus_resign);
+	service_unbind_command(wumpus_svs, &wumpus_reset);
+	service_unbind_command(wumpus_svs, &wumpus_who);
+	service_unbind_command(wumpus_svs, &wumpus_look);
+	service_unbind_command(wumpus_svs, &wumpus_bench);
 }
 
 VENDOR_DECLARE_MODULE_V1("contrib/wumpus", MODULE_UNLOAD_CAPABILITY_OK, CONTRIB_VENDOR_NENOLOD)